@@ -2,7 +2,9 @@
  * This example illustrates how to toggle the relay of multiple Orvibo WiWo S20 devices
  *
  * The example will setup a soft AP with SSID "ORVIBO" and wait for two S20 device to connect.
- * When connected it will toggle the relay each 10 sec.
+ * When connected it will toggle the relays each 10 sec, the two plugs are always set to
+ * opposite states. The plugs are put in a scene so both relays are switched at the same
+ * time and a single callback reports when both plugs have confirmed the new state.
  *
  * Note: This example expects the S20 devices to be "paired" with the SSID "ORVIBO" using
  *       WPA2/AES with passkey "WIWO_S20". Simplest way to do this is to use the included
@@ -11,6 +13,7 @@
 #include <ESP8266WiFi.h>
 
 #include "OrviboS20.h"
+#include "OrviboS20Group.h"
 
 const char *ssid = "ORVIBO";
 const char *password = "WIWO_S20";
@@ -24,6 +27,8 @@ OrviboS20Device s20_2("Plug2");
 //   OrviboS20Device s20_1(mac1, "Plug1");
 //   OrviboS20Device s20_2(mac2, "Plug2");
 
+OrviboS20Scene plugs;
+
 void onS20Connect(OrviboS20Device &device)
 {
   Serial.printf("S20 device \"%s\" connected\n", device.getName());
@@ -88,8 +93,12 @@ void loop()
 
     // Get last known relay state for first device
     bool state = s20_1.getState();
-    // Set relays
-    s20_1.setState(!state);
-    s20_2.setState(state);
+    // Set relays, both at once
+    plugs.clear();
+    plugs.add(s20_1, !state);
+    plugs.add(s20_2, state);
+    plugs.apply([](OrviboS20Scene &scene, uint8_t succeeded, uint8_t failed, uint32_t settle_us) {
+      Serial.printf("Scene applied: %d ok, %d failed, settled in %u us\n", succeeded, failed, settle_us);
+    });
   }
 }
@@ -0,0 +1,172 @@
+/*
+ * Measures the throughput (packets/sec) of the receive path for a mix of valid and
+ * invalid frames:
+ *   decode   - OrviboS20Decoder::decode() only
+ *   dispatch - decode + handler table lookup
+ *   handle   - full OrviboS20.handle() path through an in-memory transport
+ */
+// Build:
+//   g++ -O2 -std=c++11 -I../../../src -I../common ../../../src/*.cpp DecoderBenchmark.cpp -o decoder_bench
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <vector>
+
+#include "OrviboS20.h"
+#include "OrviboS20MemoryTransport.h"
+
+static const int PACKET_COUNT = 1000000;
+static const int DEVICE_COUNT = 100;
+
+struct Packet
+{
+    uint8_t data[64];
+    size_t length;
+};
+
+/* Stand-in for OrviboS20Device with a handler table of the same shape */
+struct Sink
+{
+    uint32_t state_changes = 0;
+    uint32_t discovers = 0;
+
+    void onStateChange(const OrviboS20Frame &frame)
+    {
+        state_changes += frame.state() > 0;
+    }
+
+    void onDiscover(const OrviboS20Frame &frame)
+    {
+        discovers += frame.payload_length;
+    }
+};
+
+static constexpr OrviboS20FrameHandler<Sink> SINK_HANDLERS[] = {
+    {CMD_STATE_CHANGE, &Sink::onStateChange},
+    {CMD_DISCOVER, &Sink::onDiscover},
+};
+
+static double nowNs()
+{
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void makePacket(std::mt19937 &rng, Packet &packet)
+{
+    uint8_t *frame = packet.data;
+    uint32_t kind = rng() % 10;
+    uint8_t id = rng() % DEVICE_COUNT;
+
+    frame[0] = 0x68;
+    frame[1] = 0x64;
+    frame[6] = 0xAC;
+    frame[7] = 0xCF;
+    frame[8] = 0x23;
+    frame[9] = 0;
+    frame[10] = 0;
+    frame[11] = id;
+    memset(&frame[12], 0x20, 6);
+    if (kind < 7)
+    {
+        // State change (the common case)
+        packet.length = ORVIBO_HEADER_LEN + ORVIBO_STATE_PAYLOAD_LEN;
+        frame[4] = CMD_STATE_CHANGE >> 8;
+        frame[5] = CMD_STATE_CHANGE & 0xFF;
+        memset(&frame[18], 0, 4);
+        frame[22] = rng() & 1;
+    }
+    else if (kind < 8)
+    {
+        // Discover reply, MAC shifted one byte
+        packet.length = 42;
+        frame[4] = CMD_DISCOVER >> 8;
+        frame[5] = CMD_DISCOVER & 0xFF;
+        memmove(&frame[7], &frame[6], 6);
+        memset(&frame[19], 0, packet.length - 19);
+    }
+    else if (kind < 9)
+    {
+        // Bad magic
+        packet.length = 23;
+        frame[0] = 0;
+    }
+    else
+    {
+        // Length field mismatch
+        packet.length = 22;
+    }
+    frame[2] = 0;
+    frame[3] = (kind == 9) ? 23 : packet.length;
+}
+
+int main()
+{
+    std::mt19937 rng(1);
+    std::vector<Packet> packets(PACKET_COUNT);
+    for (auto &packet : packets)
+    {
+        makePacket(rng, packet);
+    }
+
+    printf("%10s %14s %10s\n", "stage", "packets/sec", "ns/pkt");
+
+    // Decode only
+    volatile size_t valid = 0;
+    double start = nowNs();
+    for (const auto &packet : packets)
+    {
+        OrviboS20Frame frame;
+        if (OrviboS20Decoder::decode(packet.data, packet.length, frame) == DECODE_OK)
+        {
+            valid = valid + 1;
+        }
+    }
+    double ns = (nowNs() - start) / PACKET_COUNT;
+    printf("%10s %14.0f %10.1f\n", "decode", 1e9 / ns, ns);
+
+    // Decode and dispatch
+    Sink sink;
+    start = nowNs();
+    for (const auto &packet : packets)
+    {
+        OrviboS20Frame frame;
+        if (OrviboS20Decoder::decode(packet.data, packet.length, frame) == DECODE_OK)
+        {
+            OrviboS20Decoder::dispatch(SINK_HANDLERS, sink, frame);
+        }
+    }
+    ns = (nowNs() - start) / PACKET_COUNT;
+    printf("%10s %14.0f %10.1f\n", "dispatch", 1e9 / ns, ns);
+
+    // Full receive path
+    OrviboS20MemoryTransport transport;
+    OrviboS20.setTransport(&transport);
+    OrviboS20.onFoundDevice([](uint8_t *mac) { (void)mac; });
+    OrviboS20.setRxBudget(0xFFFF, 0);
+    OrviboS20.begin();
+    std::vector<OrviboS20Device *> devices;
+    for (int i = 0; i < DEVICE_COUNT; i++)
+    {
+        uint8_t mac[6] = {0xAC, 0xCF, 0x23, 0, 0, (uint8_t)i};
+        devices.push_back(new OrviboS20Device(mac));
+    }
+    for (const auto &packet : packets)
+    {
+        transport.inject(packet.data, packet.length);
+    }
+    start = nowNs();
+    while (transport.pending() > 0)
+    {
+        OrviboS20.handle();
+    }
+    ns = (nowNs() - start) / PACKET_COUNT;
+    printf("%10s %14.0f %10.1f\n", "handle", 1e9 / ns, ns);
+
+    printf("\nvalid %zu/%d, state changes %u\n", (size_t)valid, PACKET_COUNT, sink.state_changes);
+
+    for (OrviboS20Device *dev : devices)
+    {
+        delete dev;
+    }
+    return 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * Time-to-full-fleet benchmark for the active discovery sweep
+ *
+ * OrviboS20 runs on 127.0.0.1 and OrviboS20FleetEmulator emulates the devices on
+ * 127.0.0.2. Half of the devices are created with their MAC and half as "any MAC"
+ * placeholders. Nothing is announced by the emulator, so without the sweep no device
+ * would be bound until it happens to send something. Reported per fleet size and loss:
+ * devices bound, discovery requests sent and the time until all devices were bound.
+ * All devices answer a broadcast request at once, so the sizes are kept to what fits in a
+ * broadcast domain (a /24 has 254 addresses) plus one larger network.
+ *
+ * Usage: discovery_bench [jitter ms]   (default 20, spread of the replies to a broadcast)
+ */
+// Build:
+//   g++ -O2 -std=c++11 -pthread -I../../../src -I../common ../../../src/*.cpp DiscoveryBenchmark.cpp -o discovery_bench
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "OrviboS20.h"
+#include "OrviboS20FleetEmulator.h"
+#include "OrviboS20PosixTransport.h"
+
+static const uint8_t ROUNDS = 5;
+static const uint16_t INTERVAL_MS = 500;
+static const uint16_t BATCH = 64;
+
+static void runSweep(size_t count, float loss, uint32_t jitter_ms)
+{
+    OrviboS20FleetEmulator emulator(count);
+    OrviboS20FleetEmulator::config_t config = {};
+    config.loss_rx = loss;
+    config.loss_tx = loss;
+    config.delay_us = 200;
+    config.jitter_us = jitter_ms * 1000;
+    config.seed = 1;
+    emulator.setConfig(config);
+
+    OrviboS20Class gateway;
+    OrviboS20PosixTransport transport(IPAddress(127, 0, 0, 1));
+    gateway.setTransport(&transport);
+    gateway.setRxBudget(256, 0);
+
+    std::vector<OrviboS20Device *> devices(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (i % 2 == 0)
+        {
+            uint8_t mac[6];
+            OrviboS20FleetEmulator::makeMac(i, mac);
+            devices[i] = new OrviboS20Device(mac, "", gateway);
+        }
+        else
+        {
+            devices[i] = new OrviboS20Device("", gateway);
+        }
+    }
+
+    if (!gateway.begin() || !emulator.start())
+    {
+        printf("Failed to open sockets on 127.0.0.1/127.0.0.2:%u\n", ORVIBO_UDP_PORT);
+        exit(1);
+    }
+    bool done = false;
+    gateway.onDiscoveryDone([&done](const OrviboS20Class::discovery_stats_t &) {
+        done = true;
+    });
+    // The emulator answers broadcast requests sent to its own address
+    gateway.startDiscovery(IPAddress(127, 0, 0, 2), ROUNDS, INTERVAL_MS, BATCH);
+    while (!done)
+    {
+        transport.wait(1);
+        gateway.handle();
+    }
+    OrviboS20Class::discovery_stats_t stats = gateway.getDiscoveryStats();
+
+    emulator.stop();
+    gateway.stop();
+    for (OrviboS20Device *dev : devices)
+    {
+        delete dev;
+    }
+
+    char full_fleet[16] = "-";
+    if (stats.full_fleet_ms != UINT32_MAX)
+    {
+        snprintf(full_fleet, sizeof(full_fleet), "%u", stats.full_fleet_ms);
+    }
+    printf("%7zu %5.1f%% %8u %8u %8u %13s\n", count, loss * 100, stats.devices, stats.bound, stats.probes, full_fleet);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t jitter_ms = (argc > 1) ? atoi(argv[1]) : 20;
+
+    printf("%u rounds, %u ms apart, %u requests per handle(), replies spread over %u ms\n", ROUNDS, INTERVAL_MS, BATCH, jitter_ms);
+    printf("%7s %6s %8s %8s %8s %13s\n", "devices", "loss", "created", "bound", "requests", "full fleet ms");
+    const size_t counts[] = {50, 250, 1000};
+    const float losses[] = {0.0f, 0.05f};
+    for (size_t count : counts)
+    {
+        for (float loss : losses)
+        {
+            runSweep(count, loss, jitter_ms);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,115 @@
+/*
+ * Measures the per-packet cost of dispatching received packets to OrviboS20Device
+ * instances as the number of registered devices grows.
+ *
+ * For comparison the cost of the previous linear list walk (memcmp on each device MAC)
+ * (lookup only) is measured for the same packet sequence.
+ */
+// Build:
+//   g++ -O2 -std=c++11 -I../../../src -I../common ../../../src/*.cpp DispatchBenchmark.cpp -o dispatch_bench
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <vector>
+
+#include "OrviboS20.h"
+#include "OrviboS20MemoryTransport.h"
+
+static const int PACKET_COUNT = 200000;
+
+static double nowNs()
+{
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void makeMac(uint32_t i, uint8_t *mac)
+{
+    mac[0] = 0xAC;
+    mac[1] = 0xCF;
+    mac[2] = 0x23;
+    mac[3] = i >> 16;
+    mac[4] = i >> 8;
+    mac[5] = i;
+}
+
+static void makeStateChange(const uint8_t *mac, uint8_t state, uint8_t *frame)
+{
+    const uint8_t header[] = {0x68, 0x64, 0x00, 0x17, 0x73, 0x66};
+    memcpy(frame, header, sizeof(header));
+    memcpy(&frame[6], mac, 6);
+    memset(&frame[12], 0x20, 6);
+    memset(&frame[18], 0, 4);
+    frame[22] = state;
+}
+
+int main()
+{
+    OrviboS20MemoryTransport transport;
+    OrviboS20.setTransport(&transport);
+    OrviboS20.onFoundDevice([](uint8_t *mac) { (void)mac; });
+    OrviboS20.setRxBudget(0xFFFF, 0);
+    OrviboS20.begin();
+
+    printf("%10s %16s %16s\n", "devices", "dispatch ns/pkt", "linear ns/pkt");
+
+    const int device_counts[] = {10, 100, 1000, 10000};
+    for (int count : device_counts)
+    {
+        std::vector<OrviboS20Device *> devices;
+        for (int i = 0; i < count; i++)
+        {
+            uint8_t mac[6];
+            makeMac(i, mac);
+            devices.push_back(new OrviboS20Device(mac));
+        }
+
+        std::mt19937 rng(count);
+        std::vector<uint32_t> targets(PACKET_COUNT);
+        for (auto &t : targets)
+        {
+            t = rng() % count;
+        }
+
+        for (int i = 0; i < PACKET_COUNT; i++)
+        {
+            uint8_t mac[6];
+            uint8_t frame[23];
+            makeMac(targets[i], mac);
+            makeStateChange(mac, i & 1, frame);
+            transport.inject(frame, sizeof(frame));
+        }
+
+        double start = nowNs();
+        while (transport.pending() > 0)
+        {
+            OrviboS20.handle();
+        }
+        double dispatch_ns = (nowNs() - start) / PACKET_COUNT;
+
+        // Linear walk over the devices like the old list based lookup
+        volatile int found = 0;
+        start = nowNs();
+        for (int i = 0; i < PACKET_COUNT; i++)
+        {
+            uint8_t mac[6];
+            makeMac(targets[i], mac);
+            for (OrviboS20Device *dev : devices)
+            {
+                if (memcmp(dev->getMac(), mac, 6) == 0)
+                {
+                    found = found + 1;
+                    break;
+                }
+            }
+        }
+        double linear_ns = (nowNs() - start) / PACKET_COUNT;
+
+        printf("%10d %16.1f %16.1f\n", count, dispatch_ns, linear_ns);
+
+        for (OrviboS20Device *dev : devices)
+        {
+            delete dev;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,223 @@
+/*
+ * Load benchmark for OrviboS20Engine
+ *
+ * A generator thread sends CMD_STATE_CHANGE frames for N emulated devices over loopback
+ * at increasing rates. Every frame toggles the relay state so each one ends up in an
+ * onStateChange() callback, where the time since the frame was sent is recorded.
+ * Reported per rate: received packets/sec, latency p50/p99/max and dropped frames.
+ *
+ * Usage: engine_bench [devices] [shards]   (default 10000 devices, 4 shards)
+ */
+// Build:
+//   g++ -O2 -std=c++11 -pthread -I../../../src ../../../src/*.cpp EngineBenchmark.cpp -o engine_bench
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "OrviboS20Engine.h"
+
+static const int RUN_TIME_MS = 2000;
+static const int BATCH_SIZE = 64;
+
+struct ShardResult
+{
+    std::mutex lock; // Uncontended except when main() collects the results
+    std::vector<uint32_t> latencies_us;
+};
+
+static std::vector<std::atomic<uint64_t>> *s_sent_ns;
+
+static uint64_t nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void makeMac(uint32_t id, uint8_t *mac)
+{
+    mac[0] = 0xAC;
+    mac[1] = 0xCF;
+    mac[2] = 0x23;
+    mac[3] = id >> 16;
+    mac[4] = id >> 8;
+    mac[5] = id;
+}
+
+static uint32_t macToId(const uint8_t *mac)
+{
+    return ((uint32_t)mac[3] << 16) | ((uint32_t)mac[4] << 8) | mac[5];
+}
+
+static int openSocket(const char *ip, uint16_t port)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int size = 8 * 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, ip, &addr.sin_addr);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("bind");
+        exit(1);
+    }
+    return fd;
+}
+
+/* Sends one state change per device and round at the given rate, returns frames sent */
+static uint64_t generate(int fd, uint32_t device_count, uint32_t rate, uint8_t &state)
+{
+    struct sockaddr_in dst = {};
+    dst.sin_family = AF_INET;
+    dst.sin_port = htons(ORVIBO_UDP_PORT);
+    inet_pton(AF_INET, "127.0.0.1", &dst.sin_addr);
+
+    uint8_t frames[BATCH_SIZE][23];
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct iovec iovs[BATCH_SIZE];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < BATCH_SIZE; i++)
+    {
+        const uint8_t header[] = {0x68, 0x64, 0x00, 0x17, 0x73, 0x66};
+        memcpy(frames[i], header, sizeof(header));
+        memset(&frames[i][12], 0x20, 6);
+        memset(&frames[i][18], 0, 5);
+        iovs[i].iov_base = frames[i];
+        iovs[i].iov_len = sizeof(frames[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &dst;
+        msgs[i].msg_hdr.msg_namelen = sizeof(dst);
+    }
+
+    uint64_t start = nowNs();
+    uint64_t sent = 0;
+    uint32_t id = 0;
+    while (nowNs() - start < (uint64_t)RUN_TIME_MS * 1000000)
+    {
+        // Pace: how many frames should have been sent by now
+        uint64_t due = (nowNs() - start) * rate / 1000000000;
+        if (sent >= due)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+            continue;
+        }
+        int n = std::min<uint64_t>(BATCH_SIZE, due - sent);
+        for (int i = 0; i < n; i++)
+        {
+            makeMac(id, &frames[i][6]);
+            frames[i][22] = state;
+            (*s_sent_ns)[id].store(nowNs(), std::memory_order_relaxed);
+            if (++id == device_count)
+            {
+                id = 0;
+                state ^= 1;
+            }
+        }
+        int ret = sendmmsg(fd, msgs, n, 0);
+        sent += (ret > 0) ? ret : 0;
+    }
+    return sent;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t device_count = (argc > 1) ? atoi(argv[1]) : 10000;
+    uint8_t shard_count = (argc > 2) ? atoi(argv[2]) : 4;
+
+    std::vector<std::atomic<uint64_t>> sent_ns(device_count);
+    s_sent_ns = &sent_ns;
+    std::vector<ShardResult> results(shard_count);
+
+    OrviboS20Engine engine(shard_count, IPAddress(127, 0, 0, 1));
+    std::vector<OrviboS20Device *> devices;
+    for (uint32_t i = 0; i < device_count; i++)
+    {
+        uint8_t mac[6];
+        makeMac(i, mac);
+        OrviboS20Class &shard = engine.shardFor(mac);
+        OrviboS20Device *dev = new OrviboS20Device(mac, "", shard);
+        // Each shard worker only appends to its own result vector
+        ShardResult *result = &results[0];
+        for (uint8_t s = 0; s < shard_count; s++)
+        {
+            if (&engine.shard(s) == &shard)
+            {
+                result = &results[s];
+            }
+        }
+        dev->onStateChange([result](OrviboS20Device &device, bool) {
+            uint64_t sent = (*s_sent_ns)[macToId(device.getMac())].load(std::memory_order_relaxed);
+            std::lock_guard<std::mutex> guard(result->lock);
+            result->latencies_us.push_back((nowNs() - sent) / 1000);
+        });
+        devices.push_back(dev);
+    }
+    for (uint8_t s = 0; s < shard_count; s++)
+    {
+        // Process everything queued in each handle() call
+        engine.shard(s).setRxBudget(256, 0);
+    }
+
+    if (!engine.start())
+    {
+        printf("Failed to start engine on 127.0.0.1:%u\n", ORVIBO_UDP_PORT);
+        return 1;
+    }
+
+    // The engine sends subscriptions to the "devices" which all live on 127.0.0.2
+    int fd = openSocket("127.0.0.2", ORVIBO_UDP_PORT);
+
+    printf("%u devices, %u shards\n", device_count, shard_count);
+    printf("%10s %12s %10s %10s %10s %10s\n", "rate", "rx pkt/s", "p50 us", "p99 us", "max us", "dropped");
+
+    uint8_t state = 0;
+    const uint32_t rates[] = {50000, 100000, 200000, 400000, 800000};
+    for (uint32_t rate : rates)
+    {
+        uint64_t sent = generate(fd, device_count, rate, state);
+        // Let the workers drain their queues
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+        std::vector<uint32_t> all;
+        for (auto &result : results)
+        {
+            std::lock_guard<std::mutex> guard(result.lock);
+            all.insert(all.end(), result.latencies_us.begin(), result.latencies_us.end());
+            result.latencies_us.clear();
+        }
+        std::sort(all.begin(), all.end());
+        uint64_t dropped = sent - all.size();
+        if (all.empty())
+        {
+            all.push_back(0);
+        }
+        printf("%10u %12.0f %10u %10u %10u %10llu\n", rate, all.size() * 1000.0 / RUN_TIME_MS,
+               all[all.size() / 2], all[all.size() * 99 / 100], all.back(),
+               (unsigned long long)dropped);
+    }
+
+    OrviboS20Engine::stats_t stats = engine.getStats();
+    printf("\nengine: rx %llu, batches %llu, invalid %llu, queue full %llu, wakeups %llu\n",
+           (unsigned long long)stats.rx_packets, (unsigned long long)stats.rx_batches,
+           (unsigned long long)stats.rx_invalid, (unsigned long long)stats.rx_dropped,
+           (unsigned long long)stats.wakeups);
+
+    engine.stop();
+    close(fd);
+    for (OrviboS20Device *dev : devices)
+    {
+        delete dev;
+    }
+    return 0;
+}
@@ -0,0 +1,209 @@
+/*
+ * Command latency and timeout detection benchmark against an emulated fleet
+ *
+ * OrviboS20 runs on 127.0.0.1 and OrviboS20FleetEmulator emulates the devices on
+ * 127.0.0.2. For each fleet size the devices announce themselves, then relay commands
+ * are sent to random idle devices at a fixed rate while the emulator drops, delays and
+ * churns. Reported per fleet size:
+ *  - command latency p50/p99 and completed commands/sec
+ *  - timeout detection: commands to devices that were offline during the whole command
+ *    must time out, commands to devices that were online should succeed (a timeout
+ *    there means all attempts were lost). Commands overlapping a churn are not counted.
+ *
+ * Usage: fleet_bench [loss] [offline fraction]   (default 0.02, 0.01)
+ */
+// Build:
+//   g++ -O2 -std=c++11 -pthread -I../../../src -I../common ../../../src/*.cpp FleetBenchmark.cpp -o fleet_bench
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "OrviboS20.h"
+#include "OrviboS20FleetEmulator.h"
+#include "OrviboS20PosixTransport.h"
+
+static const uint32_t COMMAND_RATE = 2000; /* Commands per second */
+static const uint32_t RUN_TIME_MS = 5000;
+static const uint32_t OFFLINE_MS = 2000;   /* Longer than a command incl. retransmissions */
+
+struct Result
+{
+    uint32_t connected;
+    std::vector<uint32_t> latencies_us;
+    uint32_t succeeded;
+    uint32_t timeouts;
+    uint32_t online_ok;       /* Online device, command succeeded */
+    uint32_t online_timeout;  /* Online device, command timed out */
+    uint32_t offline_timeout; /* Offline device, command timed out */
+    uint32_t offline_ok;      /* Offline device, command succeeded (should never happen) */
+    uint32_t mixed;
+    uint64_t detect_us;       /* Sum of time to timeout for offline devices */
+};
+
+struct Record
+{
+    size_t index;
+    uint64_t start_us;
+    bool busy;
+    bool state;
+    OrviboS20FleetEmulator *emulator;
+    Result *result;
+};
+
+static void runFleet(size_t count, float loss, float offline_fraction)
+{
+    OrviboS20FleetEmulator emulator(count);
+    OrviboS20FleetEmulator::config_t config = {};
+    config.loss_rx = loss;
+    config.loss_tx = loss;
+    config.delay_us = 200;
+    config.jitter_us = 300;
+    // On average offline_fraction of the fleet is offline
+    uint32_t offline_devices = std::max<uint32_t>(1, count * offline_fraction);
+    config.churn_interval_ms = std::max<uint32_t>(1, OFFLINE_MS / offline_devices);
+    config.offline_ms = OFFLINE_MS;
+    config.seed = 1;
+
+    OrviboS20Class gateway;
+    OrviboS20PosixTransport transport(IPAddress(127, 0, 0, 1));
+    gateway.setTransport(&transport);
+    gateway.setRxBudget(256, 0);
+    // 50 + 100 + 200 ms, a timeout is detected after 350 ms
+    gateway.setCommandRetry(3, 50);
+
+    Result result = {};
+    std::vector<Record> records(count);
+    std::vector<OrviboS20Device *> devices(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        uint8_t mac[6];
+        OrviboS20FleetEmulator::makeMac(i, mac);
+        devices[i] = new OrviboS20Device(mac, "", gateway);
+        records[i] = {i, 0, false, false, &emulator, &result};
+        devices[i]->onConnect([&result](OrviboS20Device &) {
+            result.connected++;
+        });
+    }
+
+    if (!gateway.begin() || !emulator.start())
+    {
+        printf("Failed to open sockets on 127.0.0.1/127.0.0.2:%u\n", ORVIBO_UDP_PORT);
+        exit(1);
+    }
+    emulator.announceAll(500);
+    uint64_t start = OrviboS20FleetEmulator::nowUs();
+    while ((result.connected < count) && (OrviboS20FleetEmulator::nowUs() - start < 3000000))
+    {
+        transport.wait(1);
+        gateway.handle();
+    }
+    uint32_t connected = result.connected;
+
+    // Churn only starts once the fleet is up
+    emulator.setConfig(config);
+
+    std::mt19937 random(2);
+    uint64_t sent = 0;
+    uint32_t busy = 0;
+    start = OrviboS20FleetEmulator::nowUs();
+    uint64_t now = start;
+    while ((now - start < (uint64_t)RUN_TIME_MS * 1000) || (busy > 0 && now - start < (uint64_t)(RUN_TIME_MS + 2000) * 1000))
+    {
+        uint64_t due = (now - start < (uint64_t)RUN_TIME_MS * 1000) ? (now - start) * COMMAND_RATE / 1000000 : sent;
+        while (sent < due)
+        {
+            Record &record = records[std::uniform_int_distribution<size_t>(0, count - 1)(random)];
+            sent++;
+            if (record.busy)
+            {
+                continue;
+            }
+            record.busy = true;
+            busy++;
+            record.state = !record.state;
+            record.start_us = OrviboS20FleetEmulator::nowUs();
+            Record *rec = &record;
+            uint32_t *busy_ptr = &busy;
+            devices[record.index]->setState(record.state, [rec, busy_ptr](OrviboS20Device &, OrviboCommandResult res, uint32_t) {
+                uint64_t end = OrviboS20FleetEmulator::nowUs();
+                Result &r = *rec->result;
+                rec->busy = false;
+                (*busy_ptr)--;
+                if (res == RESULT_SUCCESS)
+                {
+                    r.succeeded++;
+                    r.latencies_us.push_back(end - rec->start_us);
+                }
+                else if (res == RESULT_TIMEOUT)
+                {
+                    r.timeouts++;
+                }
+                switch (rec->emulator->onlineDuring(rec->index, rec->start_us, end))
+                {
+                case OrviboS20FleetEmulator::ONLINE:
+                    (res == RESULT_SUCCESS) ? r.online_ok++ : r.online_timeout++;
+                    break;
+                case OrviboS20FleetEmulator::OFFLINE:
+                    if (res == RESULT_SUCCESS)
+                    {
+                        r.offline_ok++;
+                    }
+                    else
+                    {
+                        r.offline_timeout++;
+                        r.detect_us += end - rec->start_us;
+                    }
+                    break;
+                default:
+                    r.mixed++;
+                    break;
+                }
+            });
+        }
+        transport.wait(1);
+        gateway.handle();
+        now = OrviboS20FleetEmulator::nowUs();
+    }
+    uint64_t elapsed_us = now - start;
+
+    emulator.stop();
+    gateway.stop();
+    for (OrviboS20Device *dev : devices)
+    {
+        delete dev;
+    }
+
+    std::vector<uint32_t> &lat = result.latencies_us;
+    std::sort(lat.begin(), lat.end());
+    if (lat.empty())
+    {
+        lat.push_back(0);
+    }
+    uint32_t completed = result.succeeded + result.timeouts;
+    uint32_t online = result.online_ok + result.online_timeout;
+    uint32_t offline = result.offline_ok + result.offline_timeout;
+    printf("%7zu %9u %8u %9.0f %8u %8u %8u %7.2f%% %7.2f%% %9.0f %6u\n", count, connected, completed,
+           completed * 1e6 / elapsed_us, lat[lat.size() / 2], lat[lat.size() * 99 / 100], result.timeouts,
+           online ? 100.0 * result.online_ok / online : 0.0,
+           offline ? 100.0 * result.offline_timeout / offline : 100.0,
+           result.offline_timeout ? result.detect_us / 1000.0 / result.offline_timeout : 0.0, result.mixed);
+}
+
+int main(int argc, char *argv[])
+{
+    float loss = (argc > 1) ? atof(argv[1]) : 0.02;
+    float offline_fraction = (argc > 2) ? atof(argv[2]) : 0.01;
+
+    printf("loss %.1f%% per direction, %.1f%% of devices offline, %u commands/s\n", loss * 100, offline_fraction * 100, COMMAND_RATE);
+    printf("%7s %9s %8s %9s %8s %8s %8s %8s %8s %9s %6s\n", "devices", "connected", "commands", "cmd/s", "p50 us",
+           "p99 us", "timeouts", "online", "offline", "detect ms", "mixed");
+    const size_t sizes[] = {100, 1000, 10000};
+    for (size_t count : sizes)
+    {
+        runFleet(count, loss, offline_fraction);
+    }
+    printf("\nonline: commands to online devices that succeeded\n");
+    printf("offline: commands to offline devices that were detected as timed out\n");
+    return 0;
+}
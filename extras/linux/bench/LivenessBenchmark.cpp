@@ -0,0 +1,169 @@
+/*
+ * Disconnect detection benchmark for active liveness probing
+ *
+ * OrviboS20 runs on 127.0.0.1 and OrviboS20FleetEmulator emulates the devices on
+ * 127.0.0.2. Once the fleet is connected a few devices are silently taken offline at
+ * random times. Reported per quiet threshold:
+ *  - time from a device going offline until onDisconnect() (p50/max)
+ *  - devices wrongly disconnected while online (lost probes)
+ *  - datagrams sent per device and minute (subscriptions and probes)
+ * Without probing a silent device is disconnected after 150 s.
+ *
+ * Usage: liveness_bench [seconds] [loss]   (default 30, 0.02)
+ */
+// Build:
+//   g++ -O2 -std=c++11 -pthread -I../../../src -I../common ../../../src/*.cpp LivenessBenchmark.cpp -o liveness_bench
+#include <algorithm>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "OrviboS20.h"
+#include "OrviboS20FleetEmulator.h"
+#include "OrviboS20PosixTransport.h"
+
+static const size_t DEVICES = 500;
+static const size_t OFFLINE_DEVICES = 20;
+
+struct Record
+{
+    uint64_t offline_us; /* 0 while online */
+    uint64_t detect_us;
+    bool disconnected;
+};
+
+static void runProbing(uint32_t quiet_ms, uint32_t seconds, float loss)
+{
+    OrviboS20FleetEmulator emulator(DEVICES);
+    OrviboS20FleetEmulator::config_t config = {};
+    config.loss_rx = loss;
+    config.loss_tx = loss;
+    config.delay_us = 200;
+    config.jitter_us = 300;
+    config.seed = 1;
+
+    OrviboS20Class gateway;
+    OrviboS20PosixTransport transport(IPAddress(127, 0, 0, 1));
+    gateway.setTransport(&transport);
+    gateway.setRxBudget(256, 0);
+    gateway.setLivenessProbing(quiet_ms, 3);
+
+    std::vector<Record> records(DEVICES);
+    std::vector<OrviboS20Device *> devices(DEVICES);
+    uint32_t connected = 0;
+    for (size_t i = 0; i < DEVICES; i++)
+    {
+        uint8_t mac[6];
+        OrviboS20FleetEmulator::makeMac(i, mac);
+        devices[i] = new OrviboS20Device(mac, "", gateway);
+        Record *record = &records[i];
+        devices[i]->onConnect([&connected](OrviboS20Device &) {
+            connected++;
+        });
+        devices[i]->onDisconnect([record](OrviboS20Device &) {
+            record->disconnected = true;
+            record->detect_us = OrviboS20FleetEmulator::nowUs();
+        });
+    }
+
+    if (!gateway.begin() || !emulator.start())
+    {
+        printf("Failed to open sockets on 127.0.0.1/127.0.0.2:%u\n", ORVIBO_UDP_PORT);
+        exit(1);
+    }
+    emulator.announceAll(500);
+    uint64_t start = OrviboS20FleetEmulator::nowUs();
+    while ((connected < DEVICES) && (OrviboS20FleetEmulator::nowUs() - start < 3000000))
+    {
+        transport.wait(1);
+        gateway.handle();
+    }
+    emulator.setConfig(config);
+
+    // Take devices offline spread over the first half of the run
+    std::mt19937 random(2);
+    std::vector<std::pair<uint64_t, size_t>> schedule;
+    for (size_t i = 0; i < OFFLINE_DEVICES; i++)
+    {
+        uint64_t at = std::uniform_int_distribution<uint64_t>(0, seconds * 500000ULL)(random);
+        schedule.push_back({at, std::uniform_int_distribution<size_t>(0, DEVICES - 1)(random)});
+    }
+    std::sort(schedule.begin(), schedule.end());
+
+    OrviboS20Metrics before = gateway.getMetrics();
+    size_t next = 0;
+    start = OrviboS20FleetEmulator::nowUs();
+    uint64_t now = start;
+    while (now - start < seconds * 1000000ULL)
+    {
+        while ((next < schedule.size()) && (now - start >= schedule[next].first))
+        {
+            Record &record = records[schedule[next].second];
+            if (record.offline_us == 0 && !record.disconnected)
+            {
+                emulator.setOnline(schedule[next].second, false);
+                record.offline_us = OrviboS20FleetEmulator::nowUs();
+            }
+            next++;
+        }
+        transport.wait(10);
+        gateway.handle();
+        now = OrviboS20FleetEmulator::nowUs();
+    }
+    OrviboS20Metrics after = gateway.getMetrics();
+
+    emulator.stop();
+    gateway.stop();
+    for (OrviboS20Device *dev : devices)
+    {
+        delete dev;
+    }
+
+    std::vector<uint64_t> detect_us;
+    uint32_t offline = 0;
+    uint32_t undetected = 0;
+    uint32_t false_disconnects = 0;
+    for (const Record &record : records)
+    {
+        if (record.offline_us)
+        {
+            offline++;
+            if (record.disconnected)
+            {
+                detect_us.push_back(record.detect_us - record.offline_us);
+            }
+            else
+            {
+                undetected++;
+            }
+        }
+        else if (record.disconnected)
+        {
+            false_disconnects++;
+        }
+    }
+    std::sort(detect_us.begin(), detect_us.end());
+    if (detect_us.empty())
+    {
+        detect_us.push_back(0);
+    }
+    double per_minute = (after.tx_packets - before.tx_packets) * 60.0 / seconds / DEVICES;
+    printf("%8u %7u %9.0f %9.0f %10u %6u %10.2f\n", quiet_ms, offline, detect_us[detect_us.size() / 2] / 1000.0,
+           detect_us.back() / 1000.0, undetected, false_disconnects, per_minute);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t seconds = (argc > 1) ? atoi(argv[1]) : 30;
+    float loss = (argc > 2) ? atof(argv[2]) : 0.02;
+
+    printf("%zu devices, %.1f%% loss per direction, %u s per run, 3 missed probes\n", DEVICES, loss * 100, seconds);
+    printf("%8s %7s %9s %9s %10s %6s %10s\n", "quiet ms", "offline", "p50 ms", "max ms", "undetected", "false", "tx/dev/min");
+    const uint32_t quiet_ms[] = {2000, 5000, 10000};
+    for (uint32_t quiet : quiet_ms)
+    {
+        runProbing(quiet, seconds, loss);
+    }
+    return 0;
+}
@@ -0,0 +1,330 @@
+/*
+ * Reports the RAM used per OrviboS20Device: the object size, the size of the callback
+ * members and the heap used when devices are created, given callbacks and commanded.
+ * Also checks that a complete WiFi pairing (OrviboS20PairEmulator) doesn't allocate any
+ * heap, the exit code is 1 if it does.
+ *
+ * Note: Sizes are for this host. On the ESP8266 pointers are 4 bytes so the callback
+ *       storage and most other members are half the size.
+ */
+// Build:
+//   g++ -O2 -std=c++11 -I../../../src -I../common ../../../src/*.cpp MemoryReport.cpp -o memory_report
+#include <functional>
+#include <malloc.h>
+#include <stdio.h>
+#include <vector>
+
+#include "OrviboS20.h"
+#include "OrviboS20Group.h"
+#include "OrviboS20MemoryTransport.h"
+#include "OrviboS20PairEmulator.h"
+#include "OrviboS20WiFiPair.h"
+
+static const int DEVICE_COUNT = 1000;
+
+static size_t new_calls = 0;
+static size_t malloc_calls = 0;
+static size_t malloc_bytes = 0;
+static bool counting = true;
+
+// glibc's own allocator, all allocations in the process are counted unless paused by Uncounted
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *p, size_t size);
+extern "C" void __libc_free(void *p);
+
+extern "C" void *malloc(size_t size)
+{
+    malloc_calls += counting;
+    malloc_bytes += counting ? size : 0;
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+    malloc_calls += counting;
+    malloc_bytes += counting ? count * size : 0;
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *p, size_t size)
+{
+    malloc_calls += counting;
+    malloc_bytes += counting ? size : 0;
+    return __libc_realloc(p, size);
+}
+
+void *operator new(size_t size)
+{
+    new_calls += counting;
+    void *p = malloc(size);
+    if (p == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    __libc_free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    __libc_free(p);
+}
+
+static size_t heapInUse()
+{
+    return mallinfo2().uordblks;
+}
+
+/* Stops counting allocations while in scope */
+struct Uncounted
+{
+    Uncounted()
+    {
+        counting = false;
+    }
+    ~Uncounted()
+    {
+        counting = true;
+    }
+};
+
+/* Memory transport that isn't counted, only the library is */
+class UncountedTransport : public OrviboS20MemoryTransport
+{
+public:
+    int parsePacket() override
+    {
+        Uncounted pause;
+        return OrviboS20MemoryTransport::parsePacket();
+    }
+    int beginPacket(IPAddress ip, uint16_t port) override
+    {
+        Uncounted pause;
+        return OrviboS20MemoryTransport::beginPacket(ip, port);
+    }
+    size_t write(const uint8_t *buffer, size_t length) override
+    {
+        Uncounted pause;
+        return OrviboS20MemoryTransport::write(buffer, length);
+    }
+    int endPacket() override
+    {
+        Uncounted pause;
+        return OrviboS20MemoryTransport::endPacket();
+    }
+
+    using OrviboS20MemoryTransport::write;
+};
+
+/* Same for the emulated WiFi link */
+class UncountedLink : public OrviboS20WiFiLink
+{
+public:
+    UncountedLink(OrviboS20WiFiLink &link) : m_link(link)
+    {
+    }
+
+    void disconnect() override
+    {
+        Uncounted pause;
+        m_link.disconnect();
+    }
+    void scanNetworks() override
+    {
+        Uncounted pause;
+        m_link.scanNetworks();
+    }
+    int scanComplete() override
+    {
+        Uncounted pause;
+        return m_link.scanComplete();
+    }
+    bool getNetwork(int index, char *ssid, size_t ssid_size, uint8_t *bssid, int32_t &channel) override
+    {
+        Uncounted pause;
+        return m_link.getNetwork(index, ssid, ssid_size, bssid, channel);
+    }
+    void begin(const char *ssid, const char *passphrase, int32_t channel, const uint8_t *bssid) override
+    {
+        Uncounted pause;
+        m_link.begin(ssid, passphrase, channel, bssid);
+    }
+    bool isConnected() override
+    {
+        Uncounted pause;
+        return m_link.isConnected();
+    }
+    const uint8_t *BSSID() override
+    {
+        Uncounted pause;
+        return m_link.BSSID();
+    }
+    IPAddress broadcastIP() override
+    {
+        Uncounted pause;
+        return m_link.broadcastIP();
+    }
+
+private:
+    OrviboS20WiFiLink &m_link;
+};
+
+static uint64_t s_now_us = 0;
+
+static uint64_t virtualTime()
+{
+    return s_now_us;
+}
+
+static void makeStateChange(const uint8_t *mac, uint8_t state, uint8_t *frame)
+{
+    const uint8_t header[] = {0x68, 0x64, 0x00, 0x17, 0x73, 0x66};
+    memcpy(frame, header, sizeof(header));
+    memcpy(&frame[6], mac, 6);
+    memset(&frame[12], 0x20, 6);
+    memset(&frame[18], 0, 4);
+    frame[22] = state;
+}
+
+int main()
+{
+    printf("Object sizes (bytes)\n");
+    printf("  %-40s %6zu\n", "OrviboS20Device", sizeof(OrviboS20Device));
+    printf("  %-40s %6zu\n", "OrviboS20Device::command_callback_t", sizeof(OrviboS20Device::command_callback_t));
+    printf("  %-40s %6zu\n", "  (std::function equivalent)", sizeof(std::function<void(OrviboS20Device &, OrviboCommandResult, uint32_t)>));
+    printf("  %-40s %6zu\n", "OrviboS20Class", sizeof(OrviboS20Class));
+    printf("  %-40s %6zu\n", "OrviboS20WiFiPairClass", sizeof(OrviboS20WiFiPairClass));
+    printf("  %-40s %6zu\n", "OrviboS20Group", sizeof(OrviboS20Group));
+
+    OrviboS20MemoryTransport transport;
+    OrviboS20.setTransport(&transport);
+    OrviboS20.onFoundDevice([](uint8_t *mac) { (void)mac; });
+    OrviboS20.setRxBudget(0xFFFF, 0);
+    OrviboS20.begin();
+    // Let the memory transport allocate its send buffer up front
+    uint8_t warmup[64] = {};
+    transport.sendPacket(IPAddress(127, 0, 0, 2), 10000, warmup, sizeof(warmup));
+
+    uint32_t connects = 0;
+    uint32_t changes = 0;
+    uint32_t confirmed = 0;
+    std::vector<OrviboS20Device *> devices(DEVICE_COUNT);
+    std::vector<uint8_t> macs(DEVICE_COUNT * 6);
+    for (int i = 0; i < DEVICE_COUNT; i++)
+    {
+        uint8_t *mac = &macs[i * 6];
+        mac[0] = 0xAC;
+        mac[1] = 0xCF;
+        mac[2] = 0x23;
+        mac[3] = 0;
+        mac[4] = i >> 8;
+        mac[5] = i;
+    }
+
+    // Device creation (the MAC index grows on the heap)
+    size_t heap_start = heapInUse();
+    size_t new_start = new_calls;
+    for (int i = 0; i < DEVICE_COUNT; i++)
+    {
+        devices[i] = new OrviboS20Device(&macs[i * 6]);
+    }
+    size_t heap_created = heapInUse();
+    size_t new_created = new_calls;
+
+    // Capturing callbacks
+    for (OrviboS20Device *dev : devices)
+    {
+        uint32_t *counter = &connects;
+        dev->onConnect([counter](OrviboS20Device &) { (*counter)++; });
+        dev->onStateChange([&changes, dev](OrviboS20Device &device, bool) { changes += (&device == dev); });
+    }
+    size_t heap_callbacks = heapInUse();
+    size_t new_callbacks = new_calls;
+
+    // Receive a state change from every device and send an acknowledged command
+    for (int i = 0; i < DEVICE_COUNT; i++)
+    {
+        uint8_t frame[23];
+        makeStateChange(&macs[i * 6], 0, frame);
+        transport.inject(frame, sizeof(frame));
+    }
+    OrviboS20.handle();
+    size_t heap_traffic = heapInUse();
+    size_t new_traffic = new_calls;
+    for (OrviboS20Device *dev : devices)
+    {
+        dev->setState(true, [&confirmed](OrviboS20Device &, OrviboCommandResult result, uint32_t) {
+            confirmed += (result == RESULT_SUCCESS);
+        });
+    }
+    OrviboS20.handle();
+    // Only count the library, not the datagrams queued in the memory transport
+    size_t new_inject_start = new_calls;
+    for (int i = 0; i < DEVICE_COUNT; i++)
+    {
+        uint8_t frame[23];
+        makeStateChange(&macs[i * 6], 1, frame);
+        transport.inject(frame, sizeof(frame));
+    }
+    size_t new_injected = new_calls - new_inject_start;
+    OrviboS20.handle();
+    size_t heap_commands = heapInUse();
+    size_t new_commands = new_calls - new_injected;
+
+    printf("\nHeap per device (%d devices)\n", DEVICE_COUNT);
+    printf("  %-40s %6.1f bytes %6zu new\n", "new OrviboS20Device (incl. MAC index)", (double)(heap_created - heap_start) / DEVICE_COUNT, new_created - new_start);
+    printf("  %-40s %6.1f bytes %6zu new\n", "set capturing callbacks", (double)(heap_callbacks - heap_created) / DEVICE_COUNT, new_callbacks - new_created);
+    printf("  %-40s %6.1f bytes %6zu new\n", "setState(cb) + confirmation", ((double)heap_commands - heap_traffic) / DEVICE_COUNT, new_commands - new_traffic);
+    printf("\nconnects %u, state changes %u, confirmed %u\n", connects, changes, confirmed);
+
+    for (OrviboS20Device *dev : devices)
+    {
+        delete dev;
+    }
+
+    // A complete pairing on a virtual clock, the emulator is outside of the counted calls
+    UncountedTransport pair_transport;
+    OrviboS20PairEmulator emulator(pair_transport);
+    UncountedLink link(emulator);
+    OrviboS20WiFiPairClass pair;
+    OrviboStopReason reason = REASON_STOPPED_BY_USER;
+    uint32_t commands = 0;
+    orviboSetHostClock(&virtualTime);
+    pair.setTransport(&pair_transport);
+    pair.setWiFiLink(&link);
+    pair.onSendingCommand([&commands](const uint8_t *, const char[]) { commands++; });
+    pair.onStopped([&reason](OrviboStopReason r) { reason = r; });
+
+    size_t pair_new = 0;
+    size_t pair_malloc = 0;
+    size_t pair_bytes = 0;
+    pair.begin("HomeNetwork", "secret-passphrase");
+    while (pair.isActive())
+    {
+        size_t new_before = new_calls;
+        size_t malloc_before = malloc_calls;
+        size_t bytes_before = malloc_bytes;
+        pair.handle();
+        pair_new += new_calls - new_before;
+        pair_malloc += malloc_calls - malloc_before;
+        pair_bytes += malloc_bytes - bytes_before;
+        {
+            Uncounted pause;
+            emulator.handle();
+        }
+        s_now_us += 1000;
+    }
+    orviboSetHostClock(nullptr);
+
+    bool allocation_free = (pair_new == 0) && (pair_malloc == 0);
+    printf("\nWiFi pairing (%u commands, %s)\n", commands, (reason == REASON_PAIRING_SUCCESSFUL) ? "paired" : "failed");
+    // Nothing allocated means the heap high-water mark can't have moved
+    printf("  %-40s %6zu\n", "heap allocated (bytes)", pair_bytes);
+    printf("  %-40s %6zu new %6zu malloc  %s\n", "allocations", pair_new, pair_malloc, allocation_free ? "OK" : "FAILED");
+    return (allocation_free && (reason == REASON_PAIRING_SUCCESSFUL)) ? 0 : 1;
+}
@@ -0,0 +1,139 @@
+/*
+ * Pairing time and success rate benchmark for OrviboS20WiFiPairClass
+ *
+ * One S20 in pairing mode is emulated by OrviboS20PairEmulator and paired over and over
+ * on a virtual clock (1 ms per handle()), so each run takes the same simulated time as
+ * on a real ESP8266. Compared per command loss rate:
+ *  - fixed: the timing used before millisecond deadlines (3 s per attempt, 2 retransmits)
+ *  - default: the default timing (1 s, doubled per retransmission up to 4 s, 3 retransmits)
+ *  - fast: 300 ms, doubled up to 2.4 s, 4 retransmits
+ * Reported: pairings reported successful, devices actually configured (AT+Z received
+ * after the station config), pairing time (p50/p95) and datagrams sent per pairing.
+ *
+ * Usage: pairing_bench [runs] [jitter ms]   (default 500, 20)
+ */
+// Build:
+//   g++ -O2 -std=c++11 -I../../../src -I../common ../../../src/*.cpp PairingBenchmark.cpp -o pairing_bench
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "OrviboS20PairEmulator.h"
+#include "OrviboS20WiFiPair.h"
+
+static const char SSID[] = "HomeNetwork";
+static const char PASSPHRASE[] = "secret-passphrase";
+
+static uint64_t s_now_us = 0;
+
+static uint64_t virtualTime()
+{
+    return s_now_us;
+}
+
+struct Preset
+{
+    const char *name;
+    uint16_t command_timeout_ms;
+    uint16_t max_command_timeout_ms;
+    uint8_t backoff;
+    uint8_t retries;
+};
+
+static void runPairing(const Preset &preset, float loss, uint32_t runs, uint32_t jitter_ms)
+{
+    OrviboS20MemoryTransport transport;
+    OrviboS20PairEmulator emulator(transport);
+    OrviboS20PairEmulator::config_t config = {};
+    config.loss_rx = loss;
+    config.loss_tx = loss;
+    config.delay_ms = 5;
+    config.jitter_ms = jitter_ms;
+    config.scan_ms = 2000;
+    config.connect_ms = 1500;
+    config.seed = 1;
+    emulator.setConfig(config);
+
+    OrviboS20WiFiPairClass pair;
+    pair.setTransport(&transport);
+    pair.setWiFiLink(&emulator);
+    OrviboS20WiFiPairClass::timing_t timing = pair.getTiming();
+    for (int i = OrviboS20WiFiPairClass::CMD_FIRST; i < OrviboS20WiFiPairClass::CMD_LAST; i++)
+    {
+        timing.command_timeout_ms[i] = preset.command_timeout_ms;
+    }
+    timing.max_command_timeout_ms = preset.max_command_timeout_ms;
+    timing.backoff = preset.backoff;
+    timing.retries = preset.retries;
+    pair.setTiming(timing);
+
+    OrviboStopReason reason = REASON_STOPPED_BY_USER;
+    pair.onStopped([&reason](OrviboStopReason r) {
+        reason = r;
+    });
+
+    std::vector<uint32_t> pairing_ms;
+    uint32_t paired = 0;
+    uint32_t configured = 0;
+    size_t datagrams = transport.sentCount();
+    for (uint32_t run = 0; run < runs; run++)
+    {
+        emulator.reset();
+        emulator.setConfig(config);
+        config.seed++;
+        uint32_t start = millis();
+        pair.begin(SSID, PASSPHRASE);
+        while (pair.isActive())
+        {
+            pair.handle();
+            emulator.handle();
+            s_now_us += 1000;
+        }
+        if (reason == REASON_PAIRING_SUCCESSFUL)
+        {
+            paired++;
+            pairing_ms.push_back(millis() - start);
+        }
+        if (emulator.isConfigured(0) && (strcmp(emulator.getSsid(0), SSID) == 0) &&
+            (strcmp(emulator.getKey(0), PASSPHRASE) == 0))
+        {
+            configured++;
+        }
+    }
+    datagrams = transport.sentCount() - datagrams;
+
+    std::sort(pairing_ms.begin(), pairing_ms.end());
+    if (pairing_ms.empty())
+    {
+        pairing_ms.push_back(0);
+    }
+    printf("%-8s %5.1f%% %7.1f%% %10.1f%% %7u %7u %9.1f\n", preset.name, loss * 100, paired * 100.0 / runs,
+           configured * 100.0 / runs, pairing_ms[pairing_ms.size() / 2], pairing_ms[pairing_ms.size() * 95 / 100],
+           (double)datagrams / runs);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t runs = (argc > 1) ? atoi(argv[1]) : 500;
+    uint32_t jitter_ms = (argc > 2) ? atoi(argv[2]) : 20;
+
+    orviboSetHostClock(&virtualTime);
+    printf("%u pairings per row, 2 s scan, 1.5 s connect, replies delayed 5..%u ms, loss per direction\n", runs, 5 + jitter_ms);
+    printf("%-8s %6s %8s %11s %7s %7s %9s\n", "timing", "loss", "paired", "configured", "p50 ms", "p95 ms", "datagrams");
+    const Preset presets[] = {
+        {"fixed", 3000, 3000, 1, 2},
+        {"default", 1000, 4000, 2, 3},
+        {"fast", 300, 2400, 2, 4},
+    };
+    const float losses[] = {0.0f, 0.1f, 0.25f};
+    for (float loss : losses)
+    {
+        for (const Preset &preset : presets)
+        {
+            runPairing(preset, loss, runs, jitter_ms);
+        }
+    }
+    orviboSetHostClock(nullptr);
+    return 0;
+}
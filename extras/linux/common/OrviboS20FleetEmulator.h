@@ -0,0 +1,503 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <thread>
+#include <time.h>
+#include <unordered_map>
+#include <vector>
+
+#include "OrviboS20PosixTransport.h"
+#include "OrviboS20Protocol.h"
+
+/*
+ * Emulator of a fleet of S20 devices for host benchmarks and tests
+ *
+ * All devices share one UDP socket (default 127.0.0.2:10000) so the library under test
+ * can run on 127.0.0.1 on the same host. Each emulated device:
+ *  - answers CMD_SUBSCRIBE with its relay state
+ *  - applies CMD_SET_STATE and acknowledges it with CMD_STATE_CHANGE
+ *  - answers discovery requests (broadcast or unicast) with CMD_DISCOVER using the
+ *    same shifted MAC layout as the real firmware
+ *  - can emit CMD_STATE_CHANGE (button press) and CMD_DISCOVER (boot announce) on request
+ *
+ * Loss, delay and churn (devices going offline for a while) are configured with
+ * setConfig(). Offline devices ignore everything. The emulator runs in its own thread,
+ * all public functions are thread safe.
+ */
+class OrviboS20FleetEmulator
+{
+public:
+    struct config_t
+    {
+        float loss_rx;              /* Probability that a request to a device is lost */
+        float loss_tx;              /* Probability that a reply/event from a device is lost */
+        uint32_t delay_us;          /* Fixed delay of each reply */
+        uint32_t jitter_us;         /* Random extra delay 0..jitter_us */
+        uint32_t churn_interval_ms; /* A random device goes offline this often (0 = no churn) */
+        uint32_t offline_ms;        /* How long a churned device stays offline */
+        uint32_t seed;
+    };
+
+    struct stats_t
+    {
+        uint64_t rx;          /* Requests received */
+        uint64_t rx_lost;     /* Requests dropped by the loss model */
+        uint64_t rx_offline;  /* Requests to offline devices */
+        uint64_t rx_unknown;  /* Requests to unknown MACs or invalid frames */
+        uint64_t tx;          /* Frames sent */
+        uint64_t tx_lost;     /* Frames dropped by the loss model */
+        uint64_t churn_events;
+    };
+
+    /* Result of onlineDuring() */
+    enum Availability
+    {
+        OFFLINE = 0,
+        ONLINE = 1,
+        MIXED = 2
+    };
+
+    OrviboS20FleetEmulator(size_t count, IPAddress ip = IPAddress(127, 0, 0, 2)) : m_socket(ip), m_devices(count)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            makeMac(i, m_devices[i].mac);
+            m_index[macKey(m_devices[i].mac)] = i;
+        }
+    }
+
+    ~OrviboS20FleetEmulator()
+    {
+        stop();
+    }
+
+    /* MAC of emulated device index */
+    static void makeMac(size_t index, uint8_t *mac)
+    {
+        mac[0] = 0xAC;
+        mac[1] = 0xCF;
+        mac[2] = 0x23;
+        mac[3] = index >> 16;
+        mac[4] = index >> 8;
+        mac[5] = index;
+    }
+
+    /* Same clock as used in the timestamps of the emulator */
+    static uint64_t nowUs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    size_t size()
+    {
+        return m_devices.size();
+    }
+
+    void setConfig(const config_t &config)
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_config = config;
+        m_random.seed(config.seed);
+        m_next_churn_us = nowUs() + (uint64_t)config.churn_interval_ms * 1000;
+    }
+
+    /* Events (state changes, announces) are sent to gateway_ip */
+    bool start(IPAddress gateway_ip = IPAddress(127, 0, 0, 1), uint16_t port = ORVIBO_UDP_PORT)
+    {
+        if (m_running || !m_socket.begin(port))
+        {
+            return false;
+        }
+        m_gateway_ip = gateway_ip;
+        m_running = true;
+        m_thread = std::thread(&OrviboS20FleetEmulator::run, this);
+        return true;
+    }
+
+    void stop()
+    {
+        m_running = false;
+        if (m_thread.joinable())
+        {
+            m_thread.join();
+        }
+        m_socket.stop();
+    }
+
+    /* Queue a CMD_DISCOVER announce from each online device, spread over spread_ms */
+    void announceAll(uint32_t spread_ms = 0)
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        uint64_t now = nowUs();
+        for (size_t i = 0; i < m_devices.size(); i++)
+        {
+            if (m_devices[i].online)
+            {
+                queueDiscover(i, m_gateway_ip, ORVIBO_UDP_PORT, now + (uint64_t)spread_ms * 1000 * i / m_devices.size());
+            }
+        }
+    }
+
+    /* Emulate a button press: toggle the relay and report it */
+    void pressButton(size_t index)
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        Device &dev = m_devices[index];
+        if (dev.online)
+        {
+            dev.state = !dev.state;
+            queueStateFrame(index, CMD_STATE_CHANGE, m_gateway_ip, ORVIBO_UDP_PORT, nowUs());
+        }
+    }
+
+    void setOnline(size_t index, bool online)
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        setOnlineLocked(index, online, nowUs());
+    }
+
+    bool getState(size_t index)
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        return m_devices[index].state;
+    }
+
+    /* Whether device index was online during [from_us, to_us] (timestamps from nowUs()) */
+    Availability onlineDuring(size_t index, uint64_t from_us, uint64_t to_us)
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        const Device &dev = m_devices[index];
+        // Walk the transitions backwards to find the state at from_us
+        bool online = dev.online;
+        for (size_t i = dev.transitions.size(); i > 0; i--)
+        {
+            uint64_t t = dev.transitions[i - 1];
+            if (t <= from_us)
+            {
+                break;
+            }
+            if (t <= to_us)
+            {
+                return MIXED;
+            }
+            online = !online;
+        }
+        return online ? ONLINE : OFFLINE;
+    }
+
+    stats_t getStats()
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        return m_stats;
+    }
+
+protected:
+    static const size_t MAX_FRAME_LEN = 42;
+    static const size_t TX_BATCH_SIZE = 64;
+
+    struct Device
+    {
+        uint8_t mac[6];
+        bool state = false;
+        bool online = true;
+        uint64_t online_at_us = 0;          /* When a churned device comes back */
+        std::vector<uint64_t> transitions;  /* Online/offline changes, for onlineDuring() */
+    };
+
+    struct TxFrame
+    {
+        uint64_t due_us;
+        IPAddress ip;
+        uint16_t port;
+        uint8_t length;
+        uint8_t data[MAX_FRAME_LEN];
+
+        bool operator>(const TxFrame &other) const
+        {
+            return due_us > other.due_us;
+        }
+    };
+
+    OrviboS20PosixTransport m_socket;
+    std::vector<Device> m_devices;
+    std::unordered_map<uint64_t, size_t> m_index;
+    std::priority_queue<TxFrame, std::vector<TxFrame>, std::greater<TxFrame>> m_tx_queue;
+    std::vector<size_t> m_offline;
+    std::mutex m_lock;
+    std::thread m_thread;
+    std::atomic<bool> m_running{false};
+    IPAddress m_gateway_ip;
+    config_t m_config = {};
+    std::mt19937 m_random;
+    uint64_t m_next_churn_us = 0;
+    stats_t m_stats = {};
+
+    static uint64_t macKey(const uint8_t *mac)
+    {
+        uint64_t key = 0;
+        memcpy(&key, mac, 6);
+        return key;
+    }
+
+    bool chance(float probability)
+    {
+        return (probability > 0) && (std::uniform_real_distribution<float>(0, 1)(m_random) < probability);
+    }
+
+    uint64_t replyTime(uint64_t now)
+    {
+        uint64_t due = now + m_config.delay_us;
+        if (m_config.jitter_us)
+        {
+            due += std::uniform_int_distribution<uint32_t>(0, m_config.jitter_us)(m_random);
+        }
+        return due;
+    }
+
+    void setOnlineLocked(size_t index, bool online, uint64_t now)
+    {
+        Device &dev = m_devices[index];
+        if (dev.online != online)
+        {
+            dev.online = online;
+            dev.transitions.push_back(now);
+        }
+    }
+
+    void queueFrame(TxFrame &frame)
+    {
+        if (chance(m_config.loss_tx))
+        {
+            m_stats.tx_lost++;
+            return;
+        }
+        m_tx_queue.push(frame);
+    }
+
+    /* Generic header: magic | length | command | MAC | padding */
+    static void writeHeader(uint8_t *data, uint16_t command, size_t length, const uint8_t *mac)
+    {
+        memcpy(data, ORVIBO_MAGIC, sizeof(ORVIBO_MAGIC));
+        data[2] = length >> 8;
+        data[3] = length;
+        data[4] = command >> 8;
+        data[5] = command;
+        memcpy(&data[6], mac, 6);
+        memset(&data[12], 0x20, 6);
+    }
+
+    /*
+     * CMD_STATE_CHANGE (23 bytes) or the CMD_SUBSCRIBE reply (24 bytes)
+     * Both end with four zero bytes and the relay state
+     */
+    void queueStateFrame(size_t index, uint16_t command, IPAddress ip, uint16_t port, uint64_t due)
+    {
+        const Device &dev = m_devices[index];
+        TxFrame frame;
+        frame.due_us = due;
+        frame.ip = ip;
+        frame.port = port;
+        frame.length = ORVIBO_HEADER_LEN + ORVIBO_STATE_PAYLOAD_LEN + (command == CMD_SUBSCRIBE ? 1 : 0);
+        writeHeader(frame.data, command, frame.length, dev.mac);
+        memset(&frame.data[ORVIBO_HEADER_LEN], 0, frame.length - ORVIBO_HEADER_LEN);
+        frame.data[frame.length - 1] = dev.state;
+        queueFrame(frame);
+    }
+
+    /* CMD_DISCOVER reply, the firmware inserts an extra byte before the MAC */
+    void queueDiscover(size_t index, IPAddress ip, uint16_t port, uint64_t due)
+    {
+        const Device &dev = m_devices[index];
+        TxFrame frame;
+        frame.due_us = due;
+        frame.ip = ip;
+        frame.port = port;
+        frame.length = MAX_FRAME_LEN;
+        memset(frame.data, 0, sizeof(frame.data));
+        writeHeader(frame.data, CMD_DISCOVER, frame.length, dev.mac);
+        frame.data[6] = 0;
+        memcpy(&frame.data[7], dev.mac, 6);
+        memset(&frame.data[13], 0x20, 6);
+        for (int i = 0; i < 6; i++)
+        {
+            frame.data[19 + i] = dev.mac[5 - i];
+        }
+        memset(&frame.data[25], 0x20, 6);
+        memcpy(&frame.data[31], "SOC002", 6);
+        frame.data[41] = dev.state;
+        queueFrame(frame);
+    }
+
+    void handleRequest(const uint8_t *data, size_t length, IPAddress ip, uint16_t port, uint64_t now)
+    {
+        m_stats.rx++;
+        if (chance(m_config.loss_rx))
+        {
+            m_stats.rx_lost++;
+            return;
+        }
+
+        // Discovery requests are 6 bytes (broadcast, all devices answer) or a bare header
+        // with the MAC in the generic position
+        if ((length >= 6) && (memcmp(data, ORVIBO_MAGIC, 2) == 0) &&
+            (((uint16_t)data[4] << 8 | data[5]) == CMD_DISCOVER))
+        {
+            if (length == 6)
+            {
+                for (size_t i = 0; i < m_devices.size(); i++)
+                {
+                    if (m_devices[i].online)
+                    {
+                        queueDiscover(i, ip, port, replyTime(now));
+                    }
+                }
+                return;
+            }
+            if (length == ORVIBO_HEADER_LEN)
+            {
+                auto it = m_index.find(macKey(&data[6]));
+                if ((it != m_index.end()) && m_devices[it->second].online)
+                {
+                    queueDiscover(it->second, ip, port, replyTime(now));
+                }
+                return;
+            }
+        }
+
+        OrviboS20Frame frame;
+        if (OrviboS20Decoder::decode(data, length, frame) != DECODE_OK)
+        {
+            m_stats.rx_unknown++;
+            return;
+        }
+        auto it = m_index.find(macKey(frame.mac));
+        if (it == m_index.end())
+        {
+            m_stats.rx_unknown++;
+            return;
+        }
+        size_t index = it->second;
+        Device &dev = m_devices[index];
+        if (!dev.online)
+        {
+            m_stats.rx_offline++;
+            return;
+        }
+
+        switch (frame.command)
+        {
+        case CMD_SUBSCRIBE:
+            queueStateFrame(index, CMD_SUBSCRIBE, ip, port, replyTime(now));
+            break;
+        case CMD_SET_STATE:
+            if (frame.state() >= 0)
+            {
+                dev.state = frame.state() != 0;
+                queueStateFrame(index, CMD_STATE_CHANGE, ip, port, replyTime(now));
+            }
+            break;
+        default:
+            m_stats.rx_unknown++;
+            break;
+        }
+    }
+
+    void churn(uint64_t now)
+    {
+        // Bring back devices whose offline period has ended, they announce themselves
+        for (size_t i = 0; i < m_offline.size();)
+        {
+            size_t index = m_offline[i];
+            if (now >= m_devices[index].online_at_us)
+            {
+                setOnlineLocked(index, true, now);
+                queueDiscover(index, m_gateway_ip, ORVIBO_UDP_PORT, now);
+                m_offline[i] = m_offline.back();
+                m_offline.pop_back();
+            }
+            else
+            {
+                i++;
+            }
+        }
+
+        if (m_config.churn_interval_ms == 0)
+        {
+            return;
+        }
+        while (now >= m_next_churn_us)
+        {
+            m_next_churn_us += (uint64_t)m_config.churn_interval_ms * 1000;
+            size_t index = std::uniform_int_distribution<size_t>(0, m_devices.size() - 1)(m_random);
+            if (m_devices[index].online)
+            {
+                setOnlineLocked(index, false, now);
+                m_devices[index].online_at_us = now + (uint64_t)m_config.offline_ms * 1000;
+                m_offline.push_back(index);
+                m_stats.churn_events++;
+            }
+        }
+    }
+
+    /* Send all frames that are due, returns time until the next one (or 10 ms) */
+    int flush(uint64_t now)
+    {
+        OrviboS20Datagram batch[TX_BATCH_SIZE];
+        TxFrame frames[TX_BATCH_SIZE];
+        size_t count = 0;
+
+        while (!m_tx_queue.empty() && (m_tx_queue.top().due_us <= now))
+        {
+            frames[count] = m_tx_queue.top();
+            m_tx_queue.pop();
+            batch[count] = {frames[count].ip, frames[count].port, frames[count].data, frames[count].length};
+            if (++count == TX_BATCH_SIZE)
+            {
+                m_stats.tx += m_socket.sendPackets(batch, count);
+                count = 0;
+            }
+        }
+        if (count)
+        {
+            m_stats.tx += m_socket.sendPackets(batch, count);
+        }
+
+        if (m_tx_queue.empty())
+        {
+            return 10;
+        }
+        return (m_tx_queue.top().due_us - now) / 1000;
+    }
+
+    void run()
+    {
+        int timeout_ms = 0;
+        while (m_running)
+        {
+            m_socket.wait(timeout_ms);
+
+            std::lock_guard<std::mutex> guard(m_lock);
+            uint64_t now = nowUs();
+            uint8_t buffer[64];
+            int length;
+            while ((length = m_socket.parsePacket()) > 0)
+            {
+                if ((size_t)length > sizeof(buffer))
+                {
+                    m_stats.rx_unknown++;
+                    continue;
+                }
+                m_socket.read(buffer, sizeof(buffer));
+                handleRequest(buffer, length, m_socket.remoteIP(), m_socket.remotePort(), now);
+            }
+            churn(now);
+            timeout_ms = flush(nowUs());
+        }
+    }
+};
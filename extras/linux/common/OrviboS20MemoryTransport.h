@@ -0,0 +1,121 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+
+#include "OrviboS20Transport.h"
+
+/*
+ * In-memory transport for host benchmarks and simulations
+ * Datagrams queued with inject() are handed to the library by parsePacket().
+ * Sent datagrams are counted and optionally stored in sent().
+ */
+class OrviboS20MemoryTransport : public OrviboS20Transport
+{
+public:
+    struct Datagram
+    {
+        IPAddress ip;
+        uint16_t port;
+        std::vector<uint8_t> data;
+    };
+
+    /* Queue a datagram to be received by the library */
+    void inject(const uint8_t *data, size_t length, IPAddress ip = IPAddress(127, 0, 0, 2), uint16_t port = 10000)
+    {
+        m_rx_queue.push_back(Datagram{ip, port, std::vector<uint8_t>(data, data + length)});
+    }
+
+    void setKeepSent(bool keep)
+    {
+        m_keep_sent = keep;
+    }
+    std::vector<Datagram> &sent()
+    {
+        return m_sent;
+    }
+    size_t sentCount()
+    {
+        return m_sent_count;
+    }
+
+    bool begin(uint16_t port) override
+    {
+        (void)port;
+        return true;
+    }
+    void stop() override
+    {
+    }
+    int parsePacket() override
+    {
+        if (m_has_current)
+        {
+            m_rx_queue.pop_front();
+            m_has_current = false;
+        }
+        if (m_rx_queue.empty())
+        {
+            return 0;
+        }
+        m_has_current = true;
+        m_rx_pos = 0;
+        return m_rx_queue.front().data.size();
+    }
+    int read(uint8_t *buffer, size_t length) override
+    {
+        if (!m_has_current)
+        {
+            return 0;
+        }
+        const std::vector<uint8_t> &data = m_rx_queue.front().data;
+        size_t n = std::min(length, data.size() - m_rx_pos);
+        memcpy(buffer, &data[m_rx_pos], n);
+        m_rx_pos += n;
+        return n;
+    }
+    IPAddress remoteIP() override
+    {
+        return m_has_current ? m_rx_queue.front().ip : IPAddress();
+    }
+    uint16_t remotePort() override
+    {
+        return m_has_current ? m_rx_queue.front().port : 0;
+    }
+    int pending() override
+    {
+        return m_rx_queue.size() - (m_has_current ? 1 : 0);
+    }
+    int beginPacket(IPAddress ip, uint16_t port) override
+    {
+        m_tx.ip = ip;
+        m_tx.port = port;
+        m_tx.data.clear();
+        return 1;
+    }
+    size_t write(const uint8_t *buffer, size_t length) override
+    {
+        m_tx.data.insert(m_tx.data.end(), buffer, buffer + length);
+        return length;
+    }
+    int endPacket() override
+    {
+        m_sent_count++;
+        if (m_keep_sent)
+        {
+            m_sent.push_back(m_tx);
+        }
+        return 1;
+    }
+
+    using OrviboS20Transport::write;
+
+protected:
+    std::deque<Datagram> m_rx_queue;
+    bool m_has_current = false;
+    size_t m_rx_pos = 0;
+    Datagram m_tx;
+    bool m_keep_sent = false;
+    std::vector<Datagram> m_sent;
+    size_t m_sent_count = 0;
+};
@@ -0,0 +1,384 @@
+#pragma once
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "OrviboS20MemoryTransport.h"
+#include "OrviboS20WiFiLink.h"
+
+/*
+ * Emulator of S20 devices in pairing (AP) mode for host benchmarks and tests
+ *
+ * Emulates both the WiFi station (scan/connect, used as the OrviboS20WiFiLink of
+ * OrviboS20WiFiPairClass) and the HF-LPB100 WiFi module of each device. The module
+ * answers the datagrams that the library sends with transport while connected to its
+ * "WiWo-S20" AP:
+ *  - HF-A11ASSISTHREAD is answered with "<ip>,<mac>,HF-LPB100"
+ *  - "+ok" enters command mode, AT commands are ignored before that
+ *  - AT+WSSSID, AT+WSKEY and AT+WMODE are validated and answered with +ok or +ERR
+ *  - AT+Z reboots the module, it joins the configured network and its AP disappears
+ *
+ * Loss and delay are configured with setConfig(). All times are based on millis() so
+ * the emulator can run on a virtual clock (see orviboSetHostClock()). Call handle()
+ * after each OrviboS20WiFiPairClass::handle().
+ */
+class OrviboS20PairEmulator : public OrviboS20WiFiLink
+{
+public:
+    struct config_t
+    {
+        float loss_rx;       /* Probability that a datagram to the module is lost */
+        float loss_tx;       /* Probability that a reply from the module is lost */
+        uint32_t delay_ms;   /* Fixed delay of each reply */
+        uint32_t jitter_ms;  /* Random extra delay 0..jitter_ms */
+        uint32_t scan_ms;    /* Duration of a scan */
+        uint32_t connect_ms; /* Time to join a device AP */
+        uint32_t seed;
+    };
+
+    struct stats_t
+    {
+        uint32_t rx;      /* Datagrams received by the modules */
+        uint32_t rx_lost; /* Datagrams dropped by the loss model */
+        uint32_t tx;      /* Replies sent */
+        uint32_t tx_lost; /* Replies dropped by the loss model */
+        uint32_t errors;  /* +ERR replies */
+    };
+
+    OrviboS20PairEmulator(OrviboS20MemoryTransport &transport, size_t count = 1) : m_transport(transport), m_devices(count)
+    {
+        m_transport.setKeepSent(true);
+        m_config.delay_ms = 5;
+        m_config.scan_ms = 2000;
+        m_config.connect_ms = 1500;
+        reset();
+    }
+
+    /* BSSID of emulated device index */
+    static void makeBssid(size_t index, uint8_t *bssid)
+    {
+        bssid[0] = 0xAC;
+        bssid[1] = 0xCF;
+        bssid[2] = 0x23;
+        bssid[3] = 0x00;
+        bssid[4] = index >> 8;
+        bssid[5] = index;
+    }
+
+    void setConfig(const config_t &config)
+    {
+        m_config = config;
+        m_random.seed(config.seed);
+    }
+
+    /* Put all devices back in pairing mode */
+    void reset()
+    {
+        for (size_t i = 0; i < m_devices.size(); i++)
+        {
+            m_devices[i] = Device();
+            makeBssid(i, m_devices[i].bssid);
+        }
+        m_connected = -1;
+        m_connecting = -1;
+        m_scan_done = 0;
+        m_scanning = false;
+        m_replies.clear();
+        m_transport.sent().clear();
+        m_stats = stats_t();
+    }
+
+    /* True once the device has rebooted with a station configuration */
+    bool isConfigured(size_t index)
+    {
+        return m_devices[index].configured;
+    }
+    const char *getSsid(size_t index)
+    {
+        return m_devices[index].ssid.c_str();
+    }
+    const char *getKey(size_t index)
+    {
+        return m_devices[index].key.c_str();
+    }
+
+    const stats_t &getStats()
+    {
+        return m_stats;
+    }
+
+    /* Handles the datagrams sent by the library and delivers the replies that are due */
+    void handle()
+    {
+        receiveSent();
+        if ((m_connecting >= 0) && due(m_connect_done))
+        {
+            m_connected = m_connecting;
+            m_connecting = -1;
+        }
+        while (!m_replies.empty() && due(m_replies.front().time))
+        {
+            // Replies sent by a device we're no longer connected to are never received
+            if (m_replies.front().device == m_connected)
+            {
+                const std::string &data = m_replies.front().data;
+                m_transport.inject((const uint8_t *)data.data(), data.size(), IPAddress(10, 10, 100, 254), 48899);
+            }
+            m_replies.erase(m_replies.begin());
+        }
+    }
+
+    /* OrviboS20WiFiLink */
+    void disconnect() override
+    {
+        // Whatever was sent before the disconnect has already left
+        receiveSent();
+        m_connected = -1;
+        m_connecting = -1;
+    }
+    void scanNetworks() override
+    {
+        m_scanning = true;
+        m_scan_done = millis() + m_config.scan_ms;
+        m_scan_results.clear();
+        for (size_t i = 0; i < m_devices.size(); i++)
+        {
+            if (!m_devices[i].configured)
+            {
+                m_scan_results.push_back(i);
+            }
+        }
+    }
+    int scanComplete() override
+    {
+        if (!m_scanning || !due(m_scan_done))
+        {
+            return -1;
+        }
+        return m_scan_results.size();
+    }
+    bool getNetwork(int index, char *ssid, size_t ssid_size, uint8_t *bssid, int32_t &channel) override
+    {
+        if ((index < 0) || ((size_t)index >= m_scan_results.size()))
+        {
+            return false;
+        }
+        size_t device = m_scan_results[index];
+        snprintf(ssid, ssid_size, "WiWo-S20");
+        memcpy(bssid, m_devices[device].bssid, 6);
+        channel = 1 + device % 11;
+        return true;
+    }
+    void begin(const char *ssid, const char *passphrase, int32_t channel, const uint8_t *bssid) override
+    {
+        (void)passphrase;
+        (void)channel;
+        disconnect();
+        if (strcmp(ssid, "WiWo-S20") != 0)
+        {
+            return;
+        }
+        for (size_t i = 0; i < m_devices.size(); i++)
+        {
+            if (!m_devices[i].configured && ((bssid == nullptr) || (memcmp(bssid, m_devices[i].bssid, 6) == 0)))
+            {
+                m_connecting = i;
+                m_connect_done = millis() + m_config.connect_ms;
+                return;
+            }
+        }
+    }
+    bool isConnected() override
+    {
+        return m_connected >= 0;
+    }
+    const uint8_t *BSSID() override
+    {
+        return (m_connected >= 0) ? m_devices[m_connected].bssid : nullptr;
+    }
+    IPAddress broadcastIP() override
+    {
+        return IPAddress(10, 10, 100, 255);
+    }
+
+protected:
+    struct Device
+    {
+        uint8_t bssid[6];
+        bool command_mode = false;
+        bool configured = false;
+        bool sta_mode = false;
+        std::string ssid;
+        std::string key;
+    };
+
+    struct Reply
+    {
+        uint32_t time;
+        int device;
+        std::string data;
+    };
+
+    OrviboS20MemoryTransport &m_transport;
+    config_t m_config = {};
+    std::mt19937 m_random;
+    std::vector<Device> m_devices;
+    std::vector<size_t> m_scan_results;
+    std::vector<Reply> m_replies; /* Sorted by time */
+    stats_t m_stats = {};
+    int m_connected;
+    int m_connecting;
+    uint32_t m_connect_done = 0;
+    uint32_t m_scan_done;
+    bool m_scanning;
+
+    static bool due(uint32_t time)
+    {
+        return (int32_t)(millis() - time) >= 0;
+    }
+
+    bool chance(float probability)
+    {
+        return (probability > 0) && (std::uniform_real_distribution<float>(0, 1)(m_random) < probability);
+    }
+
+    static bool startsWith(const std::string &str, const char *prefix)
+    {
+        return str.compare(0, strlen(prefix), prefix) == 0;
+    }
+
+    void receiveSent()
+    {
+        std::vector<OrviboS20MemoryTransport::Datagram> &sent = m_transport.sent();
+        for (const OrviboS20MemoryTransport::Datagram &datagram : sent)
+        {
+            if (m_connected < 0)
+            {
+                continue;
+            }
+            m_stats.rx++;
+            if (chance(m_config.loss_rx))
+            {
+                m_stats.rx_lost++;
+                continue;
+            }
+            receive(m_devices[m_connected], std::string(datagram.data.begin(), datagram.data.end()));
+        }
+        sent.clear();
+    }
+
+    void reply(const Device &dev, const char *data)
+    {
+        if (strncmp(data, "+ERR", 4) == 0)
+        {
+            m_stats.errors++;
+        }
+        m_stats.tx++;
+        if (chance(m_config.loss_tx))
+        {
+            m_stats.tx_lost++;
+            return;
+        }
+        uint32_t delay = m_config.delay_ms;
+        if (m_config.jitter_ms)
+        {
+            delay += std::uniform_int_distribution<uint32_t>(0, m_config.jitter_ms)(m_random);
+        }
+        Reply r = {(uint32_t)(millis() + delay), (int)(&dev - &m_devices[0]), data};
+        auto pos = m_replies.end();
+        while ((pos != m_replies.begin()) && ((int32_t)((pos - 1)->time - r.time) > 0))
+        {
+            --pos;
+        }
+        m_replies.insert(pos, r);
+    }
+
+    void receive(Device &dev, const std::string &data)
+    {
+        if (data == "HF-A11ASSISTHREAD")
+        {
+            char assist[64];
+            snprintf(assist, sizeof(assist), "10.10.100.254,%02X%02X%02X%02X%02X%02X,HF-LPB100",
+                     dev.bssid[0], dev.bssid[1], dev.bssid[2], dev.bssid[3], dev.bssid[4], dev.bssid[5]);
+            reply(dev, assist);
+            return;
+        }
+        if (data == "+ok")
+        {
+            dev.command_mode = true;
+            return;
+        }
+        if (!dev.command_mode || !startsWith(data, "AT+") || (data.back() != '\r'))
+        {
+            return;
+        }
+        std::string command = data.substr(3, data.size() - 4);
+        std::string value;
+        size_t equals = command.find('=');
+        if (equals != std::string::npos)
+        {
+            value = command.substr(equals + 1);
+            command.resize(equals);
+        }
+
+        if (command == "WSSSID")
+        {
+            if (value.empty() || (value.size() > 32))
+            {
+                return reply(dev, "+ERR=-4\r\n\r\n");
+            }
+            dev.ssid = value;
+        }
+        else if (command == "WSKEY")
+        {
+            // auth,encryption,key
+            size_t first = value.find(',');
+            size_t second = (first == std::string::npos) ? first : value.find(',', first + 1);
+            if (second == std::string::npos)
+            {
+                return reply(dev, "+ERR=-4\r\n\r\n");
+            }
+            std::string auth = value.substr(0, first);
+            std::string key = value.substr(second + 1);
+            bool open = (auth == "OPEN");
+            if (!open && (auth != "WPAPSK") && (auth != "WPA2PSK"))
+            {
+                return reply(dev, "+ERR=-4\r\n\r\n");
+            }
+            if (!open && ((key.size() < 8) || (key.size() > 63)))
+            {
+                return reply(dev, "+ERR=-4\r\n\r\n");
+            }
+            dev.key = key;
+        }
+        else if (command == "WMODE")
+        {
+            if ((value != "STA") && (value != "AP"))
+            {
+                return reply(dev, "+ERR=-4\r\n\r\n");
+            }
+            dev.sta_mode = (value == "STA");
+        }
+        else if (command == "Z")
+        {
+            // Reboot without reply, the AP is gone if a station config is in place
+            dev.command_mode = false;
+            if (dev.sta_mode && !dev.ssid.empty())
+            {
+                dev.configured = true;
+                if (&dev == &m_devices[m_connected])
+                {
+                    m_connected = -1;
+                    m_connecting = -1;
+                }
+            }
+            return;
+        }
+        else
+        {
+            return reply(dev, "+ERR=-1\r\n\r\n");
+        }
+        reply(dev, "+ok\r\n\r\n");
+    }
+};
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "OrviboS20.h"
+#include "OrviboS20Capture.h"
+#include "OrviboS20MemoryTransport.h"
+
+/* Capture sink writing to a stdio file */
+class OrviboS20FileCaptureSink : public OrviboS20CaptureSink
+{
+public:
+    OrviboS20FileCaptureSink(FILE *file) : m_file(file) {}
+
+    bool write(const uint8_t *data, size_t length) override
+    {
+        return fwrite(data, 1, length, m_file) == length;
+    }
+
+protected:
+    FILE *m_file;
+};
+
+/*
+ * Feeds a capture (see OrviboS20Capture.h) back through an OrviboS20Class instance
+ *
+ * Received datagrams are injected through an in-memory transport and handle() is called
+ * at the time of each record, so timers fire at the same points as in the recording.
+ * The datagrams sent by the library are compared with the ones in the capture.
+ * Truncated datagrams are injected with their original size (the missing bytes are
+ * zero) so the library classifies them as it did when they were recorded.
+ *
+ * REPLAY_FLAT_OUT runs on a virtual clock (see orviboSetHostClock()) that jumps from
+ * record to record, which makes the run deterministic and as fast as possible.
+ * REPLAY_RECORDED_SPEED uses the real clock and sleeps between the records.
+ */
+class OrviboS20Replay
+{
+public:
+    enum Mode
+    {
+        REPLAY_RECORDED_SPEED,
+        REPLAY_FLAT_OUT
+    };
+
+    struct result_t
+    {
+        uint32_t rx_records;    /* Datagrams injected */
+        uint32_t tx_expected;   /* Datagrams sent in the capture */
+        uint32_t tx_sent;       /* Datagrams sent during the replay */
+        uint32_t tx_mismatched; /* Positions where the sent datagram differs from the capture */
+        uint32_t handle_calls;
+        uint64_t elapsed_us;    /* Wall time of the replay */
+    };
+
+    /* Read a capture file, returns false if it can't be read or isn't a capture */
+    bool load(const char *path)
+    {
+        FILE *file = fopen(path, "rb");
+        if (file == nullptr)
+        {
+            return false;
+        }
+        m_data.clear();
+        uint8_t buffer[4096];
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        {
+            m_data.insert(m_data.end(), buffer, buffer + n);
+        }
+        fclose(file);
+        return OrviboS20CaptureReader(m_data.data(), m_data.size()).isValid();
+    }
+
+    /* Reader for the loaded capture, e.g. to create the devices before run() */
+    OrviboS20CaptureReader reader()
+    {
+        return OrviboS20CaptureReader(m_data.data(), m_data.size());
+    }
+
+    /* Virtual time in flat out mode, microseconds from the start of the capture */
+    static uint64_t virtualTime()
+    {
+        return virtualClock();
+    }
+
+    /*
+     * Replay the capture through gateway
+     * The devices must already be created. begin() and stop() are called by run(), the
+     * default transport of gateway is replaced by the replay transport.
+     */
+    result_t run(OrviboS20Class &gateway, Mode mode)
+    {
+        result_t result = {};
+        OrviboS20MemoryTransport transport;
+        transport.setKeepSent(true);
+        std::vector<OrviboS20CaptureRecord> expected;
+        std::vector<uint8_t> datagram;
+
+        if (mode == REPLAY_FLAT_OUT)
+        {
+            virtualClock() = 0;
+            orviboSetHostClock(&virtualTime);
+        }
+        auto start = std::chrono::steady_clock::now();
+        gateway.setTransport(&transport);
+        gateway.begin();
+
+        OrviboS20CaptureReader capture = reader();
+        OrviboS20CaptureRecord record;
+        while (capture.next(record))
+        {
+            if (mode == REPLAY_FLAT_OUT)
+            {
+                virtualClock() = record.time_us;
+            }
+            else
+            {
+                std::this_thread::sleep_until(start + std::chrono::microseconds(record.time_us));
+            }
+
+            if (record.direction == CAPTURE_RX)
+            {
+                datagram.assign(record.data, record.data + record.length);
+                datagram.resize(record.orig_length);
+                transport.inject(datagram.data(), datagram.size(), record.ip, record.port);
+                result.rx_records++;
+            }
+            else
+            {
+                expected.push_back(record);
+            }
+            do
+            {
+                gateway.handle();
+                result.handle_calls++;
+            } while (gateway.getRxReport().pending > 0);
+        }
+
+        gateway.stop();
+        orviboSetHostClock(nullptr);
+        result.elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+        const std::vector<OrviboS20MemoryTransport::Datagram> &sent = transport.sent();
+        result.tx_expected = expected.size();
+        result.tx_sent = sent.size();
+        for (size_t i = 0; i < expected.size() || i < sent.size(); i++)
+        {
+            if ((i >= expected.size()) || (i >= sent.size()) ||
+                (expected[i].ip != sent[i].ip) || (expected[i].port != sent[i].port) ||
+                (expected[i].orig_length != sent[i].data.size()) ||
+                (memcmp(expected[i].data, sent[i].data.data(), expected[i].length) != 0))
+            {
+                result.tx_mismatched++;
+            }
+        }
+        return result;
+    }
+
+protected:
+    std::vector<uint8_t> m_data;
+
+    static uint64_t &virtualClock()
+    {
+        static uint64_t s_virtual_us = 0;
+        return s_virtual_us;
+    }
+};
@@ -0,0 +1,82 @@
+/*
+ * This example illustrates the C++20 coroutine interface (OrviboS20Coroutine.h)
+ *
+ * It waits for an S20 device to show up, then toggles its relay each 10 sec and
+ * prints the result and round-trip time of each command. The sequence is written as
+ * straight-line code, the coroutine is resumed from OrviboS20.handle().
+ */
+// Build:
+//   g++ -O2 -std=c++20 -I../../../../src ../../../../src/*.cpp Coroutine.cpp -o coroutine
+#include <stdio.h>
+
+#include "OrviboS20.h"
+#include "OrviboS20Coroutine.h"
+#include "OrviboS20PosixTransport.h"
+
+OrviboS20PosixTransport transport;
+OrviboS20Device s20("Plug1");
+
+static bool busy = false;
+
+OrviboS20Task discover()
+{
+  busy = true;
+  OrviboS20FoundOutcome found = co_await orviboDiscover(OrviboS20, 10000);
+  if (found)
+  {
+    printf("Found %02x:%02x:%02x:%02x:%02x:%02x\n",
+           found.mac[0], found.mac[1], found.mac[2], found.mac[3], found.mac[4], found.mac[5]);
+  }
+  else
+  {
+    printf("No new device within 10 sec\n");
+  }
+  busy = false;
+}
+
+OrviboS20Task toggle()
+{
+  busy = true;
+  bool state = !s20.getState();
+  OrviboS20CommandOutcome outcome = co_await orviboSetState(s20, state);
+  if (outcome)
+  {
+    printf("Relay %s, round-trip time %u us\n", state ? "on" : "off", outcome.rtt_us);
+  }
+  else
+  {
+    printf("Command failed (%d)\n", outcome.result);
+  }
+  busy = false;
+}
+
+int main()
+{
+  OrviboS20.setTransport(&transport);
+  if (!OrviboS20.begin())
+  {
+    perror("OrviboS20.begin()");
+    return 1;
+  }
+
+  unsigned long lastTime = millis();
+  while (true)
+  {
+    transport.wait(100);
+    OrviboS20.handle();
+
+    if (!busy && (millis() - lastTime > 10000))
+    {
+      lastTime = millis();
+      if (s20.isConnected())
+      {
+        toggle();
+      }
+      else
+      {
+        discover();
+      }
+    }
+  }
+  return 0;
+}
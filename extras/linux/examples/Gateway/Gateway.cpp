@@ -0,0 +1,84 @@
+/*
+ * This example illustrates how to run OrviboS20 as a gateway process on a Linux host
+ *
+ * The Linux host must be on the same network as the S20 devices (for example acting
+ * as their WiFi AP). The example controls any S20 device found and toggles its relay
+ * each 10 sec.
+ *
+ * Usage: gateway [capture file]
+ * If a capture file is given all traffic is recorded in it until Ctrl-C, see the
+ * Replay example for how to replay it.
+ */
+// Build:
+//   g++ -O2 -std=c++11 -I../../../../src -I../../common ../../../../src/*.cpp Gateway.cpp -o gateway
+#include <signal.h>
+#include <stdio.h>
+
+#include "OrviboS20.h"
+#include "OrviboS20Capture.h"
+#include "OrviboS20PosixTransport.h"
+#include "OrviboS20Replay.h"
+
+OrviboS20PosixTransport transport;
+OrviboS20Device s20("Plug1");
+
+static volatile sig_atomic_t running = 1;
+
+int main(int argc, char *argv[])
+{
+  s20.onConnect([](OrviboS20Device &device) {
+    printf("S20 device \"%s\" connected\n", device.getName());
+  });
+  s20.onDisconnect([](OrviboS20Device &device) {
+    printf("S20 device \"%s\" disconnected\n", device.getName());
+  });
+  s20.onStateChange([](OrviboS20Device &device, bool new_state) {
+    printf("S20 device \"%s\" changed state to: %d\n", device.getName(), new_state);
+  });
+  OrviboS20.onFoundDevice([](uint8_t *mac) {
+    printf("New Orvibo device detected, MAC: %02x:%02x:%02x:%02x:%02x:%02x\n",
+           mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  });
+
+  FILE *captureFile = nullptr;
+  if (argc > 1)
+  {
+    captureFile = fopen(argv[1], "wb");
+    if (captureFile == nullptr)
+    {
+      perror(argv[1]);
+      return 1;
+    }
+  }
+  OrviboS20FileCaptureSink captureSink(captureFile);
+  OrviboS20CaptureTransport capture(transport, captureSink);
+
+  OrviboS20.setTransport(captureFile ? (OrviboS20Transport *)&capture : &transport);
+  if (!OrviboS20.begin())
+  {
+    perror("OrviboS20.begin()");
+    return 1;
+  }
+
+  signal(SIGINT, [](int) { running = 0; });
+  unsigned long lastTime = millis();
+  while (running)
+  {
+    // Sleep until there is something to read, but wake up regularly for the timers
+    transport.wait(100);
+    OrviboS20.handle();
+
+    if (millis() - lastTime > 10000)
+    {
+      lastTime = millis();
+      s20.setState(!s20.getState());
+    }
+  }
+
+  OrviboS20.stop();
+  if (captureFile)
+  {
+    fclose(captureFile);
+  }
+  return 0;
+}
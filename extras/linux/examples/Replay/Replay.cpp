@@ -0,0 +1,104 @@
+/*
+ * This example replays a capture recorded with OrviboS20CaptureTransport (for example
+ * with "gateway capture.os2c") through the library
+ *
+ * A device is created for each MAC found in the capture and all callbacks are printed
+ * with their (capture) time, so the output of two library versions can be diffed to
+ * check that behaviour and callback ordering did not change. The datagrams sent by the
+ * library are compared with the ones in the capture.
+ *
+ * Usage: replay <capture file> [--realtime]
+ * By default the capture is replayed as fast as possible on a virtual clock.
+ */
+// Build:
+//   g++ -O2 -std=c++11 -I../../../../src -I../../common ../../../../src/*.cpp Replay.cpp -o replay
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "OrviboS20.h"
+#include "OrviboS20Replay.h"
+
+static void printMac(const uint8_t *mac)
+{
+  printf("%02x:%02x:%02x:%02x:%02x:%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2)
+  {
+    printf("Usage: %s <capture file> [--realtime]\n", argv[0]);
+    return 1;
+  }
+  bool realtime = (argc > 2) && (strcmp(argv[2], "--realtime") == 0);
+
+  OrviboS20Replay replay;
+  if (!replay.load(argv[1]))
+  {
+    printf("Could not read capture %s\n", argv[1]);
+    return 1;
+  }
+
+  // One device per MAC, in the order they first show up
+  std::vector<OrviboS20Device *> devices;
+  OrviboS20CaptureReader reader = replay.reader();
+  OrviboS20CaptureRecord record;
+  while (reader.next(record))
+  {
+    OrviboS20Frame frame;
+    if ((record.direction != CAPTURE_RX) || (OrviboS20Decoder::decode(record.data, record.length, frame) != DECODE_OK))
+    {
+      continue;
+    }
+    bool known = false;
+    for (OrviboS20Device *dev : devices)
+    {
+      known = known || (memcmp(dev->getMac(), frame.mac, 6) == 0);
+    }
+    if (!known)
+    {
+      devices.push_back(new OrviboS20Device(frame.mac));
+    }
+  }
+
+  for (OrviboS20Device *dev : devices)
+  {
+    dev->onConnect([](OrviboS20Device &device) {
+      printf("%10lu connect ", millis());
+      printMac(device.getMac());
+      printf("\n");
+    });
+    dev->onDisconnect([](OrviboS20Device &device) {
+      printf("%10lu disconnect ", millis());
+      printMac(device.getMac());
+      printf("\n");
+    });
+    dev->onStateChange([](OrviboS20Device &device, bool new_state) {
+      printf("%10lu state ", millis());
+      printMac(device.getMac());
+      printf(" %d\n", new_state);
+    });
+  }
+  OrviboS20.onFoundDevice([](uint8_t *mac) {
+    printf("%10lu found ", millis());
+    printMac(mac);
+    printf("\n");
+  });
+
+  OrviboS20Replay::result_t result = replay.run(OrviboS20, realtime ? OrviboS20Replay::REPLAY_RECORDED_SPEED : OrviboS20Replay::REPLAY_FLAT_OUT);
+
+  OrviboS20Metrics metrics = OrviboS20.getMetrics();
+  printf("\n%u devices, %u received, %u sent (%u in capture, %u differ), %u handle() calls in %llu us\n",
+         (unsigned)devices.size(), result.rx_records, result.tx_sent, result.tx_expected, result.tx_mismatched,
+         result.handle_calls, (unsigned long long)result.elapsed_us);
+  printf("dropped: short %u, magic %u, length %u, unknown MAC %u, oversized %u\n",
+         metrics.rx_dropped[DROP_TOO_SHORT], metrics.rx_dropped[DROP_BAD_MAGIC], metrics.rx_dropped[DROP_BAD_LENGTH],
+         metrics.rx_dropped[DROP_UNKNOWN_MAC], metrics.rx_dropped[DROP_OVERSIZED]);
+
+  for (OrviboS20Device *dev : devices)
+  {
+    delete dev;
+  }
+  return 0;
+}
@@ -0,0 +1,86 @@
+/*
+ * libFuzzer target for the receive path
+ *
+ * Each input is checked by OrviboS20Decoder on its own (the decoded view must stay
+ * inside the input) and then fed through OrviboS20.handle() as a received datagram
+ * so device lookup, "any MAC" binding and the command handlers are covered as well.
+ */
+// Build and run (clang):
+//   clang++ -g -O1 -std=c++11 -fsanitize=fuzzer,address,undefined -I../../../src -I../common ../../../src/*.cpp DecoderFuzzer.cpp -o decoder_fuzzer
+//   ./decoder_fuzzer
+//
+// Without libFuzzer the same target can replay files (e.g. a crash reproducer):
+//   g++ -g -std=c++11 -fsanitize=address,undefined -DORVIBO_FUZZ_STANDALONE -I../../../src -I../common ../../../src/*.cpp DecoderFuzzer.cpp -o decoder_fuzzer
+//   ./decoder_fuzzer crash-file...
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "OrviboS20.h"
+#include "OrviboS20MemoryTransport.h"
+
+static OrviboS20MemoryTransport transport;
+static OrviboS20Device any_device("any");
+
+static void checkFrame(const uint8_t *data, size_t size)
+{
+    OrviboS20Frame frame;
+    if (OrviboS20Decoder::decode(data, size, frame) != DECODE_OK)
+    {
+        return;
+    }
+    const uint8_t *end = data + size;
+    if ((frame.mac < data) || (frame.mac + 6 > end) ||
+        (frame.payload < data) || (frame.payload + frame.payload_length != end))
+    {
+        abort();
+    }
+    // Touch every byte so the sanitizers see any out of bounds view
+    volatile uint8_t sum = 0;
+    for (size_t i = 0; i < 6; i++)
+    {
+        sum = sum + frame.mac[i];
+    }
+    for (size_t i = 0; i < frame.payload_length; i++)
+    {
+        sum = sum + frame.payload[i];
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static bool started = false;
+    if (!started)
+    {
+        OrviboS20.setTransport(&transport);
+        OrviboS20.onFoundDevice([](uint8_t *mac) { (void)mac; });
+        OrviboS20.begin();
+        started = true;
+    }
+
+    checkFrame(data, size);
+
+    transport.inject(data, size);
+    OrviboS20.handle();
+    return 0;
+}
+
+#ifdef ORVIBO_FUZZ_STANDALONE
+int main(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        FILE *f = fopen(argv[i], "rb");
+        if (f == nullptr)
+        {
+            perror(argv[i]);
+            return 1;
+        }
+        uint8_t buffer[4096];
+        size_t size = fread(buffer, 1, sizeof(buffer), f);
+        fclose(f);
+        LLVMFuzzerTestOneInput(buffer, size);
+        printf("%s: ok\n", argv[i]);
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,14 @@
+/*
+ * Regression test: a global OrviboS20Device in a translation unit that is initialized
+ * before OrviboS20.cpp (it is linked first) is also destroyed after the global
+ * OrviboS20 instance, and its destructor must not touch freed memory.
+ * Built with AddressSanitizer the test fails with a heap-use-after-free at exit if it does.
+ */
+// Build (GlobalDevice.cpp must come before the library sources):
+//   g++ -O2 -std=c++11 -fsanitize=address -I../../../../src -I../../common GlobalDevice.cpp ../../../../src/*.cpp Main.cpp -o global_device
+#include "OrviboS20.h"
+
+static const uint8_t MAC[6] = {0xAC, 0xCF, 0x23, 0x00, 0x00, 0x01};
+
+OrviboS20Device globalDevice(MAC, "Global");
+OrviboS20Device globalAnyMacDevice("GlobalAny");
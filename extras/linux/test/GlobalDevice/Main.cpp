@@ -0,0 +1,22 @@
+#include <stdio.h>
+
+#include "OrviboS20.h"
+#include "OrviboS20MemoryTransport.h"
+
+extern OrviboS20Device globalDevice;
+
+int main()
+{
+  // A state change from the global device is looked up through the MAC index
+  OrviboS20MemoryTransport transport;
+  OrviboS20.setTransport(&transport);
+  OrviboS20.begin();
+  const uint8_t frame[] = {0x68, 0x64, 0x00, 0x17, 0x73, 0x66, 0xAC, 0xCF, 0x23, 0x00, 0x00, 0x01,
+                           0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x00, 0x00, 0x00, 0x00, 0x01};
+  transport.inject(frame, sizeof(frame));
+  OrviboS20.handle();
+  bool ok = globalDevice.isConnected() && globalDevice.getState();
+  OrviboS20.stop();
+  printf("%s\n", ok ? "OK" : "FAILED: global device not found");
+  return ok ? 0 : 1;
+}
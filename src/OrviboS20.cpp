@@ -1,39 +1,23 @@
-#include <ESP8266WiFi.h>
-#include <WiFiUDP.h>
 #include "OrviboS20.h"
-
-/***********************************************************************************
- * Types
- ***********************************************************************************/
-
-struct
-{
-    uint8_t mac[6];
-    bool used;
-} mac_entry_t;
+#include "OrviboS20MacIndex.h"
+#include "OrviboS20Protocol.h"
+#include "OrviboS20PosixTransport.h"
 
 /***********************************************************************************
  * Consts
  ***********************************************************************************/
 
-#define MAX_ORVIBO_DEVICES 10
-
-static const unsigned int ORVIBO_UDP_PORT = 10000;
-static const uint16_t ORVIBO_HEADER_LEN = 2 /*magic*/ + 2 /*len*/ + 2 /*cmd*/ + 6 /*mac*/ + 6 /*pad*/;
-static const uint8_t ORVIBO_MAGIC[] = {0x68, 0x64};
 static const uint8_t ORVIBO_MAC[] = {0xAC, 0xCF, 0x23};
 
-static const uint16_t CMD_SUBSCRIBE = 0x636C;
-static const uint16_t CMD_SET_STATE = 0x6463;
-static const uint16_t CMD_DISCOVER = 0x7161;
-static const uint16_t CMD_STATE_CHANGE = 0x7366;
-
 static const uint8_t MAC_PADDING[] = {0x20, 0x20, 0x20, 0x20, 0x20, 0x20};
 static const uint8_t ZERO_MAC[] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+static const size_t MAX_PAYLOAD_LEN = 32;
+/* Discovery request without MAC, answered by all devices */
+static const uint8_t DISCOVER_ALL_FRAME[] = {0x68, 0x64, 0x00, 0x06, 0x71, 0x61};
 
 static const unsigned int SUBSCRIBE_INTERVAL_MS = 1000 * 60;
 static const unsigned int CONNECTION_TMO_MS = 1000 * 150;
-static const unsigned int CHECK_TMO_INTERVAL_MS = 1000 * 10;
+static const uint32_t PROBE_MIN_TIMEOUT_MS = 200;
 
 /***********************************************************************************
  * Variables
@@ -45,98 +29,268 @@ OrviboS20Class OrviboS20;
  * Static functions
  ***********************************************************************************/
 
-static void reverse(uint8_t *dst, uint8_t *src, size_t len)
+static void reverse(uint8_t *dst, const uint8_t *src, size_t len)
 {
-    for (int i = 0; i < len; i++)
+    for (size_t i = 0; i < len; i++)
     {
         dst[len - i - 1] = src[i];
     }
 }
 
-/***********************************************************************************
- * Singleton class for shared data between OrviboS20Device and OrviboS20Class
- ***********************************************************************************/
+static void setFrameHeader(uint8_t *frame, uint16_t command, size_t payload_length)
+{
+    uint16_t tot_len = ORVIBO_HEADER_LEN + payload_length;
+    frame[2] = tot_len >> 8;
+    frame[3] = tot_len;
+    frame[4] = command >> 8;
+    frame[5] = command;
+}
 
-class SharedData
+static OrviboS20Transport *getDefaultTransport()
 {
-private:
-    OrviboS20Device *m_device_list = nullptr;
+#if defined(ARDUINO)
+    static OrviboS20WiFiUDPTransport transport;
+    return &transport;
+#elif defined(ORVIBO_HAS_POSIX_TRANSPORT)
+    static OrviboS20PosixTransport transport;
+    return &transport;
+#else
+    return nullptr;
+#endif
+}
 
-public:
-    WiFiUDP udp;
+/***********************************************************************************
+ * OrviboS20Registry class definition
+ ***********************************************************************************/
 
-    static SharedData &getInstance()
+void OrviboS20Registry::addToAnyMacList(OrviboS20Device *dev)
+{
+    // Keep registration order so the first created "any MAC" device is bound first
+    OrviboS20Device **iter = &m_any_mac_list;
+    while (*iter)
     {
-        static SharedData instance;
-        return instance;
+        iter = &(*iter)->m_next_any_mac;
     }
+    dev->m_next_any_mac = nullptr;
+    *iter = dev;
+}
 
-    void addDeviceToList(OrviboS20Device *dev)
+void OrviboS20Registry::removeFromAnyMacList(OrviboS20Device *dev)
+{
+    OrviboS20Device **iter = &m_any_mac_list;
+    while (*iter)
     {
-        if (m_device_list == nullptr)
+        if (*iter == dev)
         {
-            m_device_list = dev;
+            *iter = dev->m_next_any_mac;
+            break;
         }
-        else
+        iter = &(*iter)->m_next_any_mac;
+    }
+}
+
+void OrviboS20Registry::addDeviceToList(OrviboS20Device *dev)
+{
+    dev->m_prev = m_device_list_tail;
+    dev->m_next = nullptr;
+    if (m_device_list_tail)
+    {
+        m_device_list_tail->m_next = dev;
+    }
+    else
+    {
+        m_device_list = dev;
+    }
+    m_device_list_tail = dev;
+    m_device_count++;
+
+    if (dev->m_any_mac)
+    {
+        addToAnyMacList(dev);
+    }
+    else
+    {
+        // If there already is a device with the same MAC that one will be used
+        m_mac_index.insert(dev);
+    }
+}
+
+void OrviboS20Registry::removeDeviceFromList(OrviboS20Device *dev)
+{
+    if (m_subscribe_cursor == dev)
+    {
+        m_subscribe_cursor = dev->m_next;
+    }
+    if (m_discovery_cursor == dev)
+    {
+        m_discovery_cursor = dev->m_next;
+    }
+    m_device_count--;
+
+    if (dev->m_prev)
+    {
+        dev->m_prev->m_next = dev->m_next;
+    }
+    else
+    {
+        m_device_list = dev->m_next;
+    }
+    if (dev->m_next)
+    {
+        dev->m_next->m_prev = dev->m_prev;
+    }
+    else
+    {
+        m_device_list_tail = dev->m_prev;
+    }
+
+    if (dev->m_any_mac)
+    {
+        removeFromAnyMacList(dev);
+    }
+    else if (m_mac_index.remove(dev))
+    {
+        // Let any other device with the same MAC take over
+        for (OrviboS20Device *iter = m_device_list; iter; iter = iter->m_next)
         {
-            OrviboS20Device *iter = m_device_list;
-            while (iter->m_next)
+            if (!iter->m_any_mac && memcmp(iter->m_mac, dev->m_mac, 6) == 0)
             {
-                iter = iter->m_next;
+                m_mac_index.insert(iter);
+                break;
             }
-            iter->m_next = dev;
         }
     }
+}
+
+void OrviboS20Registry::addPending(OrviboS20Device *dev)
+{
+    dev->m_next_pending = m_pending_list;
+    m_pending_list = dev;
+}
+
+void OrviboS20Registry::addQueued(OrviboS20Device *dev)
+{
+    dev->m_next_queued = nullptr;
+    if (m_queued_list_tail)
+    {
+        m_queued_list_tail->m_next_queued = dev;
+    }
+    else
+    {
+        m_queued_list = dev;
+    }
+    m_queued_list_tail = dev;
+}
 
-    void removeDeviceFromList(OrviboS20Device *dev)
+void OrviboS20Registry::removeQueued(OrviboS20Device *dev)
+{
+    OrviboS20Device *prev = nullptr;
+    for (OrviboS20Device *iter = m_queued_list; iter; iter = iter->m_next_queued)
     {
-        if (m_device_list == dev)
+        if (iter == dev)
         {
-            m_device_list = dev->m_next;
+            if (prev)
+                prev->m_next_queued = dev->m_next_queued;
+            else
+                m_queued_list = dev->m_next_queued;
+            if (m_queued_list_tail == dev)
+                m_queued_list_tail = prev;
+            break;
         }
-        else
+        prev = iter;
+    }
+}
+
+OrviboS20Device *OrviboS20Registry::takeQueued()
+{
+    OrviboS20Device *first = m_queued_list;
+    m_queued_list = nullptr;
+    m_queued_list_tail = nullptr;
+    return first;
+}
+
+void OrviboS20Registry::removePending(OrviboS20Device *dev)
+{
+    OrviboS20Device **iter = &m_pending_list;
+    while (*iter)
+    {
+        if (*iter == dev)
         {
-            OrviboS20Device *iter = m_device_list;
-            while (iter->m_next)
-            {
-                if (iter->m_next == dev)
-                {
-                    iter->m_next = dev->m_next;
-                    break;
-                }
-                iter = iter->m_next;
-            }
+            *iter = dev->m_next_pending;
+            dev->m_next_pending = nullptr;
+            break;
         }
+        iter = &(*iter)->m_next_pending;
     }
+}
+
+OrviboS20Device *OrviboS20Registry::getNextSubscribeDevice()
+{
+    OrviboS20Device *dev = m_subscribe_cursor ? m_subscribe_cursor : m_device_list;
+    m_subscribe_cursor = dev ? dev->m_next : nullptr;
+    return dev;
+}
 
-    OrviboS20Device *getFirstDevice()
+OrviboS20Device *OrviboS20Registry::findDevice(const uint8_t *mac)
+{
+    return m_mac_index.find(mac);
+}
+
+OrviboS20Device *OrviboS20Registry::bindAnyMacDevice(const uint8_t *mac, const char *name)
+{
+    OrviboS20Device **iter = &m_any_mac_list;
+    while (name && *iter && (strncmp((*iter)->m_name, name, sizeof((*iter)->m_name)) != 0))
+    {
+        iter = &(*iter)->m_next_any_mac;
+    }
+    OrviboS20Device *dev = *iter;
+    if (dev)
     {
-        return m_device_list;
+        *iter = dev->m_next_any_mac;
+        dev->m_any_mac = false;
+        dev->m_mac_learned = true;
+        memcpy(dev->m_mac, mac, 6);
+        dev->updateFrameCache();
+        m_mac_index.insert(dev);
     }
-};
+    return dev;
+}
 
 /***********************************************************************************
  * OrviboS20Device class definition
  ***********************************************************************************/
 
-OrviboS20Device::OrviboS20Device(const char name[])
+OrviboS20Device::OrviboS20Device(const char name[], OrviboS20Class &owner) : m_owner(&owner)
 {
     strncpy(m_name, name, sizeof(m_name));
     m_any_mac = true;
-    SharedData::getInstance().addDeviceToList(this);
+    m_tmo_node.owner = this;
+    updateFrameCache();
+    m_owner->m_registry.addDeviceToList(this);
 }
 
-OrviboS20Device::OrviboS20Device(const uint8_t mac[], const char name[])
+OrviboS20Device::OrviboS20Device(const uint8_t mac[], const char name[], OrviboS20Class &owner) : m_owner(&owner)
 {
     strncpy(m_name, name, sizeof(m_name));
     m_any_mac = false;
     memcpy(m_mac, mac, 6);
-    SharedData::getInstance().addDeviceToList(this);
+    m_tmo_node.owner = this;
+    updateFrameCache();
+    m_owner->m_registry.addDeviceToList(this);
 }
 
 OrviboS20Device::~OrviboS20Device()
 {
-    SharedData::getInstance().removeDeviceFromList(this);
+    if (m_queued_state >= 0)
+    {
+        m_owner->m_registry.removeQueued(this);
+    }
+    if (m_pending_state >= 0)
+    {
+        m_owner->m_registry.removePending(this);
+    }
+    m_owner->m_registry.getTimers().cancel(m_tmo_node);
+    m_owner->m_registry.removeDeviceFromList(this);
 }
 
 void OrviboS20Device::updateConnectState(bool connected)
@@ -145,10 +299,15 @@ void OrviboS20Device::updateConnectState(bool connected)
         return;
 
     m_connected = connected;
-    if (connected)
+    if (m_owner->m_event_queue)
+    {
+        m_owner->m_event_queue->push(connected ? EVENT_CONNECT : EVENT_DISCONNECT, this, m_mac, m_last_state == 1);
+    }
+    else if (connected)
     {
         if (m_connect_callback)
         {
+            ORVIBO_METRIC_INC(m_owner->m_metrics, callbacks);
             m_connect_callback(*this);
         }
     }
@@ -156,43 +315,322 @@ void OrviboS20Device::updateConnectState(bool connected)
     {
         if (m_disconnect_callback)
         {
+            ORVIBO_METRIC_INC(m_owner->m_metrics, callbacks);
             m_disconnect_callback(*this);
         }
     }
 }
 
-void OrviboS20Device::sendCommand(uint16_t command, uint8_t *payload, size_t length)
+void OrviboS20Device::updateFrameCache()
 {
-    uint16_t tot_len = ORVIBO_HEADER_LEN + length;
-    auto &udp = SharedData::getInstance().udp;
+    // The subscribe frame is constant for a given MAC and its first ORVIBO_HEADER_LEN
+    // bytes (magic, MAC and padding) also serves as header template for other commands
+    uint8_t *frame = m_subscribe_frame;
+    memcpy(frame, ORVIBO_MAGIC, sizeof(ORVIBO_MAGIC));
+    setFrameHeader(frame, CMD_SUBSCRIBE, sizeof(m_subscribe_frame) - ORVIBO_HEADER_LEN);
+    memcpy(&frame[6], m_mac, 6);
+    memcpy(&frame[12], MAC_PADDING, sizeof(MAC_PADDING));
+    reverse(&frame[ORVIBO_HEADER_LEN], m_mac, 6);
+    memcpy(&frame[ORVIBO_HEADER_LEN + 6], MAC_PADDING, sizeof(MAC_PADDING));
+}
 
-    // Send UDP packet
-    udp.beginPacket(m_ip, ORVIBO_UDP_PORT);
-    udp.write(ORVIBO_MAGIC, sizeof(ORVIBO_MAGIC));
-    udp.write((uint8_t)(tot_len >> 8));
-    udp.write((uint8_t)tot_len);
-    udp.write((uint8_t)(command >> 8));
-    udp.write((uint8_t)command);
-    udp.write(m_mac, 6);
-    udp.write(MAC_PADDING, sizeof(MAC_PADDING));
-    udp.write(payload, length);
-    udp.endPacket();
+bool OrviboS20Device::sendFrame(const uint8_t *frame, size_t length)
+{
+    if ((uint32_t)m_ip == 0)
+    {
+        // We don't know where the device is yet
+        return false;
+    }
+    bool sent = m_owner->m_registry.m_transport->sendPacket(m_ip, ORVIBO_UDP_PORT, frame, length);
+    if (sent)
+    {
+        ORVIBO_METRIC_INC(m_owner->m_metrics, tx_packets);
+    }
+    else
+    {
+        ORVIBO_METRIC_INC(m_owner->m_metrics, tx_failed);
+    }
+    return sent;
 }
 
-void OrviboS20Device::subscribe()
+size_t OrviboS20Device::encodeCommand(uint8_t *frame, uint16_t command, const uint8_t *payload, size_t length)
 {
-    uint8_t payload[12];
-    reverse(payload, m_mac, 6);
-    memcpy(&payload[6], MAC_PADDING, 6);
-    sendCommand(CMD_SUBSCRIBE, payload, sizeof(payload));
+    memcpy(frame, m_subscribe_frame, ORVIBO_HEADER_LEN);
+    setFrameHeader(frame, command, length);
+    memcpy(&frame[ORVIBO_HEADER_LEN], payload, length);
+    return ORVIBO_HEADER_LEN + length;
 }
 
-bool OrviboS20Device::setState(bool state)
+bool OrviboS20Device::sendCommand(uint16_t command, const uint8_t *payload, size_t length)
+{
+    uint8_t frame[ORVIBO_HEADER_LEN + MAX_PAYLOAD_LEN];
+    if (length > MAX_PAYLOAD_LEN)
+    {
+        return false;
+    }
+    return sendFrame(frame, encodeCommand(frame, command, payload, length));
+}
+
+bool OrviboS20Device::encodeState(bool state, uint8_t *frame, OrviboS20Datagram &datagram)
+{
+    if ((uint32_t)m_ip == 0)
+    {
+        return false;
+    }
+    uint8_t payload[5];
+    memset(payload, 0, 4);
+    payload[4] = state;
+    m_sent_state = state;
+    datagram.ip = m_ip;
+    datagram.port = ORVIBO_UDP_PORT;
+    datagram.data = frame;
+    datagram.length = encodeCommand(frame, CMD_SET_STATE, payload, sizeof(payload));
+    return true;
+}
+
+bool OrviboS20Device::subscribe()
+{
+    return sendFrame(m_subscribe_frame, sizeof(m_subscribe_frame));
+}
+
+bool OrviboS20Device::keepAlive()
+{
+    // Called by the subscribe scheduler
+    if (m_owner->m_liveness_quiet_ms && m_connected)
+    {
+        // A probe already in flight is a subscription as well
+        return m_probe_outstanding ? false : sendProbe();
+    }
+    return subscribe();
+}
+
+uint32_t OrviboS20Device::probeTimeout()
+{
+    uint32_t srtt_us = (m_probe_srtt_us > m_rtt_stats.smoothed_us) ? m_probe_srtt_us : m_rtt_stats.smoothed_us;
+    uint32_t timeout = 4 * srtt_us / 1000;
+    return (timeout < PROBE_MIN_TIMEOUT_MS) ? PROBE_MIN_TIMEOUT_MS : timeout;
+}
+
+bool OrviboS20Device::sendProbe()
 {
+    // The probe is a subscription, the device answers it with a subscribe reply
+    m_probe_outstanding = true;
+    m_probe_sent_us = micros();
+    uint8_t backoff = (m_probes_missed < 5) ? m_probes_missed : 5;
+    m_owner->m_registry.getTimers().schedule(m_tmo_node, millis() + (probeTimeout() << backoff));
+    m_owner->m_liveness_stats.probes++;
+    return subscribe();
+}
+
+bool OrviboS20Device::sendState(bool state)
+{
+    m_sent_state = state;
     uint8_t payload[5];
     memset(payload, 0, 4);
     payload[4] = state;
-    sendCommand(CMD_SET_STATE, payload, sizeof(payload));
+    return sendCommand(CMD_SET_STATE, payload, sizeof(payload));
+}
+
+bool OrviboS20Device::setState(bool state)
+{
+    return queueState(state, nullptr);
+}
+
+bool OrviboS20Device::setState(bool state, command_callback_t cb)
+{
+    if ((uint32_t)m_ip == 0)
+    {
+        if (cb)
+        {
+            ORVIBO_METRIC_INC(m_owner->m_metrics, callbacks);
+            cb(*this, RESULT_NOT_CONNECTED, 0);
+        }
+        return false;
+    }
+    return queueState(state, cb);
+}
+
+bool OrviboS20Device::queueState(bool state, command_callback_t cb)
+{
+    if ((uint32_t)m_ip == 0)
+    {
+        // We don't know where the device is yet
+        return false;
+    }
+
+    OrviboS20Class::command_stats_t &stats = m_owner->m_cmd_stats;
+    command_callback_t superseded = nullptr;
+    stats.requested++;
+    if (m_queued_state >= 0)
+    {
+        // Last write wins
+        stats.coalesced++;
+        superseded = m_queued_callback;
+    }
+    else
+    {
+        m_owner->m_registry.addQueued(this);
+    }
+    m_queued_state = state;
+    m_queued_callback = cb;
+
+    if (superseded)
+    {
+        ORVIBO_METRIC_INC(m_owner->m_metrics, callbacks);
+        superseded(*this, RESULT_SUPERSEDED, 0);
+    }
+    return true;
+}
+
+void OrviboS20Device::flushQueuedState()
+{
+    OrviboS20Class::command_stats_t &stats = m_owner->m_cmd_stats;
+    bool state = m_queued_state;
+    command_callback_t cb = m_queued_callback;
+    m_queued_state = -1;
+    m_queued_callback = nullptr;
+
+    if (m_pending_state >= 0)
+    {
+        completeCommand(RESULT_SUPERSEDED, 0);
+    }
+    else if ((m_last_state == (int)state) && ((m_sent_state < 0) || (m_sent_state == (int)state)))
+    {
+        // The device has already confirmed this state and there is no unconfirmed
+        // command for another state in flight
+        stats.skipped++;
+        if (cb)
+        {
+            ORVIBO_METRIC_INC(m_owner->m_metrics, callbacks);
+            cb(*this, RESULT_SUCCESS, 0);
+        }
+        return;
+    }
+
+    stats.sent++;
+    if (cb)
+    {
+        startCommand(state, cb);
+    }
+    else
+    {
+        sendState(state);
+    }
+}
+
+bool OrviboS20Device::startCommand(bool state, command_callback_t cb)
+{
+    if (!sendState(state))
+    {
+        if (cb)
+        {
+            ORVIBO_METRIC_INC(m_owner->m_metrics, callbacks);
+            cb(*this, RESULT_NOT_CONNECTED, 0);
+        }
+        return false;
+    }
+    armCommand(state, cb);
+    return true;
+}
+
+void OrviboS20Device::cancelQueuedState()
+{
+    if (m_queued_state >= 0)
+    {
+        m_owner->m_registry.removeQueued(this);
+        m_queued_state = -1;
+        command_callback_t cb = m_queued_callback;
+        m_queued_callback = nullptr;
+        if (cb)
+        {
+            ORVIBO_METRIC_INC(m_owner->m_metrics, callbacks);
+            cb(*this, RESULT_SUPERSEDED, 0);
+        }
+    }
+}
+
+void OrviboS20Device::armCommand(bool state, command_callback_t cb)
+{
+    if (m_pending_state >= 0)
+    {
+        completeCommand(RESULT_SUPERSEDED, 0);
+    }
+
+    uint32_t timeout = m_owner->m_cmd_timeout_ms;
+    if (2 * m_rtt_stats.smoothed_us / 1000 > timeout)
+    {
+        timeout = 2 * m_rtt_stats.smoothed_us / 1000;
+    }
+    m_pending_state = state;
+    m_pending_attempts = 1;
+    m_pending_timeout_ms = timeout;
+    m_pending_deadline = millis() + timeout;
+    m_pending_sent_us = micros();
+    m_pending_callback = cb;
+    m_owner->m_registry.addPending(this);
+}
+
+void OrviboS20Device::completeCommand(OrviboCommandResult result, uint32_t rtt_us)
+{
+    m_owner->m_registry.removePending(this);
+    m_pending_state = -1;
+    if (result == RESULT_SUCCESS)
+    {
+        m_rtt_stats.succeeded++;
+    }
+    else if (result == RESULT_TIMEOUT)
+    {
+        m_rtt_stats.failed++;
+        if (m_owner->m_liveness_quiet_ms && m_connected && !m_probe_outstanding)
+        {
+            // Find out if the device is still there right away
+            m_owner->m_registry.getTimers().schedule(m_tmo_node, millis());
+        }
+    }
+
+    // The callback may issue a new command so clear the pending state first
+    command_callback_t cb = m_pending_callback;
+    m_pending_callback = nullptr;
+    if (cb)
+    {
+        ORVIBO_METRIC_INC(m_owner->m_metrics, callbacks);
+        cb(*this, result, rtt_us);
+    }
+}
+
+void OrviboS20Device::addRttSample(uint32_t rtt_us)
+{
+    rtt_stats_t &stats = m_rtt_stats;
+    stats.last_us = rtt_us;
+    if (stats.samples == 0)
+    {
+        stats.min_us = rtt_us;
+        stats.max_us = rtt_us;
+        stats.smoothed_us = rtt_us;
+    }
+    else
+    {
+        if (rtt_us < stats.min_us)
+            stats.min_us = rtt_us;
+        if (rtt_us > stats.max_us)
+            stats.max_us = rtt_us;
+        stats.smoothed_us = stats.smoothed_us - (stats.smoothed_us >> 3) + (rtt_us >> 3);
+    }
+    stats.samples++;
+#if ORVIBO_METRICS
+    m_rtt_histogram.add(rtt_us);
+#endif
+}
+
+OrviboS20Device::metrics_t OrviboS20Device::getMetrics()
+{
+    metrics_t metrics = {};
+    // The address is learnt from the first datagram received from the device
+    metrics.last_seen_ms = !m_heard ? UINT32_MAX : (uint32_t)(millis() - m_last_rx_time);
+#if ORVIBO_METRICS
+    metrics.rtt = m_rtt_histogram;
+#endif
+    return metrics;
 }
 
 bool OrviboS20Device::getState()
@@ -206,38 +644,101 @@ void OrviboS20Device::checkConnectTimeout()
     // connected the ESP8266WiFi will still keep the device in wifi_softap_get_station_info()
     // list. It seems that a device is only removed from this list if a device sends a graceful
     // WiFi disassociation request
-    if (m_connected)
+    // This is called by the timer wheel when the connection timer expires
+    if (!m_connected)
+    {
+        return;
+    }
+    if (m_owner->m_liveness_quiet_ms == 0)
     {
-        if (millis() - m_last_rx_time > CONNECTION_TMO_MS)
+        if ((uint32_t)(millis() - m_last_rx_time) >= CONNECTION_TMO_MS)
         {
             updateConnectState(false);
         }
+        return;
     }
+
+    // Liveness probing: the device has been quiet for quiet_ms or a probe timed out
+    if (m_probe_outstanding)
+    {
+        m_owner->m_liveness_stats.missed++;
+        if (++m_probes_missed >= m_owner->m_liveness_max_missed)
+        {
+            m_probe_outstanding = false;
+            m_probes_missed = 0;
+            m_owner->m_liveness_stats.lost++;
+            updateConnectState(false);
+            return;
+        }
+    }
+    sendProbe();
+}
+
+void OrviboS20Device::scheduleConnectTimeout()
+{
+    uint32_t quiet_ms = m_owner->m_liveness_quiet_ms;
+    m_owner->m_registry.getTimers().schedule(m_tmo_node, m_last_rx_time + (quiet_ms ? quiet_ms : CONNECTION_TMO_MS));
 }
 
-void OrviboS20Device::handlePacket(uint16_t command, uint8_t *payload, size_t length)
+void OrviboS20Device::handleFrame(const OrviboS20Frame &frame)
 {
+    static constexpr OrviboS20FrameHandler<OrviboS20Device> handlers[] = {
+        {CMD_STATE_CHANGE, &OrviboS20Device::handleStateChange},
+    };
+
+    m_heard = true;
     m_last_rx_time = millis();
+    if (m_probe_outstanding)
+    {
+        // Any datagram answers the probe, only unambiguous samples are used for the RTT
+        if (m_probes_missed == 0)
+        {
+            uint32_t rtt_us = micros() - m_probe_sent_us;
+            m_probe_srtt_us = m_probe_srtt_us ? m_probe_srtt_us - (m_probe_srtt_us >> 3) + (rtt_us >> 3) : rtt_us;
+        }
+        m_probe_outstanding = false;
+        m_probes_missed = 0;
+    }
+    scheduleConnectTimeout();
     updateConnectState(true);
 
-    switch (command)
+    OrviboS20Decoder::dispatch(handlers, *this, frame);
+}
+
+void OrviboS20Device::handleStateChange(const OrviboS20Frame &frame)
+{
+    int new_state = frame.state();
+    if (new_state < 0)
+    {
+        return;
+    }
+    if (new_state == m_sent_state)
     {
-    case CMD_STATE_CHANGE:
-        if (length == 5)
+        m_sent_state = -1;
+    }
+    if (new_state != m_last_state)
+    {
+        m_last_state = new_state;
+        m_owner->m_binding_changes++;
+        if (m_owner->m_event_queue)
         {
-            int new_state = payload[4];
-            if (new_state != m_last_state)
-            {
-                m_last_state = new_state;
-                if (m_state_change_callback)
-                {
-                    m_state_change_callback(*this, new_state);
-                }
-            }
+            m_owner->m_event_queue->push(EVENT_STATE_CHANGE, this, m_mac, new_state);
+        }
+        else if (m_state_change_callback)
+        {
+            ORVIBO_METRIC_INC(m_owner->m_metrics, callbacks);
+            m_state_change_callback(*this, new_state);
         }
-        break;
-    default:
-        break;
+    }
+    if (m_pending_state >= 0 && m_pending_state == new_state)
+    {
+        uint32_t rtt_us = micros() - m_pending_sent_us;
+        if (m_pending_attempts == 1)
+        {
+            // Only unambiguous samples are used (Karn's algorithm)
+            addRttSample(rtt_us);
+        }
+        completeCommand(RESULT_SUCCESS, rtt_us);
     }
 }
 
@@ -245,99 +746,418 @@ void OrviboS20Device::handlePacket(uint16_t command, uint8_t *payload, size_t le
  * OrviboS20Class class definition
  ***********************************************************************************/
 
-void OrviboS20Class::checkIfNewDevice(uint8_t *mac)
+bool OrviboS20Class::checkIfNewDevice(uint8_t *mac)
+{
+    if (!m_seen_devices.insert(mac))
+    {
+        return false;
+    }
+    if (m_event_queue)
+    {
+        m_event_queue->push(EVENT_FOUND_DEVICE, nullptr, mac, 0);
+    }
+    else if (m_found_device_callback)
+    {
+        ORVIBO_METRIC_INC(m_metrics, callbacks);
+        m_found_device_callback(mac);
+    }
+    return true;
+}
+
+bool OrviboS20Class::checkRxPacket()
 {
-    static int known_orvibo_mac_count = 0;
-    static uint8_t known_orvibo_mac_list[MAX_ORVIBO_DEVICES][6];
+    uint8_t rx_buffer[64];
+    auto &udp = *m_registry.m_transport;
 
-    if (known_orvibo_mac_count >= MAX_ORVIBO_DEVICES)
+    int size = udp.parsePacket();
+    if (size <= 0)
     {
-        // List is full
-        return;
+        return false;
+    }
+    ORVIBO_METRIC_INC(m_metrics, rx_packets);
+    if ((size_t)size > sizeof(rx_buffer))
+    {
+        // Not an S20 frame, and decoding a truncated copy could accept it
+        ORVIBO_METRIC_INC(m_metrics, rx_dropped[DROP_OVERSIZED]);
+        return true;
+    }
+    int len = udp.read(rx_buffer, sizeof(rx_buffer));
+    OrviboS20Frame frame;
+    OrviboDecodeResult result = (len > 0) ? OrviboS20Decoder::decode(rx_buffer, len, frame) : DECODE_TOO_SHORT;
+    if (result != DECODE_OK)
+    {
+        // Invalid packet
+        ORVIBO_METRIC_INC(m_metrics, rx_dropped[orviboDropReason(result)]);
+        return true;
     }
 
-    for (int i = 0; i < known_orvibo_mac_count; i++)
+    uint8_t src_mac[6];
+    memcpy(src_mac, frame.mac, sizeof(src_mac));
+    bool new_device = checkIfNewDevice(src_mac);
+
+    OrviboS20Device *dev = m_registry.findDevice(src_mac);
+    if (!dev)
     {
-        if (memcmp(known_orvibo_mac_list[i], mac, 6) == 0)
+        // If the MAC didn't match we check if there are any "any MAC" devices
+        dev = m_registry.bindAnyMacDevice(src_mac);
+    }
+    if (dev)
+    {
+        bool was_bound = ((uint32_t)dev->m_ip != 0);
+        IPAddress ip = udp.remoteIP();
+        if ((uint32_t)ip != (uint32_t)dev->m_ip)
         {
-            return;
+            m_binding_changes++;
         }
+        dev->m_ip = ip;
+        dev->handleFrame(frame);
+        if (!was_bound && m_discovery_stats.active)
+        {
+            dev->subscribe();
+            if (++m_discovery_stats.bound >= m_discovery_stats.devices)
+            {
+                m_discovery_stats.full_fleet_ms = millis() - m_discovery_start;
+                finishDiscovery();
+            }
+        }
+    }
+    else
+    {
+        ORVIBO_METRIC_INC(m_metrics, rx_dropped[DROP_UNKNOWN_MAC]);
+    }
+    if (new_device && m_device_waiters)
+    {
+        // After the frame is handled so that the device can be used right away
+        completeDeviceWaiters(src_mac);
     }
+    return true;
+}
 
-    memcpy(known_orvibo_mac_list[known_orvibo_mac_count], mac, 6);
-    known_orvibo_mac_count++;
+void OrviboS20Class::processRxPackets()
+{
+    unsigned long start_time = micros();
+    uint16_t processed = 0;
+    bool empty = false;
+
+    while (processed < m_rx_budget_packets)
+    {
+        if (!checkRxPacket())
+        {
+            empty = true;
+            break;
+        }
+        processed++;
+        if (m_rx_budget_us && (micros() - start_time >= m_rx_budget_us))
+        {
+            break;
+        }
+    }
 
-    m_found_device_callback(mac);
+    m_rx_report.processed = processed;
+    m_rx_report.pending = empty ? 0 : m_registry.m_transport->pending();
 }
 
-void OrviboS20Class::checkRxPacket()
+void OrviboS20Class::setEventQueue(OrviboS20EventQueue *queue)
 {
-    uint8_t rx_buffer[64];
-    auto &udp = SharedData::getInstance().udp;
-
-    if (udp.parsePacket() <= 0)
+#if ORVIBO_METRICS
+    if (m_event_queue && (m_event_queue != queue))
     {
-        return;
+        // Keep the callbacks dispatched from the old queue in the metrics
+        m_metrics.callbacks += m_event_queue->m_callbacks.exchange(0, std::memory_order_relaxed);
     }
-    int len = udp.read(rx_buffer, sizeof(rx_buffer));
-    if ((len < ORVIBO_HEADER_LEN) || (memcmp(rx_buffer, ORVIBO_MAGIC, sizeof(ORVIBO_MAGIC)) != 0))
+#endif
+    if (queue)
     {
-        // Invalid packet
-        return;
+        queue->m_owner = this;
     }
-    uint16_t totlen = (rx_buffer[2] << 8) | rx_buffer[3];
-    if (totlen != len)
+    m_event_queue = queue;
+}
+
+void OrviboS20Class::waitForDevice(OrviboS20DeviceWaiter &waiter, uint32_t timeout_ms, OrviboS20DeviceWaiter::found_callback_t cb)
+{
+    cancelWaitForDevice(waiter);
+    waiter.m_deadline = millis() + timeout_ms;
+    waiter.m_callback = cb;
+    waiter.m_generation = m_waiter_generation;
+    waiter.m_active = true;
+    waiter.m_next = m_device_waiters;
+    m_device_waiters = &waiter;
+}
+
+void OrviboS20Class::cancelWaitForDevice(OrviboS20DeviceWaiter &waiter)
+{
+    for (OrviboS20DeviceWaiter **iter = &m_device_waiters; *iter; iter = &(*iter)->m_next)
     {
-        // Invalid length
-        return;
+        if (*iter == &waiter)
+        {
+            *iter = waiter.m_next;
+            break;
+        }
     }
+    waiter.m_active = false;
+}
 
-    uint16_t cmd = (rx_buffer[4] << 8) | rx_buffer[5];
-    uint8_t *src_mac = &rx_buffer[6];
-    uint8_t *payload = &rx_buffer[ORVIBO_HEADER_LEN];
-    size_t payload_length = len - ORVIBO_HEADER_LEN;
+void OrviboS20Class::completeDeviceWaiters(const uint8_t *mac)
+{
+    // A found device completes all waiters, a timeout (mac == nullptr) only the expired
+    // ones. Waiters are unlinked before the callback since it may start a new wait or
+    // cancel another waiter. Waits started from a callback belong to a newer generation
+    // and are left alone.
+    uint32_t now = millis();
+    uint32_t generation = m_waiter_generation++;
+    OrviboS20DeviceWaiter **iter = &m_device_waiters;
+    while (*iter)
+    {
+        OrviboS20DeviceWaiter *waiter = *iter;
+        if (((int32_t)(waiter->m_generation - generation) <= 0) && (mac || ((int32_t)(now - waiter->m_deadline) >= 0)))
+        {
+            *iter = waiter->m_next;
+            waiter->m_active = false;
+            OrviboS20DeviceWaiter::found_callback_t cb = waiter->m_callback;
+            waiter->m_callback = nullptr;
+            ORVIBO_METRIC_INC(m_metrics, callbacks);
+            cb(*waiter, mac);
+            // The list may have changed in the callback, start over
+            iter = &m_device_waiters;
+        }
+        else
+        {
+            iter = &waiter->m_next;
+        }
+    }
+}
 
-    if (cmd == CMD_DISCOVER)
+void OrviboS20Class::setTransport(OrviboS20Transport *transport)
+{
+    if (!m_started)
     {
-        // Probably a bug in Orvibo S20 firmware
-        src_mac++;
-        payload++;
-        payload_length--;
+        m_registry.m_transport = transport;
     }
+}
 
-    checkIfNewDevice(src_mac);
+void OrviboS20Class::scheduleSubscriptions()
+{
+    // Instead of subscribing all devices at once each device gets its own slot
+    // (phase offset) within SUBSCRIBE_INTERVAL_MS so the traffic is spread evenly
+    OrviboS20Registry &shared = m_registry;
+    size_t count = shared.getDeviceCount();
+    if (count == 0)
+    {
+        return;
+    }
+    uint32_t spacing = SUBSCRIBE_INTERVAL_MS / count;
+    if (spacing == 0)
+    {
+        spacing = 1;
+    }
 
-    OrviboS20Device *any_mac_dev = nullptr;
-    OrviboS20Device *iter = SharedData::getInstance().getFirstDevice();
-    while (iter)
+    uint32_t now = millis();
+    uint16_t sent = 0;
+    while ((int32_t)(now - m_next_subscribe_time) >= 0)
     {
-        if (memcmp(iter->m_mac, src_mac, 6) == 0)
+        if (sent >= m_subscribe_budget)
         {
-            iter->m_ip = udp.remoteIP();
-            iter->handlePacket(cmd, payload, payload_length);
+            m_subscribe_stats.budget_hits++;
+            if ((int32_t)(now - m_next_subscribe_time) > (int32_t)SUBSCRIBE_INTERVAL_MS)
+            {
+                // We're more than a full interval behind (long delay in loop()?)
+                // Don't try to catch up as that would only result in bursts
+                m_next_subscribe_time = now;
+            }
             break;
         }
-        if (iter->m_any_mac && !any_mac_dev)
+        if (shared.getNextSubscribeDevice()->keepAlive())
+        {
+            sent++;
+        }
+        m_next_subscribe_time += spacing;
+    }
+
+    if (sent > 0)
+    {
+        m_subscribe_stats.last_tick = sent;
+        m_subscribe_stats.total += sent;
+        if (sent > m_subscribe_stats.peak_per_tick)
+        {
+            m_subscribe_stats.peak_per_tick = sent;
+        }
+        if (m_subscribe_tick_callback)
+        {
+            ORVIBO_METRIC_INC(m_metrics, callbacks);
+            m_subscribe_tick_callback(sent);
+        }
+    }
+}
+
+bool OrviboS20Class::startDiscovery(IPAddress broadcast_ip, uint8_t rounds, uint16_t interval_ms, uint16_t batch)
+{
+    if (!m_started)
+    {
+        return false;
+    }
+    m_discovery_stats = {};
+    m_discovery_stats.active = true;
+    m_discovery_stats.full_fleet_ms = UINT32_MAX;
+    for (OrviboS20Device *dev = m_registry.getFirstDevice(); dev; dev = dev->m_next)
+    {
+        m_discovery_stats.devices++;
+        if ((uint32_t)dev->m_ip != 0)
+        {
+            m_discovery_stats.bound++;
+        }
+    }
+    m_discovery_ip = (uint32_t)broadcast_ip;
+    m_discovery_start = millis();
+    m_next_discovery_time = m_discovery_start;
+    m_discovery_interval_ms = interval_ms;
+    m_discovery_batch = batch ? batch : 1;
+    m_discovery_rounds_left = rounds ? rounds : 1;
+    m_discovery_round = 0;
+    m_registry.m_discovery_cursor = nullptr;
+    if (m_discovery_stats.bound >= m_discovery_stats.devices)
+    {
+        // Nothing to bind, one round is still sent for onFoundDevice()
+        m_discovery_stats.full_fleet_ms = 0;
+        m_discovery_rounds_left = 1;
+    }
+    return true;
+}
+
+bool OrviboS20Class::sendDiscovery(const uint8_t *frame, size_t length)
+{
+    bool sent = m_registry.m_transport->sendPacket(IPAddress(m_discovery_ip), ORVIBO_UDP_PORT, frame, length);
+    if (sent)
+    {
+        m_discovery_stats.probes++;
+        ORVIBO_METRIC_INC(m_metrics, tx_packets);
+    }
+    else
+    {
+        ORVIBO_METRIC_INC(m_metrics, tx_failed);
+    }
+    return sent;
+}
+
+void OrviboS20Class::runDiscovery()
+{
+    // The first round is a broadcast request. Later rounds send requests to the devices
+    // with a known MAC that haven't answered yet, paced by m_discovery_batch per
+    // handle(), and only broadcast again while there are unbound "any MAC" devices
+    // since every device answers a broadcast.
+    uint16_t sent = 0;
+    OrviboS20Device *dev = m_registry.m_discovery_cursor;
+    while (dev && (sent < m_discovery_batch))
+    {
+        if (!dev->m_any_mac && ((uint32_t)dev->m_ip == 0))
         {
-            any_mac_dev = iter;
+            uint8_t frame[ORVIBO_HEADER_LEN];
+            memcpy(frame, dev->m_subscribe_frame, ORVIBO_HEADER_LEN);
+            setFrameHeader(frame, CMD_DISCOVER, 0);
+            sendDiscovery(frame, sizeof(frame));
+            sent++;
         }
-        iter = iter->m_next;
+        dev = dev->m_next;
+    }
+    m_registry.m_discovery_cursor = dev;
+    if (dev)
+    {
+        return;
+    }
+
+    uint32_t now = millis();
+    if ((int32_t)(now - m_next_discovery_time) < 0)
+    {
+        return;
+    }
+    if (m_discovery_rounds_left == 0)
+    {
+        // No reply from some devices within interval_ms of the last round
+        finishDiscovery();
+        return;
+    }
+    bool first_round = (m_discovery_round++ == 0);
+    m_discovery_rounds_left--;
+    m_next_discovery_time = now + m_discovery_interval_ms;
+    if (first_round || m_registry.m_any_mac_list)
+    {
+        sendDiscovery(DISCOVER_ALL_FRAME, sizeof(DISCOVER_ALL_FRAME));
+    }
+    if (!first_round)
+    {
+        m_registry.m_discovery_cursor = m_registry.getFirstDevice();
+    }
+}
+
+void OrviboS20Class::finishDiscovery()
+{
+    m_discovery_stats.active = false;
+    m_discovery_rounds_left = 0;
+    m_registry.m_discovery_cursor = nullptr;
+    if (m_discovery_done_callback)
+    {
+        ORVIBO_METRIC_INC(m_metrics, callbacks);
+        m_discovery_done_callback(m_discovery_stats);
+    }
+}
+
+size_t OrviboS20Class::sendDatagrams(const OrviboS20Datagram *datagrams, size_t count)
+{
+    m_cmd_stats.sent += count;
+    size_t sent = m_registry.m_transport->sendPackets(datagrams, count);
+    ORVIBO_METRIC_ADD(m_metrics, tx_packets, sent);
+    ORVIBO_METRIC_ADD(m_metrics, tx_failed, count - sent);
+    return sent;
+}
+
+void OrviboS20Class::flushCommands()
+{
+    OrviboS20Device *dev = m_registry.takeQueued();
+    while (dev)
+    {
+        OrviboS20Device *next = dev->m_next_queued;
+        dev->m_next_queued = nullptr;
+        dev->flushQueuedState();
+        dev = next;
     }
+}
 
-    // If the MAC didn't match we check if there are any "any MAC" devices
-    if (!iter && any_mac_dev)
+void OrviboS20Class::retransmitCommands()
+{
+    uint32_t now = millis();
+    OrviboS20Device *dev = m_registry.getFirstPending();
+    while (dev)
     {
-        any_mac_dev->m_any_mac = false;
-        memcpy(any_mac_dev->m_mac, src_mac, 6);
-        any_mac_dev->m_ip = udp.remoteIP();
-        any_mac_dev->handlePacket(cmd, payload, payload_length);
+        OrviboS20Device *next = dev->m_next_pending;
+        if ((int32_t)(now - dev->m_pending_deadline) >= 0)
+        {
+            if (dev->m_pending_attempts < m_cmd_max_attempts)
+            {
+                dev->m_pending_attempts++;
+                dev->m_pending_timeout_ms *= 2;
+                dev->m_pending_deadline = now + dev->m_pending_timeout_ms;
+                dev->m_pending_sent_us = micros();
+                dev->m_rtt_stats.retransmits++;
+                dev->sendState(dev->m_pending_state);
+            }
+            else
+            {
+                dev->completeCommand(RESULT_TIMEOUT, 0);
+            }
+        }
+        dev = next;
     }
 }
 
 bool OrviboS20Class::begin()
 {
-    if (SharedData::getInstance().udp.begin(ORVIBO_UDP_PORT))
+    if (!m_registry.m_transport && (this == &OrviboS20))
+    {
+        m_registry.m_transport = getDefaultTransport();
+    }
+    OrviboS20Transport *transport = m_registry.m_transport;
+    if (transport && transport->begin(ORVIBO_UDP_PORT))
     {
+        m_next_subscribe_time = millis();
         m_started = true;
         return true;
     }
@@ -349,8 +1169,10 @@ void OrviboS20Class::stop()
     if (m_started)
     {
         m_started = false;
-        SharedData::getInstance().udp.stop();
-        OrviboS20Device *iter = SharedData::getInstance().getFirstDevice();
+        m_registry.m_transport->stop();
+        m_discovery_stats.active = false;
+        m_discovery_rounds_left = 0;
+        m_registry.m_discovery_cursor = nullptr;
     }
 }
 
@@ -358,33 +1180,26 @@ void OrviboS20Class::handle()
 {
     if (m_started)
     {
-        static unsigned long s_last_subscribe_time = 0;
-        if (millis() - s_last_subscribe_time >= SUBSCRIBE_INTERVAL_MS)
-        {
-            // Time for subscription
-            OrviboS20Device *iter = SharedData::getInstance().getFirstDevice();
-            while (iter)
-            {
-                iter->subscribe();
-                iter = iter->m_next;
-            }
-            s_last_subscribe_time = millis();
-        }
+        scheduleSubscriptions();
+        flushCommands();
+        retransmitCommands();
 
-        static unsigned long s_last_tmo_check_time = 0;
-        if (millis() - s_last_tmo_check_time >= CHECK_TMO_INTERVAL_MS)
+        // Check connection timeouts, only expired devices are visited
+        m_registry.getTimers().advance(millis(), [](OrviboS20Device &device) {
+            device.checkConnectTimeout();
+        });
+
+        if (m_discovery_stats.active)
         {
-            // Check connection timeout
-            OrviboS20Device *iter = SharedData::getInstance().getFirstDevice();
-            while (iter)
-            {
-                iter->checkConnectTimeout();
-                iter = iter->m_next;
-            }
-            s_last_tmo_check_time = millis();
+            runDiscovery();
         }
 
         // Check incomming packets
-        checkRxPacket();
+        processRxPackets();
+
+        if (m_device_waiters)
+        {
+            completeDeviceWaiters(nullptr);
+        }
     }
 }
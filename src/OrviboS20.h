@@ -1,12 +1,206 @@
 #pragma once
 
-#include <Arduino.h>
-#include <functional>
+#include "OrviboS20Callback.h"
+#include "OrviboS20EventQueue.h"
+#include "OrviboS20MacIndex.h"
+#include "OrviboS20Metrics.h"
+#include "OrviboS20Platform.h"
+#include "OrviboS20Protocol.h"
+#include "OrviboS20SeenSet.h"
+#include "OrviboS20TimerWheel.h"
+#include "OrviboS20Transport.h"
 
+/*
+ * Number of MACs remembered for OrviboS20.onFoundDevice() (about 14 bytes each)
+ * With ORVIBO_SEEN_DEVICES_LRU set the least recently seen MAC is forgotten when the
+ * set is full (and reported again if it shows up later), otherwise MACs beyond the
+ * capacity are never reported.
+ */
+#ifndef ORVIBO_SEEN_DEVICES_MAX
+#ifdef ARDUINO
+#define ORVIBO_SEEN_DEVICES_MAX 64
+#else
+#define ORVIBO_SEEN_DEVICES_MAX 4096
+#endif
+#endif
+#ifndef ORVIBO_SEEN_DEVICES_LRU
+#define ORVIBO_SEEN_DEVICES_LRU 1
+#endif
+
+/*
+ * Size of the connection and liveness timer wheel (see OrviboS20TimerWheel)
+ * Each OrviboS20Class holds two levels of ORVIBO_TIMER_SLOTS list heads, 2 KB of RAM
+ * with 256 slots on a 32-bit target. The 100 ms tick honours the probe timeouts. On
+ * ESP8266 32 slots of 250 ms (256 bytes) are used instead, the coarse level then
+ * spans 256 s which still covers the 150 s connection timeout.
+ */
+#ifndef ORVIBO_TIMER_SLOTS
+#ifdef ARDUINO
+#define ORVIBO_TIMER_SLOTS 32
+#else
+#define ORVIBO_TIMER_SLOTS 256
+#endif
+#endif
+#ifndef ORVIBO_TIMER_TICK_MS
+#ifdef ARDUINO
+#define ORVIBO_TIMER_TICK_MS 250
+#else
+#define ORVIBO_TIMER_TICK_MS 100
+#endif
+#endif
+
+class OrviboS20Class;
+class OrviboS20Device;
+
+/* Connection and liveness timers, see ORVIBO_TIMER_SLOTS */
+typedef OrviboS20TimerWheel<OrviboS20Device, ORVIBO_TIMER_SLOTS, ORVIBO_TIMER_TICK_MS> OrviboS20DeviceTimers;
+
+/* The default instance, see OrviboS20Class */
+extern OrviboS20Class OrviboS20;
+
+enum OrviboCommandResult
+{
+    RESULT_SUPERSEDED = -3,    /* A newer command was issued before this one completed */
+    RESULT_NOT_CONNECTED = -2, /* The device address is not known yet */
+    RESULT_TIMEOUT = -1,       /* No confirmation after all retransmissions */
+    RESULT_SUCCESS = 0
+};
+
+/*
+ * Devices, command queues and timers of one OrviboS20Class instance
+ */
+class OrviboS20Registry
+{
+protected:
+    OrviboS20Device *m_device_list = nullptr;
+    OrviboS20Device *m_device_list_tail = nullptr;
+    OrviboS20Device *m_any_mac_list = nullptr;
+    OrviboS20Device *m_subscribe_cursor = nullptr;
+    OrviboS20Device *m_discovery_cursor = nullptr;
+    OrviboS20Device *m_pending_list = nullptr;
+    OrviboS20Device *m_queued_list = nullptr;
+    OrviboS20Device *m_queued_list_tail = nullptr;
+    size_t m_device_count = 0;
+    OrviboS20MacIndex<OrviboS20Device> m_mac_index;
+    OrviboS20DeviceTimers m_timers;
+    OrviboS20Transport *m_transport = nullptr;
+
+    void addToAnyMacList(OrviboS20Device *dev);
+    void removeFromAnyMacList(OrviboS20Device *dev);
+
+    void addDeviceToList(OrviboS20Device *dev);
+    void removeDeviceFromList(OrviboS20Device *dev);
+    OrviboS20Device *getFirstDevice()
+    {
+        return m_device_list;
+    }
+    size_t getDeviceCount()
+    {
+        return m_device_count;
+    }
+    OrviboS20DeviceTimers &getTimers()
+    {
+        return m_timers;
+    }
+
+    /* List of devices with an acknowledged command waiting for confirmation */
+    OrviboS20Device *getFirstPending()
+    {
+        return m_pending_list;
+    }
+    void addPending(OrviboS20Device *dev);
+    void removePending(OrviboS20Device *dev);
+
+    /* FIFO of devices with a command waiting to be sent in next handle() */
+    void addQueued(OrviboS20Device *dev);
+    void removeQueued(OrviboS20Device *dev);
+    /* Detach the whole queue, returns the first device */
+    OrviboS20Device *takeQueued();
+
+    /* Returns the devices in round-robin order for the subscribe scheduler */
+    OrviboS20Device *getNextSubscribeDevice();
+    OrviboS20Device *findDevice(const uint8_t *mac);
+    /*
+     * Assign the MAC to the first unbound "any MAC" device (if there is one)
+     * If name is given only a device with that name is bound.
+     */
+    OrviboS20Device *bindAnyMacDevice(const uint8_t *mac, const char *name = nullptr);
+
+    friend class OrviboS20Class;
+    friend class OrviboS20Device;
+    friend class OrviboS20BindingStore;
+};
+
+/*
+ * One-shot wait for the next previously unknown device, see OrviboS20Class::waitForDevice()
+ * The callback gets the MAC of the device found, or nullptr on timeout.
+ */
+class OrviboS20DeviceWaiter
+{
+public:
+    typedef OrviboS20Callback<void(OrviboS20DeviceWaiter &waiter, const uint8_t *mac)> found_callback_t;
+
+    bool isActive()
+    {
+        return m_active;
+    }
+
+protected:
+    OrviboS20DeviceWaiter *m_next = nullptr;
+    uint32_t m_deadline = 0;
+    uint32_t m_generation = 0;
+    bool m_active = false;
+    found_callback_t m_callback = nullptr;
+
+    friend class OrviboS20Class;
+};
+
+/*
+ * Handles the UDP communication for a set of OrviboS20Device instances
+ * Normally the global OrviboS20 instance is used. Several instances can be created
+ * (e.g. one per network interface or shard of devices), each with its own transport,
+ * devices and state, so they can be handled on separate threads. Only the global
+ * instance may use the default transport.
+ */
 class OrviboS20Class
 {
 public:
-    typedef std::function<void(uint8_t *)> found_device_callback_t;
+    typedef OrviboS20Callback<void(uint8_t *)> found_device_callback_t;
+    typedef OrviboS20Callback<void(uint16_t sent)> subscribe_tick_callback_t;
+
+    /* Progress of the discovery sweep, see startDiscovery() */
+    struct discovery_stats_t
+    {
+        bool active;
+        uint32_t devices;       /* Devices registered when the sweep started */
+        uint32_t bound;         /* Of those, devices with a known address */
+        uint32_t probes;        /* Discovery requests sent */
+        uint32_t full_fleet_ms; /* Time from start until all devices were bound, UINT32_MAX if not */
+    };
+    typedef OrviboS20Callback<void(const discovery_stats_t &stats)> discovery_done_callback_t;
+
+    /* Liveness probing counters, see setLivenessProbing() */
+    struct liveness_stats_t
+    {
+        uint32_t probes; /* Probes sent (incl. scheduled subscriptions used as probes) */
+        uint32_t missed; /* Probes not answered in time */
+        uint32_t lost;   /* Devices disconnected after max_missed probes */
+    };
+
+    /*
+     * The constructor is constexpr so OrviboS20 is initialized before any global
+     * OrviboS20Device registers with it, regardless of the order of initialization
+     */
+    constexpr OrviboS20Class()
+    {
+    }
+
+    /* Result of the receive loop in the last handle() call */
+    struct rx_report_t
+    {
+        uint16_t processed; /* Number of datagrams processed */
+        uint16_t pending;   /* Datagrams still waiting (lower bound) */
+    };
 
     /*
      * This callback will be called when a packet is received and successfully parsed
@@ -17,6 +211,173 @@ public:
         m_found_device_callback = cb;
     }
 
+    /*
+     * Use another transport than the default one (WiFiUDP on ESP8266 and
+     * OrviboS20PosixTransport on Linux). Must be called before begin().
+     */
+    void setTransport(OrviboS20Transport *transport);
+
+    /*
+     * Queue connect/disconnect/state change/found device events instead of calling the
+     * callbacks from handle(), see OrviboS20EventQueue. nullptr restores direct calls.
+     */
+    void setEventQueue(OrviboS20EventQueue *queue);
+
+    /*
+     * Calls cb from handle() when a packet is received from a previously unknown device
+     * (same condition as onFoundDevice()) or after timeout_ms with a nullptr MAC.
+     * Independent of onFoundDevice() and of other waiters. The waiter must stay alive
+     * until it has completed or been cancelled.
+     */
+    void waitForDevice(OrviboS20DeviceWaiter &waiter, uint32_t timeout_ms, OrviboS20DeviceWaiter::found_callback_t cb);
+    void cancelWaitForDevice(OrviboS20DeviceWaiter &waiter);
+
+    /*
+     * Subscriptions (keepalives) are spread evenly over the subscribe interval (1 min)
+     * This sets the max number of subscriptions sent in one handle() call
+     */
+    void setSubscribeBudget(uint16_t max_per_tick)
+    {
+        m_subscribe_budget = max_per_tick ? max_per_tick : 1;
+    }
+
+    /* Subscribe scheduler instrumentation */
+    struct subscribe_stats_t
+    {
+        uint16_t last_tick;     /* Subscriptions sent in the last handle() that sent any */
+        uint16_t peak_per_tick; /* Max subscriptions sent in one handle() */
+        uint32_t total;         /* Total number of subscriptions sent */
+        uint32_t budget_hits;   /* Number of handle() calls limited by the budget */
+    };
+    const subscribe_stats_t &getSubscribeStats()
+    {
+        return m_subscribe_stats;
+    }
+    void resetSubscribeStats()
+    {
+        m_subscribe_stats = {};
+    }
+    /* This callback is called for each handle() call that sent subscriptions */
+    void onSubscribeTick(subscribe_tick_callback_t cb)
+    {
+        m_subscribe_tick_callback = cb;
+    }
+
+    /*
+     * Active discovery, e.g. right after begin()
+     * Without it a device is only bound when it happens to send something. The sweep
+     * sends a broadcast discovery request (answered by all devices) to broadcast_ip
+     * followed by a request for each device with a known MAC but no address yet, max
+     * batch of them per handle() call. This is repeated rounds times, interval_ms apart.
+     * The replies are handled like any other packet ("any MAC" devices are bound in
+     * reply order) and devices bound by the sweep are subscribed right away.
+     * The sweep ends when all devices registered at start have an address, or
+     * interval_ms after the last round. Returns false if not started.
+     */
+    bool startDiscovery(IPAddress broadcast_ip = IPAddress(255, 255, 255, 255), uint8_t rounds = 3, uint16_t interval_ms = 500, uint16_t batch = 8);
+    const discovery_stats_t &getDiscoveryStats()
+    {
+        return m_discovery_stats;
+    }
+    /* Called from handle() when the sweep has ended */
+    void onDiscoveryDone(discovery_done_callback_t cb)
+    {
+        m_discovery_done_callback = cb;
+    }
+
+    /*
+     * Active liveness probing
+     * By default a device is disconnected when nothing has been received from it for
+     * 150 s. With probing each subscription to a connected device is a probe, and a
+     * device that has been quiet for quiet_ms is probed as well. A probe that isn't
+     * answered within the probe timeout (4 times the smoothed RTT of the device, min
+     * 200 ms, doubled for each retry) is retried, and after max_missed unanswered
+     * probes the device is disconnected. A command that times out triggers a probe
+     * right away. With quiet_ms at the subscribe interval (1 min) no extra traffic is
+     * sent, lower values detect a silent failure sooner at the cost of more probes.
+     * quiet_ms = 0 turns probing off.
+     */
+    void setLivenessProbing(uint32_t quiet_ms = 60000, uint8_t max_missed = 3)
+    {
+        m_liveness_quiet_ms = quiet_ms;
+        m_liveness_max_missed = max_missed ? max_missed : 1;
+    }
+    const liveness_stats_t &getLivenessStats()
+    {
+        return m_liveness_stats;
+    }
+
+    /*
+     * Retransmission policy for acknowledged commands (see OrviboS20Device::setState())
+     * A command is sent max_attempts times in total. The first retransmission timeout is
+     * the larger of timeout_ms and twice the smoothed RTT of the device and it is doubled
+     * for each retransmission.
+     */
+    void setCommandRetry(uint8_t max_attempts, uint16_t timeout_ms)
+    {
+        m_cmd_max_attempts = max_attempts ? max_attempts : 1;
+        m_cmd_timeout_ms = timeout_ms;
+    }
+
+    /*
+     * Relay commands are queued and sent in the next handle() call. Several commands for
+     * the same device before handle() are coalesced (last one wins) and a command is not
+     * sent at all if the device has already confirmed the requested state.
+     */
+    struct command_stats_t
+    {
+        uint32_t requested; /* setState() calls */
+        uint32_t sent;      /* Commands sent to devices */
+        uint32_t coalesced; /* Commands replaced by a later one before being sent */
+        uint32_t skipped;   /* Commands not sent since the device already had the state */
+    };
+    const command_stats_t &getCommandStats()
+    {
+        return m_cmd_stats;
+    }
+
+    /* State of the set of MACs used for onFoundDevice(), see ORVIBO_SEEN_DEVICES_MAX */
+    struct seen_stats_t
+    {
+        uint16_t count;
+        uint16_t capacity;
+        uint32_t evicted;    /* MACs forgotten to make room (LRU) */
+        uint32_t overflowed; /* MACs not remembered since the set was full (no LRU) */
+    };
+    seen_stats_t getSeenStats()
+    {
+        return {(uint16_t)m_seen_devices.size(), (uint16_t)m_seen_devices.capacity(), m_seen_devices.evicted(), m_seen_devices.overflowed()};
+    }
+
+    /*
+     * Snapshot of the traffic counters (all zero if built with ORVIBO_METRICS 0)
+     * Cheap enough to call from loop(), the counters are only copied.
+     */
+    OrviboS20Metrics getMetrics()
+    {
+#if ORVIBO_METRICS
+        OrviboS20Metrics metrics = m_metrics;
+        if (m_event_queue)
+        {
+            // dispatch() may run on another thread, it keeps its own counter
+            metrics.callbacks += m_event_queue->m_callbacks.load(std::memory_order_relaxed);
+        }
+        return metrics;
+#else
+        return {};
+#endif
+    }
+    void resetMetrics()
+    {
+#if ORVIBO_METRICS
+        m_metrics = {};
+        if (m_event_queue)
+        {
+            m_event_queue->m_callbacks.store(0, std::memory_order_relaxed);
+        }
+#endif
+    }
+
     /* Start UDP communication */
     bool begin();
     /* Stop UDP communication */
@@ -24,27 +385,144 @@ public:
     /* Call this from loop() */
     void handle();
 
+    /*
+     * Limit the work done by the receive loop in each handle() call
+     * handle() processes received datagrams until there are no more, max_packets have
+     * been processed or max_us microseconds have passed (0 = no time limit)
+     */
+    void setRxBudget(uint16_t max_packets, unsigned long max_us = 0)
+    {
+        m_rx_budget_packets = max_packets ? max_packets : 1;
+        m_rx_budget_us = max_us;
+    }
+
+    /* Returns how many datagrams the last handle() processed and how many are still waiting */
+    const rx_report_t &getRxReport()
+    {
+        return m_rx_report;
+    }
+
 protected:
     bool m_started = false;
     found_device_callback_t m_found_device_callback = nullptr;
+    uint16_t m_rx_budget_packets = 16;
+    unsigned long m_rx_budget_us = 2000;
+    rx_report_t m_rx_report = {};
+    uint16_t m_subscribe_budget = 4;
+    uint32_t m_next_subscribe_time = 0;
+    subscribe_stats_t m_subscribe_stats = {};
+    subscribe_tick_callback_t m_subscribe_tick_callback = nullptr;
+    uint8_t m_cmd_max_attempts = 4;
+    uint16_t m_cmd_timeout_ms = 250;
+    command_stats_t m_cmd_stats = {};
+#if ORVIBO_METRICS
+    OrviboS20Metrics m_metrics = {};
+#endif
+    OrviboS20SeenSet<ORVIBO_SEEN_DEVICES_MAX, ORVIBO_SEEN_DEVICES_LRU> m_seen_devices;
+    OrviboS20Registry m_registry;
+    OrviboS20EventQueue *m_event_queue = nullptr;
+    OrviboS20DeviceWaiter *m_device_waiters = nullptr;
+    uint32_t m_waiter_generation = 0;
+    uint32_t m_discovery_ip = 0;
+    uint32_t m_discovery_start = 0;
+    uint32_t m_next_discovery_time = 0;
+    uint16_t m_discovery_interval_ms = 0;
+    uint16_t m_discovery_batch = 0;
+    uint8_t m_discovery_rounds_left = 0;
+    uint8_t m_discovery_round = 0; /* Rounds started by the current sweep */
+    discovery_stats_t m_discovery_stats = {};
+    discovery_done_callback_t m_discovery_done_callback = nullptr;
+    uint32_t m_binding_changes = 0; /* Incremented when a device address or state changes */
+    uint32_t m_liveness_quiet_ms = 0;
+    uint8_t m_liveness_max_missed = 3;
+    liveness_stats_t m_liveness_stats = {};
+
+    bool checkIfNewDevice(uint8_t *mac);
+    void completeDeviceWaiters(const uint8_t *mac);
+    bool checkRxPacket();
+    void processRxPackets();
+    void scheduleSubscriptions();
+    void runDiscovery();
+    void finishDiscovery();
+    bool sendDiscovery(const uint8_t *frame, size_t length);
+    size_t sendDatagrams(const OrviboS20Datagram *datagrams, size_t count);
+    void flushCommands();
+    void retransmitCommands();
 
-    void checkIfNewDevice(uint8_t *mac);
-    void checkRxPacket();
+    friend class OrviboS20Device;
+    friend class OrviboS20Scene;
+    friend class OrviboS20EventQueue;
+    friend class OrviboS20BindingStore;
 };
 
 class OrviboS20Device
 {
 public:
-    typedef std::function<void(OrviboS20Device &device)> connect_callback_t;
-    typedef std::function<void(OrviboS20Device &device, bool)> state_change_callback_t;
+    typedef OrviboS20Callback<void(OrviboS20Device &device)> connect_callback_t;
+    typedef OrviboS20Callback<void(OrviboS20Device &device, bool)> state_change_callback_t;
+    typedef OrviboS20Callback<void(OrviboS20Device &device, OrviboCommandResult result, uint32_t rtt_us)> command_callback_t;
+    typedef OrviboS20DeviceTimers timer_wheel_t;
 
-    OrviboS20Device(const char name[] = "");
-    OrviboS20Device(const uint8_t mac[], const char name[] = "");
+    /* Round-trip time statistics for acknowledged commands */
+    struct rtt_stats_t
+    {
+        uint32_t last_us;     /* Last measured RTT */
+        uint32_t min_us;
+        uint32_t max_us;
+        uint32_t smoothed_us; /* Exponentially weighted moving average (1/8) */
+        uint32_t samples;
+        uint32_t succeeded;   /* Number of confirmed commands */
+        uint32_t failed;      /* Number of commands that timed out */
+        uint32_t retransmits;
+    };
+
+    /* Snapshot returned by getMetrics() */
+    struct metrics_t
+    {
+        uint32_t last_seen_ms;     /* Time since the last datagram from the device, UINT32_MAX if never */
+        OrviboS20RttHistogram rtt; /* Unambiguous RTT samples (all zero if built with ORVIBO_METRICS 0) */
+    };
+
+    /*
+     * owner is the OrviboS20Class instance handling the communication with the device
+     * If no MAC is specified the first unknown S20 device found is used.
+     */
+    OrviboS20Device(const char name[] = "", OrviboS20Class &owner = OrviboS20);
+    OrviboS20Device(const uint8_t mac[], const char name[] = "", OrviboS20Class &owner = OrviboS20);
     ~OrviboS20Device();
 
-    /* Sets the relay state (true = on) */
+    /*
+     * Sets the relay state (true = on)
+     * The command is sent in next OrviboS20.handle() call, see OrviboS20.getCommandStats()
+     * Returns false if the address of the device is not known yet
+     */
     bool setState(bool state);
 
+    /*
+     * Sets the relay state and waits for the device to confirm it
+     * The command is retransmitted until the device reports the new state or until the
+     * retry policy (see OrviboS20.setCommandRetry()) is exhausted. cb is called from
+     * OrviboS20.handle() with the result and the round-trip time of the confirmed
+     * transmission. Issuing a new command before completion supersedes the pending one.
+     * If the device address is not known cb is called directly with RESULT_NOT_CONNECTED
+     * and false is returned.
+     */
+    bool setState(bool state, command_callback_t cb);
+
+    /* Returns true while a command is queued or waiting for confirmation */
+    bool isCommandPending()
+    {
+        return (m_queued_state >= 0) || (m_pending_state >= 0);
+    }
+
+    /* Returns round-trip time statistics for acknowledged commands */
+    const rtt_stats_t &getRttStats()
+    {
+        return m_rtt_stats;
+    }
+
+    metrics_t getMetrics();
+
     /* Returns last known relay state */
     bool getState();
 
@@ -79,7 +557,8 @@ public:
 
     /*
      * This callback is called when the device is disconnected
-     * Note: It will take up to ~3 min before this is called after the device is unplugged
+     * Note: It will take ~2.5 min before this is called after the device is unplugged,
+     * unless liveness probing is used (see OrviboS20Class::setLivenessProbing())
      */
     void onDisconnect(connect_callback_t cb)
     {
@@ -92,27 +571,85 @@ public:
         m_state_change_callback = cb;
     }
 
+    OrviboS20Class &getOwner()
+    {
+        return *m_owner;
+    }
+
 protected:
+    OrviboS20Class *m_owner;
     IPAddress m_ip = {};
     uint8_t m_mac[6] = {};
     char m_name[32];
     OrviboS20Device *m_next = {};
+    OrviboS20Device *m_prev = {};
+    OrviboS20Device *m_next_any_mac = {};
     bool m_any_mac;
+    bool m_mac_learned = false; /* Created as "any MAC" device and bound */
     int m_last_state = -1;
     bool m_connected = false;
-    unsigned int m_last_rx_time = 0;
+    bool m_heard = false; /* Something has been received, restored devices only have an address */
+    uint32_t m_last_rx_time = 0;
+    timer_wheel_t::Node m_tmo_node;
+
+    /* Liveness probing, see OrviboS20Class::setLivenessProbing() */
+    bool m_probe_outstanding = false;
+    uint8_t m_probes_missed = 0;
+    uint32_t m_probe_sent_us = 0;
+    uint32_t m_probe_srtt_us = 0;
+
+    /* Command waiting to be sent in next handle() */
+    int8_t m_queued_state = -1;
+    int8_t m_sent_state = -1; /* Last state sent that the device has not reported yet */
+    command_callback_t m_queued_callback = nullptr;
+    OrviboS20Device *m_next_queued = {};
+
+    /* Acknowledged command state */
+    int8_t m_pending_state = -1;
+    uint8_t m_pending_attempts = 0;
+    uint32_t m_pending_timeout_ms = 0;
+    uint32_t m_pending_deadline = 0;
+    uint32_t m_pending_sent_us = 0;
+    command_callback_t m_pending_callback = nullptr;
+    OrviboS20Device *m_next_pending = {};
+    rtt_stats_t m_rtt_stats = {};
+#if ORVIBO_METRICS
+    OrviboS20RttHistogram m_rtt_histogram = {};
+#endif
     connect_callback_t m_connect_callback = nullptr;
     connect_callback_t m_disconnect_callback = nullptr;
     state_change_callback_t m_state_change_callback = nullptr;
 
-    void sendCommand(uint16_t command, uint8_t *payload, size_t length);
-    void subscribe();
+    /* Prebuilt CMD_SUBSCRIBE frame (header + reversed MAC + padding), see updateFrameCache() */
+    uint8_t m_subscribe_frame[30];
+
+    void updateFrameCache();
+    bool sendFrame(const uint8_t *frame, size_t length);
+    bool sendCommand(uint16_t command, const uint8_t *payload, size_t length);
+    bool subscribe();
+    bool keepAlive();
+    bool sendProbe();
+    uint32_t probeTimeout();
+    void scheduleConnectTimeout();
     void checkConnectTimeout();
     void updateConnectState(bool connected);
-    void handlePacket(uint16_t command, uint8_t *payload, size_t length);
+    void handleFrame(const OrviboS20Frame &frame);
+    void handleStateChange(const OrviboS20Frame &frame);
+    bool sendState(bool state);
+    bool queueState(bool state, command_callback_t cb);
+    void flushQueuedState();
+    bool startCommand(bool state, command_callback_t cb);
+    void armCommand(bool state, command_callback_t cb);
+    void cancelQueuedState();
+    size_t encodeCommand(uint8_t *frame, uint16_t command, const uint8_t *payload, size_t length);
+    bool encodeState(bool state, uint8_t *frame, OrviboS20Datagram &datagram);
+    void completeCommand(OrviboCommandResult result, uint32_t rtt_us);
+    void addRttSample(uint32_t rtt_us);
 
     friend class OrviboS20Class;
-    friend class SharedData;
+    friend class OrviboS20Scene;
+    friend class OrviboS20Registry;
+    friend class OrviboS20EventQueue;
+    friend class OrviboS20SetStateAwaitable;
+    friend class OrviboS20BindingStore;
 };
-
-extern OrviboS20Class OrviboS20;
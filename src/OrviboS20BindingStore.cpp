@@ -0,0 +1,334 @@
+#include "OrviboS20BindingStore.h"
+
+/***********************************************************************************
+ * Consts
+ ***********************************************************************************/
+
+static const uint8_t STATE_UNKNOWN = 0xFF;
+static const size_t SUBSCRIBE_BATCH = 16;
+
+/***********************************************************************************
+ * Static functions
+ ***********************************************************************************/
+
+static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t length)
+{
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++)
+    {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+/***********************************************************************************
+ * OrviboS20FileBindingStorage class definition
+ ***********************************************************************************/
+
+#if defined(ARDUINO) || defined(ORVIBO_HAS_POSIX_TRANSPORT)
+
+OrviboS20FileBindingStorage::OrviboS20FileBindingStorage(const char *path) : m_path(path)
+{
+    snprintf(m_tmp_path, sizeof(m_tmp_path), "%s.tmp", path);
+}
+
+#ifdef ARDUINO
+
+bool OrviboS20FileBindingStorage::openRead()
+{
+    m_writing = false;
+    m_file = LittleFS.open(m_path, "r");
+    return (bool)m_file;
+}
+
+bool OrviboS20FileBindingStorage::openWrite()
+{
+    m_writing = true;
+    m_failed = false;
+    m_file = LittleFS.open(m_tmp_path, "w");
+    return (bool)m_file;
+}
+
+size_t OrviboS20FileBindingStorage::read(uint8_t *buffer, size_t length)
+{
+    return m_file.read(buffer, length);
+}
+
+bool OrviboS20FileBindingStorage::write(const uint8_t *data, size_t length)
+{
+    if (m_file.write(data, length) != length)
+    {
+        m_failed = true;
+    }
+    return !m_failed;
+}
+
+bool OrviboS20FileBindingStorage::close(bool commit)
+{
+    m_file.close();
+    if (!m_writing)
+    {
+        return true;
+    }
+    m_writing = false;
+    if (!commit || m_failed)
+    {
+        LittleFS.remove(m_tmp_path);
+        return false;
+    }
+    return LittleFS.rename(m_tmp_path, m_path);
+}
+
+#else
+
+bool OrviboS20FileBindingStorage::openRead()
+{
+    m_writing = false;
+    m_file = fopen(m_path, "rb");
+    return m_file != nullptr;
+}
+
+bool OrviboS20FileBindingStorage::openWrite()
+{
+    m_writing = true;
+    m_failed = false;
+    m_file = fopen(m_tmp_path, "wb");
+    return m_file != nullptr;
+}
+
+size_t OrviboS20FileBindingStorage::read(uint8_t *buffer, size_t length)
+{
+    return fread(buffer, 1, length, m_file);
+}
+
+bool OrviboS20FileBindingStorage::write(const uint8_t *data, size_t length)
+{
+    if (fwrite(data, 1, length, m_file) != length)
+    {
+        m_failed = true;
+    }
+    return !m_failed;
+}
+
+bool OrviboS20FileBindingStorage::close(bool commit)
+{
+    if (m_file == nullptr)
+    {
+        return false;
+    }
+    if (fclose(m_file) != 0)
+    {
+        m_failed = true;
+    }
+    m_file = nullptr;
+    if (!m_writing)
+    {
+        return true;
+    }
+    m_writing = false;
+    if (!commit || m_failed)
+    {
+        remove(m_tmp_path);
+        return false;
+    }
+    return rename(m_tmp_path, m_path) == 0;
+}
+
+#endif
+
+#endif
+
+/***********************************************************************************
+ * OrviboS20BindingStore class definition
+ ***********************************************************************************/
+
+bool OrviboS20BindingStore::validate(uint16_t &count)
+{
+    // The whole image is checked before anything is applied so a torn or corrupt
+    // write never results in half restored bindings
+    uint8_t buffer[ORVIBO_BINDINGS_RECORD_LEN + 32];
+    if (m_storage.read(buffer, ORVIBO_BINDINGS_HEADER_LEN) != ORVIBO_BINDINGS_HEADER_LEN ||
+        (memcmp(buffer, ORVIBO_BINDINGS_MAGIC, sizeof(ORVIBO_BINDINGS_MAGIC)) != 0) ||
+        (buffer[4] != ORVIBO_BINDINGS_VERSION))
+    {
+        return false;
+    }
+    count = buffer[6] | (buffer[7] << 8);
+    uint32_t crc = crc32(0, buffer, ORVIBO_BINDINGS_HEADER_LEN);
+    for (uint16_t i = 0; i < count; i++)
+    {
+        if (m_storage.read(buffer, ORVIBO_BINDINGS_RECORD_LEN) != ORVIBO_BINDINGS_RECORD_LEN)
+        {
+            return false;
+        }
+        uint8_t name_length = buffer[ORVIBO_BINDINGS_RECORD_LEN - 1];
+        if ((name_length > 32) ||
+            (m_storage.read(&buffer[ORVIBO_BINDINGS_RECORD_LEN], name_length) != name_length))
+        {
+            return false;
+        }
+        crc = crc32(crc, buffer, ORVIBO_BINDINGS_RECORD_LEN + name_length);
+    }
+    if (m_storage.read(buffer, 4) != 4)
+    {
+        return false;
+    }
+    return crc == (uint32_t)(buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((uint32_t)buffer[3] << 24));
+}
+
+size_t OrviboS20BindingStore::restore()
+{
+    uint16_t count = 0;
+    if (!m_storage.openRead())
+    {
+        return 0;
+    }
+    bool valid = validate(count);
+    m_storage.close(false);
+    if (!valid || !m_storage.openRead())
+    {
+        return 0;
+    }
+
+    OrviboS20Registry &registry = m_owner.m_registry;
+    uint8_t header[ORVIBO_BINDINGS_HEADER_LEN];
+    m_storage.read(header, sizeof(header));
+    size_t restored = 0;
+    for (uint16_t i = 0; i < count; i++)
+    {
+        uint8_t record[ORVIBO_BINDINGS_RECORD_LEN];
+        char name[33];
+        m_storage.read(record, sizeof(record));
+        uint8_t name_length = record[ORVIBO_BINDINGS_RECORD_LEN - 1];
+        m_storage.read((uint8_t *)name, name_length);
+        name[name_length] = 0;
+
+        const uint8_t *mac = &record[0];
+        OrviboS20Device *dev = registry.findDevice(mac);
+        if (!dev && (record[11] & ORVIBO_BINDING_ANY_MAC))
+        {
+            dev = registry.bindAnyMacDevice(mac, name);
+        }
+        if (!dev)
+        {
+            // The device doesn't exist anymore
+            continue;
+        }
+        dev->m_ip = IPAddress(record[6], record[7], record[8], record[9]);
+        if (record[10] != STATE_UNKNOWN)
+        {
+            dev->m_last_state = record[10] ? 1 : 0;
+        }
+        restored++;
+    }
+    m_storage.close(false);
+
+    m_saved_changes = m_owner.m_binding_changes;
+    m_last_save_time = millis();
+    if (m_owner.m_started)
+    {
+        subscribeAll();
+    }
+    return restored;
+}
+
+size_t OrviboS20BindingStore::subscribeAll()
+{
+    // One burst instead of waiting for the subscribe scheduler to get to each device
+    OrviboS20Transport *transport = m_owner.m_registry.m_transport;
+    OrviboS20Datagram datagrams[SUBSCRIBE_BATCH];
+    size_t count = 0;
+    size_t sent = 0;
+    OrviboS20Device *dev = m_owner.m_registry.getFirstDevice();
+    while (dev || count)
+    {
+        if (dev && ((uint32_t)dev->m_ip != 0))
+        {
+            datagrams[count++] = {dev->m_ip, ORVIBO_UDP_PORT, dev->m_subscribe_frame, sizeof(dev->m_subscribe_frame)};
+        }
+        dev = dev ? dev->m_next : nullptr;
+        if ((count == SUBSCRIBE_BATCH) || (!dev && count))
+        {
+            size_t n = transport->sendPackets(datagrams, count);
+            ORVIBO_METRIC_ADD(m_owner.m_metrics, tx_packets, n);
+            ORVIBO_METRIC_ADD(m_owner.m_metrics, tx_failed, count - n);
+            sent += n;
+            count = 0;
+        }
+    }
+    return sent;
+}
+
+bool OrviboS20BindingStore::save()
+{
+    if (!m_storage.openWrite())
+    {
+        return false;
+    }
+    uint16_t count = 0;
+    for (OrviboS20Device *dev = m_owner.m_registry.getFirstDevice(); dev; dev = dev->m_next)
+    {
+        if (!dev->m_any_mac && ((uint32_t)dev->m_ip != 0) && (count < UINT16_MAX))
+        {
+            count++;
+        }
+    }
+
+    uint8_t header[ORVIBO_BINDINGS_HEADER_LEN] = {};
+    memcpy(header, ORVIBO_BINDINGS_MAGIC, sizeof(ORVIBO_BINDINGS_MAGIC));
+    header[4] = ORVIBO_BINDINGS_VERSION;
+    header[6] = count;
+    header[7] = count >> 8;
+    uint32_t crc = crc32(0, header, sizeof(header));
+    bool ok = m_storage.write(header, sizeof(header));
+
+    OrviboS20Device *dev = m_owner.m_registry.getFirstDevice();
+    for (uint16_t i = 0; ok && (i < count); dev = dev->m_next)
+    {
+        if (dev->m_any_mac || ((uint32_t)dev->m_ip == 0))
+        {
+            continue;
+        }
+        uint8_t record[ORVIBO_BINDINGS_RECORD_LEN + 32];
+        uint8_t name_length = strnlen(dev->m_name, sizeof(dev->m_name));
+        memcpy(&record[0], dev->m_mac, 6);
+        for (int b = 0; b < 4; b++)
+        {
+            record[6 + b] = dev->m_ip[b];
+        }
+        record[10] = (dev->m_last_state < 0) ? STATE_UNKNOWN : dev->m_last_state;
+        record[11] = dev->m_mac_learned ? ORVIBO_BINDING_ANY_MAC : 0;
+        record[12] = name_length;
+        memcpy(&record[ORVIBO_BINDINGS_RECORD_LEN], dev->m_name, name_length);
+        crc = crc32(crc, record, ORVIBO_BINDINGS_RECORD_LEN + name_length);
+        ok = m_storage.write(record, ORVIBO_BINDINGS_RECORD_LEN + name_length);
+        i++;
+    }
+
+    uint8_t trailer[4] = {(uint8_t)crc, (uint8_t)(crc >> 8), (uint8_t)(crc >> 16), (uint8_t)(crc >> 24)};
+    ok = ok && m_storage.write(trailer, sizeof(trailer));
+    ok = m_storage.close(ok) && ok;
+    if (ok)
+    {
+        m_saved_changes = m_owner.m_binding_changes;
+        m_last_save_time = millis();
+    }
+    return ok;
+}
+
+void OrviboS20BindingStore::handle()
+{
+    if ((m_saved_changes != m_owner.m_binding_changes) &&
+        ((uint32_t)(millis() - m_last_save_time) >= m_save_interval_ms))
+    {
+        if (!save())
+        {
+            // Don't retry on every call
+            m_last_save_time = millis();
+        }
+    }
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include "OrviboS20.h"
+
+/*
+ * Persistent device bindings for warm starts
+ *
+ * The learned MAC, IP address and last relay state of each bound device are saved so
+ * that they can be restored after a reboot, before any device has sent anything.
+ * All integers are little endian.
+ *   header: magic "OS2B" (4) | version (1) | reserved (1) | record count (2)
+ *   record: MAC (6) | IPv4 address (4, a.b.c.d order) | state (1, 0xFF = unknown) |
+ *           flags (1) | name length (1) | name (name length)
+ *   trailer: CRC-32 of header and records (4)
+ */
+
+static const uint8_t ORVIBO_BINDINGS_MAGIC[4] = {'O', 'S', '2', 'B'};
+static const uint8_t ORVIBO_BINDINGS_VERSION = 1;
+static const size_t ORVIBO_BINDINGS_HEADER_LEN = 8;
+static const size_t ORVIBO_BINDINGS_RECORD_LEN = 13; /* Without the name */
+
+/* Record flags */
+static const uint8_t ORVIBO_BINDING_ANY_MAC = 0x01; /* Bound to an "any MAC" device */
+
+/*
+ * Where the bindings are kept
+ * A write must not replace the stored bindings until it is closed with commit = true.
+ */
+class OrviboS20BindingStorage
+{
+public:
+    virtual ~OrviboS20BindingStorage() {}
+
+    /* Returns false if nothing is stored */
+    virtual bool openRead() = 0;
+    virtual bool openWrite() = 0;
+    virtual size_t read(uint8_t *buffer, size_t length) = 0;
+    virtual bool write(const uint8_t *data, size_t length) = 0;
+    /* commit is ignored after openRead(), returns false if the write failed */
+    virtual bool close(bool commit) = 0;
+};
+
+/*
+ * Bindings stored in a file, in LittleFS on the ESP8266 (LittleFS.begin() must have been
+ * called) and in the file system on Linux. A temporary file is renamed over path when a
+ * write is committed. path must stay valid.
+ */
+#if defined(ARDUINO) || defined(ORVIBO_HAS_POSIX_TRANSPORT)
+
+#ifdef ARDUINO
+#include <LittleFS.h>
+#else
+#include <stdio.h>
+#endif
+
+class OrviboS20FileBindingStorage : public OrviboS20BindingStorage
+{
+public:
+    OrviboS20FileBindingStorage(const char *path);
+
+    bool openRead() override;
+    bool openWrite() override;
+    size_t read(uint8_t *buffer, size_t length) override;
+    bool write(const uint8_t *data, size_t length) override;
+    bool close(bool commit) override;
+
+protected:
+    const char *m_path;
+    char m_tmp_path[64];
+    bool m_writing = false;
+    bool m_failed = false;
+#ifdef ARDUINO
+    File m_file;
+#else
+    FILE *m_file = nullptr;
+#endif
+};
+
+#endif
+
+/*
+ * Saves and restores the bindings of the devices of an OrviboS20Class instance
+ *
+ *   OrviboS20FileBindingStorage storage("/s20.bin");
+ *   OrviboS20BindingStore bindings(storage);
+ *
+ *   OrviboS20.begin();
+ *   bindings.restore(); // After the devices have been created
+ *   ...
+ *   OrviboS20.handle();
+ *   bindings.handle();  // Saves when something has changed, at most once a minute
+ *
+ * Devices created with a MAC are matched by MAC. A device that was bound to an
+ * "any MAC" device is given to the first unbound "any MAC" device with the same name,
+ * so the bindings are kept as long as the devices are created in the same order.
+ */
+class OrviboS20BindingStore
+{
+public:
+    OrviboS20BindingStore(OrviboS20BindingStorage &storage, OrviboS20Class &owner = OrviboS20) : m_storage(storage), m_owner(owner) {}
+
+    /*
+     * Restores the stored bindings and, if OrviboS20Class::begin() has been called,
+     * sends a subscription to each restored device at once so commands can be sent
+     * right away. Returns the number of devices restored, 0 if nothing valid is stored.
+     * A restored device counts as never seen until it sends something: it is not
+     * connected and getMetrics().last_seen_ms is UINT32_MAX.
+     */
+    size_t restore();
+
+    /* Writes the bindings of all devices with a known address */
+    bool save();
+
+    /* Saves from handle() when bindings or relay states have changed (default 60 s, limits flash wear) */
+    void setSaveInterval(uint32_t interval_ms)
+    {
+        m_save_interval_ms = interval_ms;
+    }
+
+    /* Call this from loop() to save changes */
+    void handle();
+
+protected:
+    OrviboS20BindingStorage &m_storage;
+    OrviboS20Class &m_owner;
+    uint32_t m_save_interval_ms = 60000;
+    uint32_t m_last_save_time = 0;
+    uint32_t m_saved_changes = 0;
+
+    bool validate(uint16_t &count);
+    size_t subscribeAll();
+};
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <new>
+#include <stddef.h>
+#include <type_traits>
+#include <utility>
+
+/*
+ * Max size of the state captured by a callback (lambda captures, functor members)
+ * The default fits a lambda capturing two pointers, e.g. [this, &device].
+ */
+#ifndef ORVIBO_CALLBACK_CAPACITY
+#define ORVIBO_CALLBACK_CAPACITY (2 * sizeof(void *))
+#endif
+
+template <class Signature, size_t CAPACITY = ORVIBO_CALLBACK_CAPACITY>
+class OrviboS20Callback;
+
+/*
+ * Callable wrapper that never allocates
+ * Works like std::function but the callable is stored inside the object. Assigning
+ * a callable with a larger capture than CAPACITY fails to compile. Calling an empty
+ * callback does nothing.
+ */
+template <class R, class... Args, size_t CAPACITY>
+class OrviboS20Callback<R(Args...), CAPACITY>
+{
+public:
+    constexpr OrviboS20Callback() : m_storage()
+    {
+    }
+
+    constexpr OrviboS20Callback(std::nullptr_t) : m_storage()
+    {
+    }
+
+    template <class F, class = typename std::enable_if<!std::is_same<typename std::decay<F>::type, OrviboS20Callback>::value>::type>
+    OrviboS20Callback(F &&f)
+    {
+        assign(std::forward<F>(f));
+    }
+
+    OrviboS20Callback(const OrviboS20Callback &other)
+    {
+        copyFrom(other);
+    }
+
+    ~OrviboS20Callback()
+    {
+        reset();
+    }
+
+    OrviboS20Callback &operator=(const OrviboS20Callback &other)
+    {
+        if (this != &other)
+        {
+            reset();
+            copyFrom(other);
+        }
+        return *this;
+    }
+
+    OrviboS20Callback &operator=(std::nullptr_t)
+    {
+        reset();
+        return *this;
+    }
+
+    explicit operator bool() const
+    {
+        return m_invoke != nullptr;
+    }
+
+    /* Returns the stored callable if it is an F (same as std::function::target()), otherwise nullptr */
+    template <class F>
+    F *target()
+    {
+        return (m_invoke == &invoke<F>) ? static_cast<F *>(static_cast<void *>(&m_storage)) : nullptr;
+    }
+
+    R operator()(Args... args) const
+    {
+        if (m_invoke == nullptr)
+        {
+            return R();
+        }
+        return m_invoke(const_cast<void *>(static_cast<const void *>(&m_storage)), std::forward<Args>(args)...);
+    }
+
+protected:
+    typedef R (*invoke_t)(void *storage, Args... args);
+    /* Copy constructs from src into dst, or destroys dst when src is nullptr */
+    typedef void (*manage_t)(void *dst, const void *src);
+
+    typename std::aligned_storage<CAPACITY, alignof(void *)>::type m_storage;
+    invoke_t m_invoke = nullptr;
+    manage_t m_manage = nullptr;
+
+    template <class F>
+    static R invoke(void *storage, Args... args)
+    {
+        return (*static_cast<F *>(storage))(std::forward<Args>(args)...);
+    }
+
+    template <class F>
+    static void manage(void *dst, const void *src)
+    {
+        if (src)
+        {
+            new (dst) F(*static_cast<const F *>(src));
+        }
+        else
+        {
+            static_cast<F *>(dst)->~F();
+        }
+    }
+
+    template <class T>
+    static bool isNull(T *fn)
+    {
+        return fn == nullptr;
+    }
+
+    template <class T>
+    static bool isNull(const T &)
+    {
+        return false;
+    }
+
+    template <class F>
+    void assign(F &&f)
+    {
+        typedef typename std::decay<F>::type Fn;
+        static_assert(sizeof(Fn) <= CAPACITY, "Callback capture too large, reduce it or raise ORVIBO_CALLBACK_CAPACITY");
+        static_assert(alignof(Fn) <= alignof(void *), "Callback capture alignment not supported");
+        if (isNull(f))
+        {
+            return;
+        }
+        new (&m_storage) Fn(std::forward<F>(f));
+        m_invoke = &invoke<Fn>;
+        m_manage = &manage<Fn>;
+    }
+
+    void copyFrom(const OrviboS20Callback &other)
+    {
+        if (other.m_invoke)
+        {
+            other.m_manage(&m_storage, &other.m_storage);
+            m_invoke = other.m_invoke;
+            m_manage = other.m_manage;
+        }
+    }
+
+    void reset()
+    {
+        if (m_invoke)
+        {
+            m_manage(&m_storage, nullptr);
+            m_invoke = nullptr;
+            m_manage = nullptr;
+        }
+    }
+};
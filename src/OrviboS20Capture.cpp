@@ -0,0 +1,208 @@
+#include "OrviboS20Capture.h"
+
+/***********************************************************************************
+ * Static functions
+ ***********************************************************************************/
+
+static void putLe(uint8_t *dst, uint64_t value, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; i++)
+    {
+        dst[i] = value >> (8 * i);
+    }
+}
+
+static uint64_t getLe(const uint8_t *src, size_t bytes)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; i++)
+    {
+        value |= (uint64_t)src[i] << (8 * i);
+    }
+    return value;
+}
+
+/***********************************************************************************
+ * OrviboS20CaptureTransport class definition
+ ***********************************************************************************/
+
+bool OrviboS20CaptureTransport::begin(uint16_t port)
+{
+    if (!m_header_written)
+    {
+        uint8_t header[ORVIBO_CAPTURE_FILE_HEADER_LEN] = {};
+        memcpy(header, ORVIBO_CAPTURE_MAGIC, sizeof(ORVIBO_CAPTURE_MAGIC));
+        header[4] = ORVIBO_CAPTURE_VERSION;
+        m_header_written = m_sink.write(header, sizeof(header));
+        m_last_us = micros();
+        m_time_us = 0;
+    }
+    return m_transport.begin(port);
+}
+
+void OrviboS20CaptureTransport::stop()
+{
+    m_transport.stop();
+}
+
+int OrviboS20CaptureTransport::parsePacket()
+{
+    // The whole datagram is read here so that it can be recorded even if the
+    // library only reads parts of it
+    int size = m_transport.parsePacket();
+    m_rx_pos = 0;
+    m_rx_length = 0;
+    if (size > 0)
+    {
+        int length = m_transport.read(m_rx_buffer, sizeof(m_rx_buffer));
+        m_rx_length = (length > 0) ? length : 0;
+        record(CAPTURE_RX, m_transport.remoteIP(), m_transport.remotePort(), m_rx_buffer, m_rx_length, size);
+    }
+    return size;
+}
+
+int OrviboS20CaptureTransport::read(uint8_t *buffer, size_t length)
+{
+    size_t remaining = m_rx_length - m_rx_pos;
+    if (length > remaining)
+    {
+        length = remaining;
+    }
+    memcpy(buffer, &m_rx_buffer[m_rx_pos], length);
+    m_rx_pos += length;
+    return length;
+}
+
+IPAddress OrviboS20CaptureTransport::remoteIP()
+{
+    return m_transport.remoteIP();
+}
+
+uint16_t OrviboS20CaptureTransport::remotePort()
+{
+    return m_transport.remotePort();
+}
+
+int OrviboS20CaptureTransport::pending()
+{
+    return m_transport.pending();
+}
+
+int OrviboS20CaptureTransport::beginPacket(IPAddress ip, uint16_t port)
+{
+    m_tx_ip = ip;
+    m_tx_port = port;
+    m_tx_length = 0;
+    return m_transport.beginPacket(ip, port);
+}
+
+size_t OrviboS20CaptureTransport::write(const uint8_t *buffer, size_t length)
+{
+    size_t space = (m_tx_length < sizeof(m_tx_buffer)) ? sizeof(m_tx_buffer) - m_tx_length : 0;
+    size_t n = (length < space) ? length : space;
+    memcpy(&m_tx_buffer[m_tx_length], buffer, n);
+    m_tx_length += length;
+    return m_transport.write(buffer, length);
+}
+
+int OrviboS20CaptureTransport::endPacket()
+{
+    int ret = m_transport.endPacket();
+    if (ret)
+    {
+        record(CAPTURE_TX, m_tx_ip, m_tx_port, m_tx_buffer, m_tx_length, m_tx_length);
+    }
+    m_tx_length = 0;
+    return ret;
+}
+
+bool OrviboS20CaptureTransport::sendPacket(IPAddress ip, uint16_t port, const uint8_t *buffer, size_t length)
+{
+    bool sent = m_transport.sendPacket(ip, port, buffer, length);
+    if (sent)
+    {
+        record(CAPTURE_TX, ip, port, buffer, length, length);
+    }
+    return sent;
+}
+
+size_t OrviboS20CaptureTransport::sendPackets(const OrviboS20Datagram *datagrams, size_t count)
+{
+    size_t sent = m_transport.sendPackets(datagrams, count);
+    // The count doesn't tell which datagrams failed (they are skipped), the first
+    // ones are recorded
+    for (size_t i = 0; i < sent; i++)
+    {
+        record(CAPTURE_TX, datagrams[i].ip, datagrams[i].port, datagrams[i].data, datagrams[i].length, datagrams[i].length);
+    }
+    return sent;
+}
+
+void OrviboS20CaptureTransport::record(OrviboCaptureDirection direction, IPAddress ip, uint16_t port, const uint8_t *data, size_t length, size_t orig_length)
+{
+    // micros() wraps after ~71 min, the capture time is kept in 64 bits
+    uint32_t now = micros();
+    m_time_us += (uint32_t)(now - m_last_us);
+    m_last_us = now;
+
+    if (length > ORVIBO_CAPTURE_MAX_FRAME)
+    {
+        length = ORVIBO_CAPTURE_MAX_FRAME;
+    }
+    if (orig_length > UINT16_MAX)
+    {
+        orig_length = UINT16_MAX;
+    }
+    uint8_t header[ORVIBO_CAPTURE_RECORD_HEADER_LEN];
+    putLe(&header[0], m_time_us, 8);
+    header[8] = direction;
+    for (int i = 0; i < 4; i++)
+    {
+        header[9 + i] = ip[i];
+    }
+    putLe(&header[13], port, 2);
+    putLe(&header[15], length, 2);
+    putLe(&header[17], orig_length, 2);
+    if (!m_sink.write(header, sizeof(header)) || !m_sink.write(data, length))
+    {
+        m_dropped++;
+    }
+}
+
+/***********************************************************************************
+ * OrviboS20CaptureReader class definition
+ ***********************************************************************************/
+
+OrviboS20CaptureReader::OrviboS20CaptureReader(const uint8_t *data, size_t length) : m_data(data), m_length(length)
+{
+    m_valid = (length >= ORVIBO_CAPTURE_FILE_HEADER_LEN) &&
+              (memcmp(data, ORVIBO_CAPTURE_MAGIC, sizeof(ORVIBO_CAPTURE_MAGIC)) == 0) &&
+              (data[4] == ORVIBO_CAPTURE_VERSION);
+}
+
+bool OrviboS20CaptureReader::next(OrviboS20CaptureRecord &record)
+{
+    if (!m_valid || (m_length - m_pos < ORVIBO_CAPTURE_RECORD_HEADER_LEN))
+    {
+        return false;
+    }
+    const uint8_t *header = &m_data[m_pos];
+    uint16_t length = getLe(&header[15], 2);
+    if (m_length - m_pos - ORVIBO_CAPTURE_RECORD_HEADER_LEN < length)
+    {
+        return false;
+    }
+    record.time_us = getLe(&header[0], 8);
+    record.direction = (header[8] == CAPTURE_TX) ? CAPTURE_TX : CAPTURE_RX;
+    record.ip = IPAddress(header[9], header[10], header[11], header[12]);
+    record.port = getLe(&header[13], 2);
+    record.length = length;
+    record.orig_length = getLe(&header[17], 2);
+    if (record.orig_length < length)
+    {
+        record.orig_length = length;
+    }
+    record.data = &header[ORVIBO_CAPTURE_RECORD_HEADER_LEN];
+    m_pos += ORVIBO_CAPTURE_RECORD_HEADER_LEN + length;
+    return true;
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include "OrviboS20Transport.h"
+
+/*
+ * Packet capture at the transport boundary
+ *
+ * A capture starts with an 8 byte file header followed by one record per datagram.
+ * All integers are little endian.
+ *   file header: magic "OS2C" (4) | version (1) | reserved (3)
+ *   record:      time_us (8) | direction (1) | IPv4 address (4, a.b.c.d order) |
+ *                port (2) | length (2) | orig_length (2) | datagram (length)
+ * time_us is counted from the start of the capture. orig_length is the size of the
+ * datagram on the wire, length the number of bytes captured (see
+ * ORVIBO_CAPTURE_MAX_FRAME).
+ */
+
+static const uint8_t ORVIBO_CAPTURE_MAGIC[4] = {'O', 'S', '2', 'C'};
+static const uint8_t ORVIBO_CAPTURE_VERSION = 1;
+static const size_t ORVIBO_CAPTURE_FILE_HEADER_LEN = 8;
+static const size_t ORVIBO_CAPTURE_RECORD_HEADER_LEN = 19;
+
+/* Max number of bytes captured of each datagram, longer ones are truncated */
+#ifndef ORVIBO_CAPTURE_MAX_FRAME
+#ifdef ARDUINO
+#define ORVIBO_CAPTURE_MAX_FRAME 64
+#else
+#define ORVIBO_CAPTURE_MAX_FRAME 512
+#endif
+#endif
+
+enum OrviboCaptureDirection
+{
+    CAPTURE_RX = 0, /* Received by the library */
+    CAPTURE_TX = 1  /* Sent by the library */
+};
+
+struct OrviboS20CaptureRecord
+{
+    uint64_t time_us;
+    OrviboCaptureDirection direction;
+    IPAddress ip; /* Remote address (source of RX, destination of TX) */
+    uint16_t port;
+    uint16_t length;      /* Bytes in data */
+    uint16_t orig_length; /* Size of the datagram, more than length if it was truncated */
+    const uint8_t *data;
+};
+
+/* Destination of a capture (file, serial port, memory...) */
+class OrviboS20CaptureSink
+{
+public:
+    virtual ~OrviboS20CaptureSink() {}
+
+    virtual bool write(const uint8_t *data, size_t length) = 0;
+};
+
+/*
+ * Transport that records all traffic of another transport
+ * Pass it to OrviboS20Class::setTransport() instead of the wrapped transport:
+ *   OrviboS20CaptureTransport capture(transport, sink);
+ *   OrviboS20.setTransport(&capture);
+ */
+class OrviboS20CaptureTransport : public OrviboS20Transport
+{
+public:
+    OrviboS20CaptureTransport(OrviboS20Transport &transport, OrviboS20CaptureSink &sink) : m_transport(transport), m_sink(sink) {}
+
+    /* Writes the file header the first time it is called */
+    bool begin(uint16_t port) override;
+    void stop() override;
+    int parsePacket() override;
+    int read(uint8_t *buffer, size_t length) override;
+    IPAddress remoteIP() override;
+    uint16_t remotePort() override;
+    int pending() override;
+    int beginPacket(IPAddress ip, uint16_t port) override;
+    size_t write(const uint8_t *buffer, size_t length) override;
+    int endPacket() override;
+    bool sendPacket(IPAddress ip, uint16_t port, const uint8_t *buffer, size_t length) override;
+    size_t sendPackets(const OrviboS20Datagram *datagrams, size_t count) override;
+
+    using OrviboS20Transport::write;
+
+    /* Number of records that could not be written to the sink */
+    uint32_t getDropped()
+    {
+        return m_dropped;
+    }
+
+protected:
+    OrviboS20Transport &m_transport;
+    OrviboS20CaptureSink &m_sink;
+    bool m_header_written = false;
+    uint32_t m_dropped = 0;
+    uint32_t m_last_us = 0;
+    uint64_t m_time_us = 0;
+
+    uint8_t m_rx_buffer[ORVIBO_CAPTURE_MAX_FRAME];
+    size_t m_rx_length = 0;
+    size_t m_rx_pos = 0;
+
+    uint8_t m_tx_buffer[ORVIBO_CAPTURE_MAX_FRAME];
+    size_t m_tx_length = 0;
+    IPAddress m_tx_ip;
+    uint16_t m_tx_port = 0;
+
+    void record(OrviboCaptureDirection direction, IPAddress ip, uint16_t port, const uint8_t *data, size_t length, size_t orig_length);
+};
+
+/*
+ * Parses a capture held in memory
+ * The records point into the buffer.
+ */
+class OrviboS20CaptureReader
+{
+public:
+    OrviboS20CaptureReader(const uint8_t *data, size_t length);
+
+    /* False if the file header is missing or has an unknown version */
+    bool isValid()
+    {
+        return m_valid;
+    }
+
+    /* Returns false at the end of the capture or if the next record is truncated */
+    bool next(OrviboS20CaptureRecord &record);
+
+    /* Start over from the first record */
+    void rewind()
+    {
+        m_pos = ORVIBO_CAPTURE_FILE_HEADER_LEN;
+    }
+
+protected:
+    const uint8_t *m_data;
+    size_t m_length;
+    size_t m_pos = ORVIBO_CAPTURE_FILE_HEADER_LEN;
+    bool m_valid;
+};
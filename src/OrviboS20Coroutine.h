@@ -0,0 +1,250 @@
+#pragma once
+
+#include "OrviboS20.h"
+
+/*
+ * C++20 coroutine support
+ *
+ *   OrviboS20Task toggle(OrviboS20Device &plug)
+ *   {
+ *       OrviboS20CommandOutcome outcome = co_await orviboSetState(plug, true);
+ *       OrviboS20FoundOutcome found = co_await orviboDiscover(OrviboS20, 5000);
+ *   }
+ *
+ * The awaitables are resumed from OrviboS20Class::handle() when the device confirms the
+ * command, the command times out or a device is found, so no thread is needed per
+ * outstanding operation. An executor can be passed to resume the coroutine somewhere
+ * else instead (e.g. post it to an event loop).
+ *
+ * Only available when the compiler supports coroutines (e.g. g++ -std=c++20).
+ */
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define ORVIBO_HAS_COROUTINES 1
+#endif
+#endif
+
+#ifdef ORVIBO_HAS_COROUTINES
+
+#include <coroutine>
+#include <exception>
+
+/* Resumes a coroutine, nullptr resumes it directly from handle() */
+typedef OrviboS20Callback<void(std::coroutine_handle<> handle)> OrviboS20Executor;
+
+/*
+ * Minimal eagerly started, fire-and-forget coroutine type
+ * The coroutine runs until its first co_await when called and frees itself when done.
+ */
+struct OrviboS20Task
+{
+    struct promise_type
+    {
+        OrviboS20Task get_return_object()
+        {
+            return {};
+        }
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+        void return_void()
+        {
+        }
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+    };
+};
+
+/* Result of co_await orviboSetState() */
+struct OrviboS20CommandOutcome
+{
+    OrviboCommandResult result;
+    uint32_t rtt_us;
+
+    explicit operator bool() const
+    {
+        return result == RESULT_SUCCESS;
+    }
+};
+
+/* Result of co_await orviboDiscover() */
+struct OrviboS20FoundOutcome
+{
+    bool found; /* false on timeout */
+    uint8_t mac[6];
+
+    explicit operator bool() const
+    {
+        return found;
+    }
+};
+
+/* Awaitable returned by orviboSetState() */
+class OrviboS20SetStateAwaitable
+{
+public:
+    OrviboS20SetStateAwaitable(OrviboS20Device &device, bool state, OrviboS20Executor executor)
+        : m_device(device), m_state(state), m_executor(executor)
+    {
+    }
+
+    ~OrviboS20SetStateAwaitable()
+    {
+        // Only active if the coroutine is destroyed while the command is queued or pending
+        if (m_handle && !m_done)
+        {
+            detach(m_device.m_queued_callback);
+            detach(m_device.m_pending_callback);
+        }
+    }
+
+    bool await_ready()
+    {
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        m_handle = handle;
+        m_suspending = true;
+        m_device.setState(m_state, Completion{this});
+        m_suspending = false;
+        // RESULT_NOT_CONNECTED is reported directly, don't suspend in that case
+        return !m_done;
+    }
+
+    OrviboS20CommandOutcome await_resume()
+    {
+        return m_outcome;
+    }
+
+protected:
+    /* A named type so the destructor can find our callback on the device */
+    struct Completion
+    {
+        OrviboS20SetStateAwaitable *awaitable;
+
+        void operator()(OrviboS20Device &, OrviboCommandResult result, uint32_t rtt_us)
+        {
+            awaitable->m_outcome = {result, rtt_us};
+            awaitable->m_done = true;
+            if (!awaitable->m_suspending)
+            {
+                awaitable->resume();
+            }
+        }
+    };
+
+    OrviboS20Device &m_device;
+    bool m_state;
+    bool m_suspending = false;
+    bool m_done = false;
+    OrviboS20Executor m_executor;
+    std::coroutine_handle<> m_handle;
+    OrviboS20CommandOutcome m_outcome = {RESULT_TIMEOUT, 0};
+
+    void resume()
+    {
+        if (m_executor)
+        {
+            m_executor(m_handle);
+        }
+        else
+        {
+            m_handle.resume();
+        }
+    }
+
+    void detach(OrviboS20Device::command_callback_t &callback)
+    {
+        Completion *completion = callback.target<Completion>();
+        if (completion && (completion->awaitable == this))
+        {
+            callback = nullptr;
+        }
+    }
+};
+
+/* Awaitable returned by orviboDiscover() */
+class OrviboS20DiscoverAwaitable
+{
+public:
+    OrviboS20DiscoverAwaitable(OrviboS20Class &gateway, uint32_t timeout_ms, OrviboS20Executor executor)
+        : m_gateway(gateway), m_timeout_ms(timeout_ms), m_executor(executor)
+    {
+    }
+
+    ~OrviboS20DiscoverAwaitable()
+    {
+        // Only active if the coroutine is destroyed while waiting
+        if (m_waiter.isActive())
+        {
+            m_gateway.cancelWaitForDevice(m_waiter);
+        }
+    }
+
+    bool await_ready()
+    {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        m_handle = handle;
+        m_gateway.waitForDevice(m_waiter, m_timeout_ms, [this](OrviboS20DeviceWaiter &, const uint8_t *mac) {
+            m_outcome.found = (mac != nullptr);
+            if (mac)
+            {
+                memcpy(m_outcome.mac, mac, sizeof(m_outcome.mac));
+            }
+            if (m_executor)
+            {
+                m_executor(m_handle);
+            }
+            else
+            {
+                m_handle.resume();
+            }
+        });
+    }
+
+    OrviboS20FoundOutcome await_resume()
+    {
+        return m_outcome;
+    }
+
+protected:
+    OrviboS20Class &m_gateway;
+    uint32_t m_timeout_ms;
+    OrviboS20Executor m_executor;
+    OrviboS20DeviceWaiter m_waiter;
+    std::coroutine_handle<> m_handle;
+    OrviboS20FoundOutcome m_outcome = {};
+};
+
+/*
+ * Sets the relay state and resumes when the device has confirmed it or the retry policy
+ * is exhausted, see OrviboS20Device::setState(state, cb)
+ */
+inline OrviboS20SetStateAwaitable orviboSetState(OrviboS20Device &device, bool state, OrviboS20Executor executor = nullptr)
+{
+    return OrviboS20SetStateAwaitable(device, state, executor);
+}
+
+/*
+ * Resumes when a packet is received from a previously unknown device or after
+ * timeout_ms, see OrviboS20Class::waitForDevice()
+ */
+inline OrviboS20DiscoverAwaitable orviboDiscover(OrviboS20Class &gateway, uint32_t timeout_ms, OrviboS20Executor executor = nullptr)
+{
+    return OrviboS20DiscoverAwaitable(gateway, timeout_ms, executor);
+}
+
+#endif
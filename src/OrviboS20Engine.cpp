@@ -0,0 +1,300 @@
+#include "OrviboS20Engine.h"
+
+#ifdef ORVIBO_HAS_POSIX_TRANSPORT
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/***********************************************************************************
+ * ShardTransport class definition
+ ***********************************************************************************/
+
+bool OrviboS20Engine::ShardTransport::begin(uint16_t port)
+{
+    // The socket is opened by the engine
+    (void)port;
+    return true;
+}
+
+void OrviboS20Engine::ShardTransport::stop()
+{
+}
+
+int OrviboS20Engine::ShardTransport::parsePacket()
+{
+    if (m_current)
+    {
+        m_queue.pop();
+    }
+    m_current = m_queue.front();
+    m_rx_pos = 0;
+    return m_current ? m_current->length : 0;
+}
+
+int OrviboS20Engine::ShardTransport::read(uint8_t *buffer, size_t length)
+{
+    if (m_current == nullptr)
+    {
+        return 0;
+    }
+    size_t remaining = m_current->length - m_rx_pos;
+    if (length > remaining)
+    {
+        length = remaining;
+    }
+    memcpy(buffer, &m_current->data[m_rx_pos], length);
+    m_rx_pos += length;
+    return length;
+}
+
+IPAddress OrviboS20Engine::ShardTransport::remoteIP()
+{
+    return m_current ? m_current->ip : IPAddress();
+}
+
+uint16_t OrviboS20Engine::ShardTransport::remotePort()
+{
+    return m_current ? m_current->port : 0;
+}
+
+int OrviboS20Engine::ShardTransport::pending()
+{
+    return m_queue.size() - (m_current ? 1 : 0);
+}
+
+int OrviboS20Engine::ShardTransport::beginPacket(IPAddress ip, uint16_t port)
+{
+    m_tx_ip = ip;
+    m_tx_port = port;
+    m_tx_length = 0;
+    return 1;
+}
+
+size_t OrviboS20Engine::ShardTransport::write(const uint8_t *buffer, size_t length)
+{
+    size_t space = sizeof(m_tx_buffer) - m_tx_length;
+    if (length > space)
+    {
+        length = space;
+    }
+    memcpy(&m_tx_buffer[m_tx_length], buffer, length);
+    m_tx_length += length;
+    return length;
+}
+
+int OrviboS20Engine::ShardTransport::endPacket()
+{
+    bool ret = sendPacket(m_tx_ip, m_tx_port, m_tx_buffer, m_tx_length);
+    m_tx_length = 0;
+    return ret ? 1 : 0;
+}
+
+bool OrviboS20Engine::ShardTransport::sendPacket(IPAddress ip, uint16_t port, const uint8_t *buffer, size_t length)
+{
+    // Sending only uses the socket descriptor so all shards can share it
+    return m_socket.sendPacket(ip, port, buffer, length);
+}
+
+size_t OrviboS20Engine::ShardTransport::sendPackets(const OrviboS20Datagram *datagrams, size_t count)
+{
+    return m_socket.sendPackets(datagrams, count);
+}
+
+/***********************************************************************************
+ * OrviboS20Engine class definition
+ ***********************************************************************************/
+
+OrviboS20Engine::OrviboS20Engine(uint8_t shard_count, IPAddress bind_ip) : m_socket(bind_ip)
+{
+    m_shard_count = shard_count ? shard_count : 1;
+    m_shards = new Shard *[m_shard_count];
+    for (uint8_t i = 0; i < m_shard_count; i++)
+    {
+        m_shards[i] = new Shard(m_socket);
+        m_shards[i]->gateway.setTransport(&m_shards[i]->transport);
+    }
+}
+
+OrviboS20Engine::~OrviboS20Engine()
+{
+    stop();
+    for (uint8_t i = 0; i < m_shard_count; i++)
+    {
+        delete m_shards[i];
+    }
+    delete[] m_shards;
+}
+
+bool OrviboS20Engine::start(uint16_t port)
+{
+    if (m_running || !m_socket.begin(port))
+    {
+        return false;
+    }
+
+    for (uint8_t i = 0; i < m_shard_count; i++)
+    {
+        Shard &shard = *m_shards[i];
+        shard.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if ((shard.event_fd < 0) || !shard.gateway.begin())
+        {
+            stop();
+            return false;
+        }
+    }
+
+    m_running = true;
+    for (uint8_t i = 0; i < m_shard_count; i++)
+    {
+        m_shards[i]->thread = std::thread(&OrviboS20Engine::workerLoop, this, i);
+    }
+    m_rx_thread = std::thread(&OrviboS20Engine::receiveLoop, this);
+    return true;
+}
+
+void OrviboS20Engine::stop()
+{
+    m_running = false;
+    if (m_rx_thread.joinable())
+    {
+        m_rx_thread.join();
+    }
+    for (uint8_t i = 0; i < m_shard_count; i++)
+    {
+        Shard &shard = *m_shards[i];
+        if (shard.event_fd >= 0)
+        {
+            uint64_t one = 1;
+            (void)!::write(shard.event_fd, &one, sizeof(one));
+        }
+        if (shard.thread.joinable())
+        {
+            shard.thread.join();
+        }
+        shard.gateway.stop();
+        if (shard.event_fd >= 0)
+        {
+            close(shard.event_fd);
+            shard.event_fd = -1;
+        }
+    }
+    m_socket.stop();
+}
+
+void OrviboS20Engine::receiveLoop()
+{
+    bool touched[256];
+
+    while (m_running)
+    {
+        // Wake up regularly to check m_running
+        if (!m_socket.wait(100))
+        {
+            continue;
+        }
+        m_rx_batches.fetch_add(1, std::memory_order_relaxed);
+        memset(touched, 0, m_shard_count);
+
+        int length;
+        while ((length = m_socket.parsePacket()) > 0)
+        {
+            uint8_t data[64];
+            OrviboS20Frame frame;
+            if (((size_t)length > sizeof(data)) ||
+                (OrviboS20Decoder::decode(data, m_socket.read(data, sizeof(data)), frame) != DECODE_OK))
+            {
+                m_rx_invalid.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+
+            uint8_t index = shardIndex(frame.mac);
+            Shard &shard = *m_shards[index];
+            RxItem *item = shard.queue.reserve();
+            if (item == nullptr)
+            {
+                shard.rx_dropped.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            memcpy(item->data, data, length);
+            item->length = length;
+            item->ip = m_socket.remoteIP();
+            item->port = m_socket.remotePort();
+            shard.queue.commit();
+            shard.rx_packets.fetch_add(1, std::memory_order_relaxed);
+            touched[index] = true;
+        }
+
+        // Only wake workers that are (about to go) asleep. The fence pairs with the one
+        // in workerLoop() so either we see the flag or the worker sees the datagram.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (uint8_t i = 0; i < m_shard_count; i++)
+        {
+            if (touched[i] && m_shards[i]->sleeping.load(std::memory_order_relaxed))
+            {
+                uint64_t one = 1;
+                (void)!::write(m_shards[i]->event_fd, &one, sizeof(one));
+            }
+        }
+    }
+}
+
+void OrviboS20Engine::workerLoop(uint8_t index)
+{
+    Shard &shard = *m_shards[index];
+
+    while (m_running)
+    {
+        if (m_tick_callback)
+        {
+            m_tick_callback(shard.gateway, index);
+        }
+        do
+        {
+            shard.gateway.handle();
+        } while (shard.gateway.getRxReport().pending > 0);
+
+        // Announce that we are going to sleep before the final check so the receive
+        // thread either sees the flag or we see its datagram
+        shard.sleeping.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (shard.transport.pending() == 0)
+        {
+            struct pollfd pfd = {shard.event_fd, POLLIN, 0};
+            if (poll(&pfd, 1, m_tick_ms) > 0)
+            {
+                uint64_t value;
+                (void)!::read(shard.event_fd, &value, sizeof(value));
+                shard.wakeups.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        shard.sleeping.store(false);
+    }
+}
+
+OrviboS20Engine::stats_t OrviboS20Engine::getStats(uint8_t index)
+{
+    Shard &shard = *m_shards[index];
+    stats_t stats = {};
+    stats.rx_packets = shard.rx_packets.load(std::memory_order_relaxed);
+    stats.rx_dropped = shard.rx_dropped.load(std::memory_order_relaxed);
+    stats.wakeups = shard.wakeups.load(std::memory_order_relaxed);
+    return stats;
+}
+
+OrviboS20Engine::stats_t OrviboS20Engine::getStats()
+{
+    stats_t total = {};
+    for (uint8_t i = 0; i < m_shard_count; i++)
+    {
+        stats_t stats = getStats(i);
+        total.rx_packets += stats.rx_packets;
+        total.rx_dropped += stats.rx_dropped;
+        total.wakeups += stats.wakeups;
+    }
+    total.rx_batches = m_rx_batches.load(std::memory_order_relaxed);
+    total.rx_invalid = m_rx_invalid.load(std::memory_order_relaxed);
+    return total;
+}
+
+#endif
@@ -0,0 +1,160 @@
+#pragma once
+
+#include "OrviboS20.h"
+#include "OrviboS20PosixTransport.h"
+#include "OrviboS20SpscQueue.h"
+
+#ifdef ORVIBO_HAS_POSIX_TRANSPORT
+
+#include <atomic>
+#include <thread>
+
+/* Number of datagrams buffered per shard (power of two) */
+#ifndef ORVIBO_ENGINE_QUEUE_SIZE
+#define ORVIBO_ENGINE_QUEUE_SIZE 4096
+#endif
+
+/*
+ * Multi-threaded gateway engine for Linux
+ * Devices are split in shards, each shard is an OrviboS20Class instance driven by its
+ * own worker thread. One receive thread reads the socket (epoll + recvmmsg), drops
+ * invalid frames and hands each datagram to the shard owning the source MAC through a
+ * lock-free single producer/single consumer queue. Workers send directly on the shared
+ * socket. Shards share no state so a shard only needs its own thread.
+ *
+ * A device must be created with the shard returned by shardFor() for its MAC. Devices
+ * without MAC are bound in whatever shard receives the first unknown device.
+ * OrviboS20Device functions must only be called from the worker thread of its shard,
+ * use onShardTick() to run code there.
+ */
+class OrviboS20Engine
+{
+public:
+    /* Called in the worker thread for each loop iteration */
+    typedef OrviboS20Callback<void(OrviboS20Class &shard, uint8_t index)> shard_tick_callback_t;
+
+    struct stats_t
+    {
+        uint64_t rx_packets; /* Datagrams handed to a shard */
+        uint64_t rx_batches; /* Receive thread wake-ups */
+        uint64_t rx_invalid; /* Datagrams dropped by the decoder */
+        uint64_t rx_dropped; /* Datagrams dropped since the shard queue was full */
+        uint64_t wakeups;    /* Worker wake-ups */
+    };
+
+    /* bind_ip selects the local interface, default is to listen on all interfaces */
+    OrviboS20Engine(uint8_t shard_count, IPAddress bind_ip = IPAddress());
+    ~OrviboS20Engine();
+
+    uint8_t shardCount()
+    {
+        return m_shard_count;
+    }
+    OrviboS20Class &shard(uint8_t index)
+    {
+        return m_shards[index]->gateway;
+    }
+    OrviboS20Class &shardFor(const uint8_t *mac)
+    {
+        return shard(shardIndex(mac));
+    }
+
+    /* Set before start() */
+    void onShardTick(shard_tick_callback_t cb)
+    {
+        m_tick_callback = cb;
+    }
+
+    /* Max time a worker sleeps when there is no traffic (timers, subscriptions) */
+    void setTickInterval(int tick_ms)
+    {
+        m_tick_ms = tick_ms;
+    }
+
+    /* Open the socket and start all threads */
+    bool start(uint16_t port = ORVIBO_UDP_PORT);
+    /* Stop all threads and close the socket */
+    void stop();
+
+    /* Sum over all shards, or only shard index */
+    stats_t getStats();
+    stats_t getStats(uint8_t index);
+
+protected:
+    struct RxItem
+    {
+        uint8_t data[64];
+        uint8_t length;
+        IPAddress ip;
+        uint16_t port;
+    };
+
+    typedef OrviboS20SpscQueue<RxItem, ORVIBO_ENGINE_QUEUE_SIZE> rx_queue_t;
+
+    /* Transport of a shard: receives from the queue, sends on the shared socket */
+    class ShardTransport : public OrviboS20Transport
+    {
+    public:
+        ShardTransport(OrviboS20PosixTransport &socket, rx_queue_t &queue) : m_socket(socket), m_queue(queue) {}
+
+        bool begin(uint16_t port) override;
+        void stop() override;
+        int parsePacket() override;
+        int read(uint8_t *buffer, size_t length) override;
+        IPAddress remoteIP() override;
+        uint16_t remotePort() override;
+        int pending() override;
+        int beginPacket(IPAddress ip, uint16_t port) override;
+        size_t write(const uint8_t *buffer, size_t length) override;
+        int endPacket() override;
+        bool sendPacket(IPAddress ip, uint16_t port, const uint8_t *buffer, size_t length) override;
+        size_t sendPackets(const OrviboS20Datagram *datagrams, size_t count) override;
+
+        using OrviboS20Transport::write;
+
+    protected:
+        OrviboS20PosixTransport &m_socket;
+        rx_queue_t &m_queue;
+        RxItem *m_current = nullptr;
+        size_t m_rx_pos = 0;
+        uint8_t m_tx_buffer[64];
+        size_t m_tx_length = 0;
+        IPAddress m_tx_ip;
+        uint16_t m_tx_port = 0;
+    };
+
+    struct Shard
+    {
+        Shard(OrviboS20PosixTransport &socket) : transport(socket, queue) {}
+
+        rx_queue_t queue;
+        ShardTransport transport;
+        OrviboS20Class gateway;
+        std::thread thread;
+        int event_fd = -1;
+        std::atomic<bool> sleeping{false};
+        std::atomic<uint64_t> rx_packets{0};
+        std::atomic<uint64_t> rx_dropped{0};
+        std::atomic<uint64_t> wakeups{0};
+    };
+
+    uint8_t m_shard_count;
+    Shard **m_shards;
+    OrviboS20PosixTransport m_socket;
+    std::thread m_rx_thread;
+    std::atomic<bool> m_running{false};
+    std::atomic<uint64_t> m_rx_batches{0};
+    std::atomic<uint64_t> m_rx_invalid{0};
+    shard_tick_callback_t m_tick_callback = nullptr;
+    int m_tick_ms = 10;
+
+    uint8_t shardIndex(const uint8_t *mac)
+    {
+        return (uint8_t)(((uint64_t)orviboMacHash(mac) * m_shard_count) >> 32);
+    }
+
+    void receiveLoop();
+    void workerLoop(uint8_t index);
+};
+
+#endif
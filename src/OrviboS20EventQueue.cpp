@@ -0,0 +1,82 @@
+#include "OrviboS20EventQueue.h"
+#include "OrviboS20.h"
+
+/***********************************************************************************
+ * Class definition
+ ***********************************************************************************/
+
+void OrviboS20EventQueue::push(uint8_t type, OrviboS20Device *device, const uint8_t *mac, uint8_t state)
+{
+    OrviboS20Event *event = m_queue.reserve();
+    if (event == nullptr)
+    {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    event->device = device;
+    event->time_ms = millis();
+    event->type = type;
+    event->state = state;
+    memcpy(event->mac, mac, sizeof(event->mac));
+    m_queue.commit();
+
+    m_pushed.fetch_add(1, std::memory_order_relaxed);
+    // Only the producer writes the peak so no compare-exchange is needed
+    uint32_t queued = m_queue.size();
+    if (queued > m_peak.load(std::memory_order_relaxed))
+    {
+        m_peak.store(queued, std::memory_order_relaxed);
+    }
+}
+
+size_t OrviboS20EventQueue::dispatch(size_t max_events)
+{
+    size_t handled = 0;
+    uint32_t callbacks = 0;
+    OrviboS20Event event;
+    while ((handled < max_events) && pop(event))
+    {
+        handled++;
+        OrviboS20Device *dev = event.device;
+        switch (event.type)
+        {
+        case EVENT_CONNECT:
+            if (dev->m_connect_callback)
+            {
+                callbacks++;
+                dev->m_connect_callback(*dev);
+            }
+            break;
+        case EVENT_DISCONNECT:
+            if (dev->m_disconnect_callback)
+            {
+                callbacks++;
+                dev->m_disconnect_callback(*dev);
+            }
+            break;
+        case EVENT_STATE_CHANGE:
+            if (dev->m_state_change_callback)
+            {
+                callbacks++;
+                dev->m_state_change_callback(*dev, event.state);
+            }
+            break;
+        case EVENT_FOUND_DEVICE:
+            if (m_owner && m_owner->m_found_device_callback)
+            {
+                callbacks++;
+                m_owner->m_found_device_callback(event.mac);
+            }
+            break;
+        }
+    }
+#if ORVIBO_METRICS
+    if (callbacks)
+    {
+        m_callbacks.fetch_add(callbacks, std::memory_order_relaxed);
+    }
+#else
+    (void)callbacks;
+#endif
+    return handled;
+}
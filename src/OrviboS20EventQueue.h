@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include "OrviboS20Platform.h"
+#include "OrviboS20SpscQueue.h"
+
+/* Number of events buffered by OrviboS20EventQueue (power of two) */
+#ifndef ORVIBO_EVENT_QUEUE_SIZE
+#ifdef ARDUINO
+#define ORVIBO_EVENT_QUEUE_SIZE 32
+#else
+#define ORVIBO_EVENT_QUEUE_SIZE 1024
+#endif
+#endif
+
+class OrviboS20Class;
+class OrviboS20Device;
+
+enum OrviboEventType
+{
+    EVENT_CONNECT = 0,
+    EVENT_DISCONNECT,
+    EVENT_STATE_CHANGE,
+    EVENT_FOUND_DEVICE
+};
+
+/* Compact event record, see OrviboS20EventQueue */
+struct OrviboS20Event
+{
+    OrviboS20Device *device; /* nullptr for EVENT_FOUND_DEVICE */
+    uint32_t time_ms;        /* millis() when the event happened */
+    uint8_t type;            /* OrviboEventType */
+    uint8_t state;           /* New relay state for EVENT_STATE_CHANGE */
+    uint8_t mac[6];
+};
+
+/*
+ * Bounded lock-free event queue decoupling user callbacks from the receive path
+ *
+ * When a queue is attached with OrviboS20Class::setEventQueue() the onConnect(),
+ * onDisconnect(), onStateChange() and onFoundDevice() callbacks are no longer called
+ * from handle(). Instead an event is pushed to the queue and the application drains it
+ * when it chooses, with pop() or dispatch(), which calls the registered callbacks.
+ * On Linux this may be done from another thread than the one calling handle()
+ * (single consumer). In that case the callbacks should use the state passed to them
+ * and not call OrviboS20Device functions. Command callbacks (setState(state, cb)) are
+ * still called from handle().
+ *
+ * When the queue is full new events are dropped and counted, see getStats(). The
+ * callbacks called by dispatch() are counted in OrviboS20Class::getMetrics() as well.
+ * Devices must not be deleted while events for them are queued.
+ */
+class OrviboS20EventQueue
+{
+public:
+    struct stats_t
+    {
+        uint32_t pushed;  /* Events queued */
+        uint32_t dropped; /* Events lost since the queue was full */
+        uint32_t peak;    /* Max number of queued events seen by the producer */
+    };
+
+    /* Consumer: returns false if the queue is empty */
+    bool pop(OrviboS20Event &event)
+    {
+        OrviboS20Event *item = m_queue.front();
+        if (item == nullptr)
+        {
+            return false;
+        }
+        event = *item;
+        m_queue.pop();
+        return true;
+    }
+
+    /* Consumer: calls the callbacks of up to max_events events, returns the number handled */
+    size_t dispatch(size_t max_events = ORVIBO_EVENT_QUEUE_SIZE);
+
+    /* Number of queued events (approximate while the producer is running) */
+    size_t size() const
+    {
+        return m_queue.size();
+    }
+
+    stats_t getStats() const
+    {
+        return {m_pushed.load(std::memory_order_relaxed), m_dropped.load(std::memory_order_relaxed),
+                m_peak.load(std::memory_order_relaxed)};
+    }
+
+protected:
+    OrviboS20SpscQueue<OrviboS20Event, ORVIBO_EVENT_QUEUE_SIZE> m_queue;
+    OrviboS20Class *m_owner = nullptr;
+    std::atomic<uint32_t> m_pushed{0};
+    std::atomic<uint32_t> m_dropped{0};
+    std::atomic<uint32_t> m_peak{0};
+    std::atomic<uint32_t> m_callbacks{0}; /* Called by dispatch(), added to OrviboS20Metrics::callbacks */
+
+    /* Producer (the thread calling OrviboS20Class::handle()) */
+    void push(uint8_t type, OrviboS20Device *device, const uint8_t *mac, uint8_t state);
+
+    friend class OrviboS20Class;
+    friend class OrviboS20Device;
+};
@@ -0,0 +1,190 @@
+#include "OrviboS20Group.h"
+
+/***********************************************************************************
+ * Consts
+ ***********************************************************************************/
+
+static const size_t STATE_FRAME_LEN = ORVIBO_HEADER_LEN + ORVIBO_STATE_PAYLOAD_LEN;
+
+/***********************************************************************************
+ * Types
+ ***********************************************************************************/
+
+/*
+ * Command callback armed by OrviboS20Scene::apply()
+ * A named type so abandon() can tell it apart from callbacks given to setState().
+ * The capture is packed into one word to keep the callback allocation free.
+ */
+struct OrviboS20SceneCommand
+{
+    OrviboS20Scene *scene;
+    uint16_t tag; /* generation << 8 | member index */
+
+    void operator()(OrviboS20Device &device, OrviboCommandResult result, uint32_t rtt_us)
+    {
+        (void)device;
+        (void)rtt_us;
+        if ((tag >> 8) == scene->m_generation)
+        {
+            scene->memberDone(tag & 0xFF, result);
+        }
+    }
+};
+
+/***********************************************************************************
+ * OrviboS20Scene class definition
+ ***********************************************************************************/
+
+OrviboS20Scene::~OrviboS20Scene()
+{
+    abandon();
+}
+
+bool OrviboS20Scene::add(OrviboS20Device &device, bool state)
+{
+    if (m_count >= ORVIBO_GROUP_MAX_DEVICES)
+    {
+        return false;
+    }
+    m_members[m_count].device = &device;
+    m_members[m_count].state = state;
+    m_members[m_count].result = RESULT_NONE;
+    m_count++;
+    return true;
+}
+
+void OrviboS20Scene::clear()
+{
+    abandon();
+    m_count = 0;
+}
+
+void OrviboS20Scene::abandon()
+{
+    // Make sure no device calls back into us for an old apply()
+    if (m_outstanding > 0)
+    {
+        for (uint8_t i = 0; i < m_count; i++)
+        {
+            // Only our own callback, a setState() callback on the same device must still be called
+            OrviboS20SceneCommand *command = m_members[i].device->m_pending_callback.target<OrviboS20SceneCommand>();
+            if ((m_members[i].result == RESULT_NONE) && command && (command->scene == this))
+            {
+                m_members[i].device->m_pending_callback = nullptr;
+            }
+        }
+        m_outstanding = 0;
+    }
+}
+
+void OrviboS20Scene::apply(completion_callback_t cb)
+{
+    uint8_t frames[ORVIBO_GROUP_MAX_DEVICES][STATE_FRAME_LEN];
+    OrviboS20Datagram datagrams[ORVIBO_GROUP_MAX_DEVICES];
+    uint8_t senders[ORVIBO_GROUP_MAX_DEVICES];
+    uint8_t count = 0;
+
+    abandon();
+    m_generation++;
+    m_succeeded = 0;
+    m_failed = 0;
+    m_start_us = micros();
+    m_callback = cb;
+
+    // Encode all frames first so they can be sent back-to-back
+    for (uint8_t i = 0; i < m_count; i++)
+    {
+        Member &member = m_members[i];
+        OrviboS20Device *dev = member.device;
+        member.result = RESULT_NONE;
+        OrviboS20Class::command_stats_t &stats = dev->m_owner->m_cmd_stats;
+        stats.requested++;
+
+        // Anything queued by setState() is replaced by the scene
+        dev->cancelQueuedState();
+        if ((dev->m_pending_state < 0) && (dev->m_last_state == (int)member.state) &&
+            ((dev->m_sent_state < 0) || (dev->m_sent_state == (int)member.state)))
+        {
+            // Already in the target state
+            stats.skipped++;
+            member.result = RESULT_SUCCESS;
+            m_succeeded++;
+        }
+        else if (dev->encodeState(member.state, frames[count], datagrams[count]))
+        {
+            senders[count++] = i;
+        }
+        else
+        {
+            member.result = RESULT_NOT_CONNECTED;
+            m_failed++;
+        }
+    }
+
+    // One batch per OrviboS20Class instance (usually there is only one)
+    // A frame that could not be sent is handled as a lost one and retransmitted
+    bool sent[ORVIBO_GROUP_MAX_DEVICES] = {};
+    for (uint8_t k = 0; k < count; k++)
+    {
+        if (sent[k])
+        {
+            continue;
+        }
+        OrviboS20Class *owner = m_members[senders[k]].device->m_owner;
+        OrviboS20Datagram batch[ORVIBO_GROUP_MAX_DEVICES];
+        size_t batch_count = 0;
+        for (uint8_t j = k; j < count; j++)
+        {
+            if (!sent[j] && (m_members[senders[j]].device->m_owner == owner))
+            {
+                batch[batch_count++] = datagrams[j];
+                sent[j] = true;
+            }
+        }
+        owner->sendDatagrams(batch, batch_count);
+    }
+
+    m_outstanding = count;
+    uint8_t generation = m_generation;
+    for (uint8_t k = 0; k < count; k++)
+    {
+        uint8_t index = senders[k];
+        Member &member = m_members[index];
+        uint16_t tag = (generation << 8) | index;
+        member.device->armCommand(member.state, OrviboS20SceneCommand{this, tag});
+    }
+
+    if (count == 0)
+    {
+        m_outstanding = 1;
+        memberDone(ORVIBO_GROUP_MAX_DEVICES, RESULT_SUCCESS);
+    }
+}
+
+void OrviboS20Scene::memberDone(uint8_t index, OrviboCommandResult result)
+{
+    if (index < m_count)
+    {
+        m_members[index].result = result;
+        if (result == RESULT_SUCCESS)
+            m_succeeded++;
+        else
+            m_failed++;
+    }
+
+    if (--m_outstanding == 0)
+    {
+        uint32_t settle_us = micros() - m_start_us;
+        completion_callback_t cb = m_callback;
+        if (cb)
+        {
+            // Counted by the gateway of the member that completed the scene
+            uint8_t member = (index < m_count) ? index : 0;
+            if (member < m_count)
+            {
+                ORVIBO_METRIC_INC(m_members[member].device->m_owner->m_metrics, callbacks);
+            }
+            cb(*this, m_succeeded, m_failed, settle_us);
+        }
+    }
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "OrviboS20.h"
+
+#ifndef ORVIBO_GROUP_MAX_DEVICES
+#define ORVIBO_GROUP_MAX_DEVICES 16
+#endif
+
+/*
+ * A scene is a set of S20 devices, each with a target relay state
+ * apply() encodes the frames for all devices into one batch and sends them back-to-back
+ * so all relays switch at (almost) the same time. Each device must confirm its new state
+ * (with retransmission, see OrviboS20.setCommandRetry()) and a single callback is called
+ * when all devices have confirmed or failed.
+ */
+class OrviboS20Scene
+{
+public:
+    /*
+     * succeeded/failed: number of devices that did/did not confirm their state
+     * settle_us: time from apply() until the last device confirmed
+     */
+    typedef OrviboS20Callback<void(OrviboS20Scene &scene, uint8_t succeeded, uint8_t failed, uint32_t settle_us)> completion_callback_t;
+
+    ~OrviboS20Scene();
+
+    /* Add a device with its target state. Returns false if the scene is full */
+    bool add(OrviboS20Device &device, bool state);
+
+    /* Remove all devices */
+    void clear();
+
+    /*
+     * Switch all devices to their target state
+     * Devices that have already confirmed the target state are not sent any command.
+     * If a previous apply() is still active it is abandoned.
+     */
+    void apply(completion_callback_t cb = nullptr);
+
+    /* Returns true until all devices of the last apply() have confirmed or failed */
+    bool isActive()
+    {
+        return m_outstanding > 0;
+    }
+
+    uint8_t size()
+    {
+        return m_count;
+    }
+
+    /* Result of the last apply() for member at index (see OrviboCommandResult) */
+    OrviboCommandResult getResult(uint8_t index)
+    {
+        return (OrviboCommandResult)m_members[index].result;
+    }
+
+protected:
+    static const int8_t RESULT_NONE = 1;
+
+    struct Member
+    {
+        OrviboS20Device *device;
+        bool state;
+        int8_t result;
+    };
+
+    Member m_members[ORVIBO_GROUP_MAX_DEVICES];
+    uint8_t m_count = 0;
+    uint8_t m_generation = 0;
+    uint8_t m_outstanding = 0;
+    uint8_t m_succeeded = 0;
+    uint8_t m_failed = 0;
+    uint32_t m_start_us = 0;
+    completion_callback_t m_callback = nullptr;
+
+    void memberDone(uint8_t index, OrviboCommandResult result);
+    void abandon();
+
+    friend struct OrviboS20SceneCommand;
+};
+
+/* A group is a scene where all devices are switched to the same state */
+class OrviboS20Group : public OrviboS20Scene
+{
+public:
+    bool add(OrviboS20Device &device)
+    {
+        return OrviboS20Scene::add(device, false);
+    }
+
+    /* Switch all devices in the group, see OrviboS20Scene::apply() */
+    void setState(bool state, completion_callback_t cb = nullptr)
+    {
+        for (uint8_t i = 0; i < m_count; i++)
+        {
+            m_members[i].state = state;
+        }
+        apply(cb);
+    }
+};
@@ -0,0 +1,168 @@
+#pragma once
+
+#include "OrviboS20Platform.h"
+
+/* Hash of a 6-byte MAC */
+static inline uint32_t orviboMacHash(const uint8_t *mac)
+{
+    // S20 devices share the same OUI so the low bytes carry most of the entropy
+    uint32_t low = ((uint32_t)mac[2] << 24) | ((uint32_t)mac[3] << 16) | ((uint32_t)mac[4] << 8) | mac[5];
+    uint32_t high = ((uint32_t)mac[0] << 8) | mac[1];
+    return (low ^ (high * 0x85EBCA6BUL)) * 0x9E3779B1UL;
+}
+
+/*
+ * Open addressing hash index keyed on a 6-byte MAC
+ * The index stores pointers only, the MAC is read from the item through getMac().
+ * Linear probing is used with backward shift deletion so no tombstones are needed.
+ * The table grows (doubles) when more than half full.
+ */
+template <class T>
+class OrviboS20MacIndex
+{
+public:
+    ~OrviboS20MacIndex()
+    {
+        // The table is kept while items are indexed: a global item in another translation
+        // unit may be destroyed after a global index and still remove itself from it.
+        // Clearing m_slots here wouldn't help, stores to a dying object may be optimized away.
+        if (m_count == 0)
+        {
+            free(m_slots);
+        }
+    }
+
+    /* Returns the item with the specified MAC or nullptr */
+    T *find(const uint8_t *mac) const
+    {
+        if (m_slots == nullptr)
+        {
+            return nullptr;
+        }
+        for (size_t i = slotOf(mac);; i = (i + 1) & m_mask)
+        {
+            T *item = m_slots[i];
+            if (item == nullptr)
+            {
+                return nullptr;
+            }
+            if (memcmp(item->getMac(), mac, 6) == 0)
+            {
+                return item;
+            }
+        }
+    }
+
+    /* Returns false if an item with the same MAC already exists or if out of memory */
+    bool insert(T *item)
+    {
+        if (((m_count + 1) * 2 > capacity()) && !resize(capacity() ? capacity() * 2 : MIN_CAPACITY))
+        {
+            return false;
+        }
+        size_t i = slotOf(item->getMac());
+        while (m_slots[i] != nullptr)
+        {
+            if (memcmp(m_slots[i]->getMac(), item->getMac(), 6) == 0)
+            {
+                return false;
+            }
+            i = (i + 1) & m_mask;
+        }
+        m_slots[i] = item;
+        m_count++;
+        return true;
+    }
+
+    /* Returns false if the item is not in the index */
+    bool remove(T *item)
+    {
+        if (m_slots == nullptr)
+        {
+            return false;
+        }
+        size_t i = slotOf(item->getMac());
+        while (m_slots[i] != item)
+        {
+            if (m_slots[i] == nullptr)
+            {
+                return false;
+            }
+            i = (i + 1) & m_mask;
+        }
+        // Backward shift: move following entries of the probe sequence into the hole
+        size_t hole = i;
+        for (size_t j = (i + 1) & m_mask; m_slots[j] != nullptr; j = (j + 1) & m_mask)
+        {
+            size_t home = slotOf(m_slots[j]->getMac());
+            if (((j - home) & m_mask) >= ((j - hole) & m_mask))
+            {
+                m_slots[hole] = m_slots[j];
+                hole = j;
+            }
+        }
+        m_slots[hole] = nullptr;
+        m_count--;
+        return true;
+    }
+
+    size_t size() const
+    {
+        return m_count;
+    }
+
+    size_t capacity() const
+    {
+        return m_slots ? m_mask + 1 : 0;
+    }
+
+protected:
+    static const size_t MIN_CAPACITY = 8;
+
+    T **m_slots = nullptr;
+    size_t m_mask = 0;
+    size_t m_count = 0;
+    uint8_t m_shift = 32;
+
+    size_t slotOf(const uint8_t *mac) const
+    {
+        // Fibonacci hashing, use the top bits
+        return (size_t)(orviboMacHash(mac) >> m_shift) & m_mask;
+    }
+
+    bool resize(size_t new_capacity)
+    {
+        T **old_slots = m_slots;
+        size_t old_capacity = capacity();
+
+        T **slots = (T **)calloc(new_capacity, sizeof(T *));
+        if (slots == nullptr)
+        {
+            return false;
+        }
+        uint8_t bits = 0;
+        while (((size_t)1 << bits) < new_capacity)
+        {
+            bits++;
+        }
+        m_slots = slots;
+        m_mask = new_capacity - 1;
+        m_shift = 32 - bits;
+        m_count = 0;
+        for (size_t i = 0; i < old_capacity; i++)
+        {
+            if (old_slots[i])
+            {
+                size_t j = slotOf(old_slots[i]->getMac());
+                while (m_slots[j] != nullptr)
+                {
+                    j = (j + 1) & m_mask;
+                }
+                m_slots[j] = old_slots[i];
+                m_count++;
+            }
+        }
+        free(old_slots);
+        return true;
+    }
+};
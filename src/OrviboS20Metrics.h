@@ -0,0 +1,88 @@
+#pragma once
+
+#include "OrviboS20Platform.h"
+#include "OrviboS20Protocol.h"
+
+/*
+ * Runtime metrics: traffic counters, drop reasons and per-device RTT histograms
+ * Define ORVIBO_METRICS to 0 to remove them. The counter updates then compile to
+ * nothing and the snapshot functions return zeroed structs.
+ */
+#ifndef ORVIBO_METRICS
+#define ORVIBO_METRICS 1
+#endif
+
+#if ORVIBO_METRICS
+#define ORVIBO_METRIC_INC(metrics, field) ((metrics).field++)
+#define ORVIBO_METRIC_ADD(metrics, field, n) ((metrics).field += (n))
+#else
+#define ORVIBO_METRIC_INC(metrics, field) ((void)0)
+#define ORVIBO_METRIC_ADD(metrics, field, n) ((void)0)
+#endif
+
+/* Why a received datagram was not handled */
+enum OrviboDropReason
+{
+    DROP_TOO_SHORT = 0, /* Shorter than the header */
+    DROP_BAD_MAGIC,
+    DROP_BAD_LENGTH,    /* Length field does not match the datagram size */
+    DROP_UNKNOWN_MAC,   /* Valid frame but no device matches the source MAC */
+    DROP_OVERSIZED,     /* Larger than the receive buffer */
+    DROP_REASON_COUNT
+};
+
+static inline OrviboDropReason orviboDropReason(OrviboDecodeResult result)
+{
+    switch (result)
+    {
+    case DECODE_BAD_MAGIC:
+        return DROP_BAD_MAGIC;
+    case DECODE_BAD_LENGTH:
+        return DROP_BAD_LENGTH;
+    default:
+        return DROP_TOO_SHORT;
+    }
+}
+
+/* Counters of one OrviboS20Class instance, see OrviboS20Class::getMetrics() */
+struct OrviboS20Metrics
+{
+    uint32_t rx_packets;                   /* Datagrams received */
+    uint32_t rx_dropped[DROP_REASON_COUNT]; /* Received datagrams dropped, per OrviboDropReason */
+    uint32_t tx_packets;                   /* Datagrams sent */
+    uint32_t tx_failed;                    /* Datagrams the transport refused to send */
+    uint32_t callbacks;                    /* User callbacks called */
+};
+
+/* Number of buckets in OrviboS20RttHistogram */
+#ifndef ORVIBO_RTT_HISTOGRAM_BUCKETS
+#define ORVIBO_RTT_HISTOGRAM_BUCKETS 12
+#endif
+
+/*
+ * Histogram of round-trip times with power of two buckets
+ * Bucket 0 holds samples below 1 ms, bucket i samples in [2^(i-1), 2^i) ms and the
+ * last bucket everything above.
+ */
+struct OrviboS20RttHistogram
+{
+    uint32_t buckets[ORVIBO_RTT_HISTOGRAM_BUCKETS];
+
+    void add(uint32_t rtt_us)
+    {
+        uint32_t ms = rtt_us / 1000;
+        uint8_t bucket = 0;
+        while (ms && (bucket < ORVIBO_RTT_HISTOGRAM_BUCKETS - 1))
+        {
+            ms >>= 1;
+            bucket++;
+        }
+        buckets[bucket]++;
+    }
+
+    /* Upper limit (exclusive) of bucket in microseconds, UINT32_MAX for the last one */
+    static uint32_t bucketLimitUs(uint8_t bucket)
+    {
+        return (bucket < ORVIBO_RTT_HISTOGRAM_BUCKETS - 1) ? (1000UL << bucket) : UINT32_MAX;
+    }
+};
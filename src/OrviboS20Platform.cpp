@@ -0,0 +1,51 @@
+#include "OrviboS20Platform.h"
+
+#ifndef ARDUINO
+
+#include <time.h>
+
+/***********************************************************************************
+ * Static functions
+ ***********************************************************************************/
+
+static uint64_t clockMicros()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static orvibo_host_clock_t s_host_clock = nullptr;
+
+static uint64_t monotonicMicros()
+{
+    if (s_host_clock)
+    {
+        return s_host_clock();
+    }
+    static const uint64_t s_start = clockMicros();
+    return clockMicros() - s_start;
+}
+
+/***********************************************************************************
+ * Functions
+ ***********************************************************************************/
+
+void orviboSetHostClock(orvibo_host_clock_t clock)
+{
+    s_host_clock = clock;
+}
+
+// Both are truncated to 32 bits so they wrap around just like on the ESP8266
+
+unsigned long millis()
+{
+    return (uint32_t)(monotonicMicros() / 1000);
+}
+
+unsigned long micros()
+{
+    return (uint32_t)monotonicMicros();
+}
+
+#endif
@@ -0,0 +1,81 @@
+#pragma once
+
+/*
+ * Platform glue so the library can be built both as an Arduino library for the ESP8266
+ * and as a native library on a Linux host (gateway process, benchmarks etc).
+ * When built with the Arduino toolchain this simply includes Arduino.h.
+ */
+
+#ifdef ARDUINO
+
+#include <Arduino.h>
+
+#else
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#define ORVIBO_HAS_POSIX_TRANSPORT 1
+#endif
+
+/* Milliseconds/microseconds since start, same semantics as the Arduino functions */
+unsigned long millis();
+unsigned long micros();
+
+/*
+ * Replace the clock used by millis()/micros() (nullptr restores the monotonic clock)
+ * clock returns microseconds since start. Used for deterministic replay and simulation,
+ * set it before any other thread uses the library.
+ */
+typedef uint64_t (*orvibo_host_clock_t)();
+void orviboSetHostClock(orvibo_host_clock_t clock);
+
+/*
+ * Minimal host replacement of the Arduino IPAddress class
+ * The address is stored in network byte order (same as in_addr::s_addr)
+ */
+class IPAddress
+{
+public:
+    IPAddress() : m_addr(0) {}
+    IPAddress(uint32_t addr) : m_addr(addr) {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+    {
+        uint8_t bytes[4] = {a, b, c, d};
+        memcpy(&m_addr, bytes, 4);
+    }
+
+    operator uint32_t() const
+    {
+        return m_addr;
+    }
+
+    uint8_t operator[](int index) const
+    {
+        return reinterpret_cast<const uint8_t *>(&m_addr)[index];
+    }
+
+    bool operator==(const IPAddress &other) const
+    {
+        return m_addr == other.m_addr;
+    }
+
+    bool operator!=(const IPAddress &other) const
+    {
+        return m_addr != other.m_addr;
+    }
+
+    bool isSet() const
+    {
+        return m_addr != 0;
+    }
+
+protected:
+    uint32_t m_addr;
+};
+
+#endif
@@ -0,0 +1,309 @@
+#include "OrviboS20PosixTransport.h"
+
+#ifdef ORVIBO_HAS_POSIX_TRANSPORT
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/***********************************************************************************
+ * Class definition
+ ***********************************************************************************/
+
+OrviboS20PosixTransport::OrviboS20PosixTransport(IPAddress bind_ip) : m_bind_ip(bind_ip)
+{
+}
+
+OrviboS20PosixTransport::~OrviboS20PosixTransport()
+{
+    stop();
+}
+
+bool OrviboS20PosixTransport::begin(uint16_t port)
+{
+    stop();
+
+    m_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_fd < 0)
+    {
+        return false;
+    }
+
+    // Broadcast is needed by the WiFi pairing and reuse makes it possible to run
+    // several processes/emulators on the same host
+    int one = 1;
+    setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(m_fd, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one));
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = (uint32_t)m_bind_ip;
+    if (bind(m_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        stop();
+        return false;
+    }
+
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epoll_fd < 0)
+    {
+        stop();
+        return false;
+    }
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = m_fd;
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_fd, &ev) < 0)
+    {
+        stop();
+        return false;
+    }
+    return true;
+}
+
+void OrviboS20PosixTransport::stop()
+{
+    if (m_epoll_fd >= 0)
+    {
+        close(m_epoll_fd);
+        m_epoll_fd = -1;
+    }
+    if (m_fd >= 0)
+    {
+        close(m_fd);
+        m_fd = -1;
+    }
+    m_rx_count = 0;
+    m_rx_current = -1;
+    m_rx_pos = 0;
+}
+
+bool OrviboS20PosixTransport::fetchBatch()
+{
+    struct mmsghdr msgs[RX_BATCH_SIZE];
+    struct iovec iovs[RX_BATCH_SIZE];
+    struct sockaddr_in addrs[RX_BATCH_SIZE];
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < RX_BATCH_SIZE; i++)
+    {
+        iovs[i].iov_base = m_rx_batch[i].data;
+        iovs[i].iov_len = sizeof(m_rx_batch[i].data);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+    }
+
+    // MSG_TRUNC makes msg_len the real datagram size even if it was truncated
+    int n = recvmmsg(m_fd, msgs, RX_BATCH_SIZE, MSG_DONTWAIT | MSG_TRUNC, nullptr);
+    if (n <= 0)
+    {
+        m_rx_count = 0;
+        return false;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        m_rx_batch[i].length = msgs[i].msg_len;
+        m_rx_batch[i].ip = addrs[i].sin_addr.s_addr;
+        m_rx_batch[i].port = ntohs(addrs[i].sin_port);
+    }
+    m_rx_count = n;
+    return true;
+}
+
+int OrviboS20PosixTransport::parsePacket()
+{
+    m_rx_pos = 0;
+    if (m_fd < 0)
+    {
+        return 0;
+    }
+
+    m_rx_current++;
+    if (m_rx_current >= m_rx_count)
+    {
+        m_rx_current = -1;
+        if (!fetchBatch())
+        {
+            return 0;
+        }
+        m_rx_current = 0;
+    }
+    return m_rx_batch[m_rx_current].length;
+}
+
+int OrviboS20PosixTransport::read(uint8_t *buffer, size_t length)
+{
+    if (m_rx_current < 0)
+    {
+        return 0;
+    }
+    const RxSlot &slot = m_rx_batch[m_rx_current];
+    size_t stored = (slot.length < sizeof(slot.data)) ? slot.length : sizeof(slot.data);
+    size_t remaining = stored - m_rx_pos;
+    if (length > remaining)
+    {
+        length = remaining;
+    }
+    memcpy(buffer, &slot.data[m_rx_pos], length);
+    m_rx_pos += length;
+    return length;
+}
+
+IPAddress OrviboS20PosixTransport::remoteIP()
+{
+    return (m_rx_current < 0) ? IPAddress() : IPAddress(m_rx_batch[m_rx_current].ip);
+}
+
+uint16_t OrviboS20PosixTransport::remotePort()
+{
+    return (m_rx_current < 0) ? 0 : m_rx_batch[m_rx_current].port;
+}
+
+int OrviboS20PosixTransport::pending()
+{
+    if (m_fd < 0)
+    {
+        return 0;
+    }
+    if (buffered() > 0)
+    {
+        return buffered();
+    }
+    // FIONREAD gives the size of the next datagram in the socket queue
+    int next_size = 0;
+    if (ioctl(m_fd, FIONREAD, &next_size) == 0 && next_size > 0)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+int OrviboS20PosixTransport::beginPacket(IPAddress ip, uint16_t port)
+{
+    m_tx_ip = ip;
+    m_tx_port = port;
+    m_tx_length = 0;
+    return 1;
+}
+
+size_t OrviboS20PosixTransport::write(const uint8_t *buffer, size_t length)
+{
+    size_t space = sizeof(m_tx_buffer) - m_tx_length;
+    if (length > space)
+    {
+        length = space;
+    }
+    memcpy(&m_tx_buffer[m_tx_length], buffer, length);
+    m_tx_length += length;
+    return length;
+}
+
+int OrviboS20PosixTransport::endPacket()
+{
+    bool ret = sendPacket(m_tx_ip, m_tx_port, m_tx_buffer, m_tx_length);
+    m_tx_length = 0;
+    return ret ? 1 : 0;
+}
+
+bool OrviboS20PosixTransport::sendPacket(IPAddress ip, uint16_t port, const uint8_t *buffer, size_t length)
+{
+    if (m_fd < 0)
+    {
+        return false;
+    }
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = (uint32_t)ip;
+    return sendto(m_fd, buffer, length, 0, (struct sockaddr *)&addr, sizeof(addr)) >= 0;
+}
+
+size_t OrviboS20PosixTransport::sendPackets(const OrviboS20Datagram *datagrams, size_t count)
+{
+    // sendmmsg() sends the whole batch with one syscall
+    static const size_t TX_BATCH_SIZE = 32;
+    struct mmsghdr msgs[TX_BATCH_SIZE];
+    struct iovec iovs[TX_BATCH_SIZE];
+    struct sockaddr_in addrs[TX_BATCH_SIZE];
+    size_t pos = 0;
+    size_t sent = 0;
+
+    if (m_fd < 0)
+    {
+        return 0;
+    }
+    while (pos < count)
+    {
+        size_t n = count - pos;
+        if (n > TX_BATCH_SIZE)
+        {
+            n = TX_BATCH_SIZE;
+        }
+        memset(msgs, 0, sizeof(msgs[0]) * n);
+        for (size_t i = 0; i < n; i++)
+        {
+            const OrviboS20Datagram &dgram = datagrams[pos + i];
+            memset(&addrs[i], 0, sizeof(addrs[i]));
+            addrs[i].sin_family = AF_INET;
+            addrs[i].sin_port = htons(dgram.port);
+            addrs[i].sin_addr.s_addr = (uint32_t)dgram.ip;
+            iovs[i].iov_base = (void *)dgram.data;
+            iovs[i].iov_len = dgram.length;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int ret = sendmmsg(m_fd, msgs, n, 0);
+        if (ret > 0)
+        {
+            pos += ret;
+            sent += ret;
+        }
+        else if ((ret < 0) && (errno == EINTR))
+        {
+            continue;
+        }
+        else if ((ret == 0) || (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ENOBUFS))
+        {
+            // The socket buffer is full, the rest of the batch would fail as well
+            break;
+        }
+        else
+        {
+            // An error for this destination only (e.g. EHOSTUNREACH), skip its datagram
+            pos++;
+        }
+    }
+    return sent;
+}
+
+bool OrviboS20PosixTransport::wait(int timeout_ms)
+{
+    if (m_epoll_fd < 0)
+    {
+        return false;
+    }
+    // Datagrams already fetched by recvmmsg() are not seen by epoll, e.g. when the
+    // RX budget stopped handle() in the middle of a batch
+    if (buffered() > 0)
+    {
+        return true;
+    }
+    struct epoll_event ev;
+    int n;
+    do
+    {
+        n = epoll_wait(m_epoll_fd, &ev, 1, timeout_ms);
+    } while (n < 0 && errno == EINTR);
+    return n > 0;
+}
+
+#endif
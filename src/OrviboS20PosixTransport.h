@@ -0,0 +1,82 @@
+#pragma once
+
+#include "OrviboS20Transport.h"
+
+#ifdef ORVIBO_HAS_POSIX_TRANSPORT
+
+/*
+ * Linux backend using a non-blocking UDP socket
+ * Datagrams are fetched from the socket in batches using recvmmsg() to keep the
+ * number of syscalls down when many devices are sending. The socket is registered
+ * in an epoll instance so that the owner can sleep in wait() until there is something
+ * to read. fd() can be used to add the socket to an external event loop instead.
+ */
+class OrviboS20PosixTransport : public OrviboS20Transport
+{
+public:
+    /* bind_ip selects the local interface, default is to listen on all interfaces */
+    OrviboS20PosixTransport(IPAddress bind_ip = IPAddress());
+    ~OrviboS20PosixTransport();
+
+    bool begin(uint16_t port) override;
+    void stop() override;
+    int parsePacket() override;
+    int read(uint8_t *buffer, size_t length) override;
+    IPAddress remoteIP() override;
+    uint16_t remotePort() override;
+    int pending() override;
+    int beginPacket(IPAddress ip, uint16_t port) override;
+    size_t write(const uint8_t *buffer, size_t length) override;
+    int endPacket() override;
+    bool sendPacket(IPAddress ip, uint16_t port, const uint8_t *buffer, size_t length) override;
+    size_t sendPackets(const OrviboS20Datagram *datagrams, size_t count) override;
+
+    using OrviboS20Transport::write;
+
+    /*
+     * Block until a datagram can be read or until timeout_ms has passed (-1 = forever)
+     * Returns true if there is something to read (at once if datagrams are already buffered)
+     */
+    bool wait(int timeout_ms);
+
+    /* Socket file descriptor (-1 when stopped) */
+    int fd()
+    {
+        return m_fd;
+    }
+
+protected:
+    static const size_t MAX_DATAGRAM_SIZE = 512;
+    static const int RX_BATCH_SIZE = 16;
+
+    struct RxSlot
+    {
+        uint8_t data[MAX_DATAGRAM_SIZE];
+        size_t length; /* Real datagram length (may be larger than data) */
+        uint32_t ip;
+        uint16_t port;
+    };
+
+    IPAddress m_bind_ip;
+    int m_fd = -1;
+    int m_epoll_fd = -1;
+
+    RxSlot m_rx_batch[RX_BATCH_SIZE];
+    int m_rx_count = 0;    /* Number of slots filled by last recvmmsg() */
+    int m_rx_current = -1; /* Slot returned by last parsePacket() */
+    size_t m_rx_pos = 0;   /* Read position in current slot */
+
+    uint8_t m_tx_buffer[MAX_DATAGRAM_SIZE];
+    size_t m_tx_length = 0;
+    IPAddress m_tx_ip;
+    uint16_t m_tx_port = 0;
+
+    bool fetchBatch();
+    /* Datagrams fetched by recvmmsg() but not yet returned by parsePacket() */
+    int buffered()
+    {
+        return (m_rx_current < 0) ? m_rx_count : m_rx_count - m_rx_current - 1;
+    }
+};
+
+#endif
@@ -0,0 +1,135 @@
+#pragma once
+
+#include "OrviboS20Platform.h"
+
+/*
+ * Orvibo S20 UDP protocol
+ * Every frame starts with an 18 byte header:
+ *   magic (2) | total length (2, big endian) | command (2) | MAC (6) | padding (6)
+ * followed by a command specific payload.
+ */
+
+static const unsigned int ORVIBO_UDP_PORT = 10000;
+static const uint16_t ORVIBO_HEADER_LEN = 2 /*magic*/ + 2 /*len*/ + 2 /*cmd*/ + 6 /*mac*/ + 6 /*pad*/;
+static const uint8_t ORVIBO_MAGIC[] = {0x68, 0x64};
+
+static const uint16_t CMD_SUBSCRIBE = 0x636C;
+static const uint16_t CMD_SET_STATE = 0x6463;
+static const uint16_t CMD_DISCOVER = 0x7161;
+static const uint16_t CMD_STATE_CHANGE = 0x7366;
+
+static const size_t ORVIBO_STATE_PAYLOAD_LEN = 5;
+
+enum OrviboDecodeResult
+{
+    DECODE_OK = 0,
+    DECODE_TOO_SHORT,  /* Shorter than the header (or the layout of the command) */
+    DECODE_BAD_MAGIC,
+    DECODE_BAD_LENGTH  /* Length field does not match the datagram size */
+};
+
+/* Decoded frame, points into the buffer passed to OrviboS20Decoder::decode() */
+struct OrviboS20Frame
+{
+    uint16_t command;
+    const uint8_t *mac;     /* 6 bytes */
+    const uint8_t *payload;
+    size_t payload_length;
+
+    /* Relay state of CMD_SET_STATE/CMD_STATE_CHANGE frames, -1 if malformed */
+    int state() const
+    {
+        return (payload_length == ORVIBO_STATE_PAYLOAD_LEN) ? payload[4] : -1;
+    }
+};
+
+/*
+ * Commands that don't follow the generic layout
+ * mac_offset is added to both the MAC and payload position.
+ */
+struct OrviboS20CommandLayout
+{
+    uint16_t command;
+    uint8_t mac_offset;
+};
+
+static constexpr OrviboS20CommandLayout ORVIBO_COMMAND_LAYOUTS[] = {
+    // Probably a bug in Orvibo S20 firmware: MAC and payload are shifted one byte
+    {CMD_DISCOVER, 1},
+};
+
+/*
+ * Entry of a command handler table, see OrviboS20Decoder::dispatch()
+ * Tables are meant to be constexpr arrays, see OrviboS20Device::handleFrame().
+ */
+template <class T>
+struct OrviboS20FrameHandler
+{
+    uint16_t command;
+    void (T::*handle)(const OrviboS20Frame &frame);
+};
+
+/*
+ * Allocation free frame decoder
+ * Only validates and slices the buffer so it can be used without any transport
+ * (fuzzing, benchmarks, captures).
+ */
+class OrviboS20Decoder
+{
+public:
+    static OrviboDecodeResult decode(const uint8_t *data, size_t length, OrviboS20Frame &frame)
+    {
+        if (length < ORVIBO_HEADER_LEN)
+        {
+            return DECODE_TOO_SHORT;
+        }
+        if ((data[0] != ORVIBO_MAGIC[0]) || (data[1] != ORVIBO_MAGIC[1]))
+        {
+            return DECODE_BAD_MAGIC;
+        }
+        if ((((size_t)data[2] << 8) | data[3]) != length)
+        {
+            return DECODE_BAD_LENGTH;
+        }
+
+        uint16_t command = (data[4] << 8) | data[5];
+        uint8_t offset = macOffset(command);
+        if (length < (size_t)ORVIBO_HEADER_LEN + offset)
+        {
+            return DECODE_TOO_SHORT;
+        }
+        frame.command = command;
+        frame.mac = &data[6 + offset];
+        frame.payload = &data[ORVIBO_HEADER_LEN + offset];
+        frame.payload_length = length - ORVIBO_HEADER_LEN - offset;
+        return DECODE_OK;
+    }
+
+    /* Calls the handler registered for the frame command, returns false if there is none */
+    template <class T, size_t N>
+    static bool dispatch(const OrviboS20FrameHandler<T> (&table)[N], T &target, const OrviboS20Frame &frame)
+    {
+        for (size_t i = 0; i < N; i++)
+        {
+            if (table[i].command == frame.command)
+            {
+                (target.*table[i].handle)(frame);
+                return true;
+            }
+        }
+        return false;
+    }
+
+protected:
+    static uint8_t macOffset(uint16_t command)
+    {
+        for (size_t i = 0; i < sizeof(ORVIBO_COMMAND_LAYOUTS) / sizeof(ORVIBO_COMMAND_LAYOUTS[0]); i++)
+        {
+            if (ORVIBO_COMMAND_LAYOUTS[i].command == command)
+            {
+                return ORVIBO_COMMAND_LAYOUTS[i].mac_offset;
+            }
+        }
+        return 0;
+    }
+};
@@ -0,0 +1,199 @@
+#pragma once
+
+#include "OrviboS20MacIndex.h"
+
+static constexpr size_t orviboSeenTableSize(size_t capacity, size_t size)
+{
+    return (size >= 2 * capacity) ? size : orviboSeenTableSize(capacity, size * 2);
+}
+
+static constexpr uint8_t orviboSeenTableBits(size_t size)
+{
+    return (size <= 1) ? 0 : 1 + orviboSeenTableBits(size / 2);
+}
+
+/*
+ * Fixed size set of MACs used to detect devices not seen before
+ * All memory is allocated statically: about 14 bytes per entry (MAC, LRU links and
+ * two hash slots). Membership checks are O(1) using linear probing with backward shift
+ * deletion. When the set is full and LRU is true the least recently seen MAC is evicted,
+ * otherwise new MACs are no longer remembered (and counted as overflowed).
+ */
+template <uint16_t CAPACITY, bool LRU = true>
+class OrviboS20SeenSet
+{
+public:
+    static_assert((CAPACITY > 0) && (CAPACITY < 0x8000), "Unsupported OrviboS20SeenSet capacity");
+
+    constexpr OrviboS20SeenSet()
+    {
+    }
+
+    void clear()
+    {
+        memset(m_slots, 0, sizeof(m_slots));
+        m_head = NONE;
+        m_tail = NONE;
+        m_count = 0;
+    }
+
+    /*
+     * Adds the MAC to the set
+     * Returns true if the MAC was not in the set and has been added
+     */
+    bool insert(const uint8_t *mac)
+    {
+        size_t slot = slotOf(mac);
+        for (;; slot = (slot + 1) & (TABLE_SIZE - 1))
+        {
+            if (m_slots[slot] == 0)
+            {
+                break;
+            }
+            uint16_t entry = m_slots[slot] - 1;
+            if (memcmp(m_macs[entry], mac, 6) == 0)
+            {
+                if (LRU && (entry != m_head))
+                {
+                    unlink(entry);
+                    pushFront(entry);
+                }
+                return false;
+            }
+        }
+
+        uint16_t entry;
+        if (m_count < CAPACITY)
+        {
+            entry = m_count++;
+        }
+        else if (LRU)
+        {
+            entry = m_tail;
+            removeSlot(entry);
+            unlink(entry);
+            m_evicted++;
+            // The slot found above may have moved by the backward shift
+            slot = slotOf(mac);
+            while (m_slots[slot] != 0)
+            {
+                slot = (slot + 1) & (TABLE_SIZE - 1);
+            }
+        }
+        else
+        {
+            m_overflowed++;
+            return false;
+        }
+        memcpy(m_macs[entry], mac, 6);
+        m_slots[slot] = entry + 1;
+        pushFront(entry);
+        return true;
+    }
+
+    bool contains(const uint8_t *mac) const
+    {
+        for (size_t slot = slotOf(mac);; slot = (slot + 1) & (TABLE_SIZE - 1))
+        {
+            if (m_slots[slot] == 0)
+            {
+                return false;
+            }
+            if (memcmp(m_macs[m_slots[slot] - 1], mac, 6) == 0)
+            {
+                return true;
+            }
+        }
+    }
+
+    size_t size() const
+    {
+        return m_count;
+    }
+
+    static constexpr size_t capacity()
+    {
+        return CAPACITY;
+    }
+
+    /* Number of MACs evicted (LRU) or not remembered since the set was full */
+    uint32_t evicted() const
+    {
+        return m_evicted;
+    }
+    uint32_t overflowed() const
+    {
+        return m_overflowed;
+    }
+
+protected:
+    static const uint16_t NONE = 0xFFFF;
+
+    /* Power of two with max 50% load */
+    static constexpr size_t TABLE_SIZE = orviboSeenTableSize(CAPACITY, 2);
+    static constexpr uint8_t TABLE_BITS = orviboSeenTableBits(TABLE_SIZE);
+
+    uint8_t m_macs[CAPACITY][6] = {};
+    uint16_t m_prev[CAPACITY] = {};
+    uint16_t m_next[CAPACITY] = {};
+    uint16_t m_slots[TABLE_SIZE] = {}; /* Entry index + 1, 0 = empty */
+    uint16_t m_head = NONE;            /* Most recently seen */
+    uint16_t m_tail = NONE;            /* Least recently seen */
+    uint16_t m_count = 0;
+    uint32_t m_evicted = 0;
+    uint32_t m_overflowed = 0;
+
+    static size_t slotOf(const uint8_t *mac)
+    {
+        // Fibonacci hashing, use the top bits
+        return (size_t)(orviboMacHash(mac) >> (32 - TABLE_BITS)) & (TABLE_SIZE - 1);
+    }
+
+    void removeSlot(uint16_t entry)
+    {
+        size_t i = slotOf(m_macs[entry]);
+        while (m_slots[i] != entry + 1)
+        {
+            i = (i + 1) & (TABLE_SIZE - 1);
+        }
+        // Backward shift: move following entries of the probe sequence into the hole
+        size_t hole = i;
+        for (size_t j = (i + 1) & (TABLE_SIZE - 1); m_slots[j] != 0; j = (j + 1) & (TABLE_SIZE - 1))
+        {
+            size_t home = slotOf(m_macs[m_slots[j] - 1]);
+            if (((j - home) & (TABLE_SIZE - 1)) >= ((j - hole) & (TABLE_SIZE - 1)))
+            {
+                m_slots[hole] = m_slots[j];
+                hole = j;
+            }
+        }
+        m_slots[hole] = 0;
+    }
+
+    void pushFront(uint16_t entry)
+    {
+        m_prev[entry] = NONE;
+        m_next[entry] = m_head;
+        if (m_head != NONE)
+        {
+            m_prev[m_head] = entry;
+        }
+        else
+        {
+            m_tail = entry;
+        }
+        m_head = entry;
+    }
+
+    void unlink(uint16_t entry)
+    {
+        if (m_prev[entry] != NONE)
+            m_next[m_prev[entry]] = m_next[entry];
+        else
+            m_head = m_next[entry];
+        if (m_next[entry] != NONE)
+            m_prev[m_next[entry]] = m_prev[entry];
+        else
+            m_tail = m_prev[entry];
+    }
+};
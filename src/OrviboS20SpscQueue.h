@@ -0,0 +1,105 @@
+#pragma once
+
+#include <atomic>
+#include "OrviboS20Platform.h"
+
+/* Padding used to keep the producer and consumer state apart */
+#ifndef ORVIBO_CACHE_LINE_SIZE
+#ifdef ARDUINO
+#define ORVIBO_CACHE_LINE_SIZE 4
+#else
+#define ORVIBO_CACHE_LINE_SIZE 64
+#endif
+#endif
+
+/*
+ * Bounded lock-free single producer/single consumer ring buffer
+ * One thread may call the producer functions (push/reserve/commit) and another thread
+ * the consumer functions (front/pop) concurrently without any locking. SIZE must be a
+ * power of two. Items are stored in place so reserve()/front() allow filling and
+ * reading an item without copying it.
+ */
+template <class T, size_t SIZE>
+class OrviboS20SpscQueue
+{
+public:
+    static_assert((SIZE >= 2) && ((SIZE & (SIZE - 1)) == 0), "SIZE must be a power of two");
+
+    /* Producer: returns a free item to fill in or nullptr if the queue is full */
+    T *reserve()
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head_cache == SIZE)
+        {
+            m_head_cache = m_head.load(std::memory_order_acquire);
+            if (tail - m_head_cache == SIZE)
+            {
+                return nullptr;
+            }
+        }
+        return &m_items[tail & (SIZE - 1)];
+    }
+
+    /* Producer: publishes the item returned by reserve() */
+    void commit()
+    {
+        m_tail.store(m_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    /* Producer: returns false if the queue is full */
+    bool push(const T &item)
+    {
+        T *slot = reserve();
+        if (slot == nullptr)
+        {
+            return false;
+        }
+        *slot = item;
+        commit();
+        return true;
+    }
+
+    /* Consumer: returns the oldest item or nullptr if the queue is empty */
+    T *front()
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail_cache)
+        {
+            m_tail_cache = m_tail.load(std::memory_order_acquire);
+            if (head == m_tail_cache)
+            {
+                return nullptr;
+            }
+        }
+        return &m_items[head & (SIZE - 1)];
+    }
+
+    /* Consumer: releases the item returned by front() */
+    void pop()
+    {
+        m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    /* Number of items in the queue (approximate while the other side is running) */
+    size_t size() const
+    {
+        return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+    }
+
+    static constexpr size_t capacity()
+    {
+        return SIZE;
+    }
+
+protected:
+    // Producer and consumer indexes on separate cache lines, each side keeps a cached
+    // copy of the other index to avoid touching the shared line on every call.
+    // Padding is used instead of alignas() so the queue can be allocated with new.
+    std::atomic<size_t> m_tail{0};
+    size_t m_head_cache = 0;
+    uint8_t m_pad0[ORVIBO_CACHE_LINE_SIZE];
+    std::atomic<size_t> m_head{0};
+    size_t m_tail_cache = 0;
+    uint8_t m_pad1[ORVIBO_CACHE_LINE_SIZE];
+    T m_items[SIZE];
+};
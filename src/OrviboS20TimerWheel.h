@@ -0,0 +1,201 @@
+#pragma once
+
+#include "OrviboS20Platform.h"
+
+/*
+ * Hashed timer wheel for per-device deadlines
+ * Each slot covers TICK_MS milliseconds and holds an intrusive list of timer nodes
+ * (embedded in T). advance() only visits the slots that have passed so the cost is
+ * independent of the number of armed timers. Deadlines SLOTS * TICK_MS or more ahead
+ * go to a second level of SLOTS slots of SLOTS * TICK_MS each. One of its slots is
+ * moved down to the fine slots per rotation, so a long timer is touched once before it
+ * expires (deadlines beyond the second level are moved once per SLOTS rotations).
+ * A timer fires at most TICK_MS after its deadline.
+ */
+template <class T, uint16_t SLOTS = 256, uint32_t TICK_MS = 1000>
+class OrviboS20TimerWheel
+{
+public:
+    struct Node
+    {
+        Node *next = nullptr;
+        Node **pprev = nullptr; /* Points to the pointer pointing at this node */
+        uint32_t deadline = 0;
+        uint16_t slot = 0; /* Slot the node is linked into (SLOTS.. = coarse, 2 * SLOTS = not in the wheel) */
+        T *owner = nullptr;
+
+        bool isArmed() const
+        {
+            return pprev != nullptr;
+        }
+    };
+
+    /* (Re)arm a timer, any previous deadline is replaced */
+    void schedule(Node &node, uint32_t deadline)
+    {
+        if (!m_running)
+        {
+            m_base_time = millis();
+            m_running = true;
+        }
+        size_t slot = slotOf(deadline);
+        if (node.isArmed())
+        {
+            if (node.slot == slot)
+            {
+                // Same slot, just move the deadline
+                node.deadline = deadline;
+                return;
+            }
+            unlink(node);
+        }
+        node.deadline = deadline;
+        insert(node, slot);
+    }
+
+    void cancel(Node &node)
+    {
+        if (node.isArmed())
+        {
+            unlink(node);
+        }
+    }
+
+    /*
+     * Fire all timers with deadline <= now
+     * expired(T &owner) is called for each of them. The node is disarmed before the
+     * call so the callback may re-schedule or cancel any timer.
+     */
+    template <class F>
+    void advance(uint32_t now, F expired)
+    {
+        if (!m_running)
+        {
+            return;
+        }
+        uint32_t behind = now - m_base_time;
+        if (behind >= TICK_MS * SLOTS)
+        {
+            // We've been away for a full rotation, check every timer and re-insert
+            // the ones that have not expired relative to the new base time
+            Node *all = nullptr;
+            for (size_t i = 0; i < SLOTS; i++)
+            {
+                splice(&m_slots[i], &all);
+                splice(&m_coarse[i], &all);
+            }
+            m_base_time = now - (behind % TICK_MS);
+            m_cursor = 0;
+            process(&all, now, expired);
+            return;
+        }
+        while (now - m_base_time >= TICK_MS)
+        {
+            Node *due = nullptr;
+            splice(&m_slots[m_cursor], &due);
+            m_cursor = (m_cursor + 1) % SLOTS;
+            m_base_time += TICK_MS;
+            if (m_cursor == 0)
+            {
+                // New rotation, move the long timers that are now less than a rotation
+                // ahead down to the fine slots
+                Node *cascade = nullptr;
+                splice(&m_coarse[m_coarse_cursor], &cascade);
+                m_coarse_cursor = (m_coarse_cursor + 1) % SLOTS;
+                process(&cascade, now, expired);
+            }
+            process(&due, now, expired);
+        }
+    }
+
+protected:
+    static const uint32_t SPAN_MS = TICK_MS * SLOTS;
+
+    Node *m_slots[SLOTS] = {};
+    Node *m_coarse[SLOTS] = {}; /* SPAN_MS per slot */
+    size_t m_cursor = 0;        /* Slot covering [m_base_time, m_base_time + TICK_MS) */
+    size_t m_coarse_cursor = 0; /* Coarse slot moved down at the start of the next rotation */
+    uint32_t m_base_time = 0;
+    bool m_running = false;
+
+    /* Slot id for deadline: fine slot below SLOTS, coarse slot + SLOTS otherwise */
+    size_t slotOf(uint32_t deadline) const
+    {
+        int32_t ahead = (int32_t)(deadline - m_base_time);
+        if (ahead < 0)
+        {
+            ahead = 0;
+        }
+        if ((uint32_t)ahead < SPAN_MS)
+        {
+            return (m_cursor + (uint32_t)ahead / TICK_MS) % SLOTS;
+        }
+        // Rotations after the next one starts
+        uint32_t rotation_start = m_base_time + (SLOTS - m_cursor) * TICK_MS;
+        uint32_t rotations = (deadline - rotation_start) / SPAN_MS;
+        if (rotations >= SLOTS)
+        {
+            rotations = SLOTS - 1;
+        }
+        return SLOTS + (m_coarse_cursor + rotations) % SLOTS;
+    }
+
+    void insert(Node &node, size_t slot)
+    {
+        link(node, (slot < SLOTS) ? &m_slots[slot] : &m_coarse[slot - SLOTS]);
+        node.slot = slot;
+    }
+
+    static void link(Node &node, Node **head)
+    {
+        node.next = *head;
+        if (node.next)
+        {
+            node.next->pprev = &node.next;
+        }
+        node.pprev = head;
+        node.slot = 2 * SLOTS;
+        *head = &node;
+    }
+
+    static void unlink(Node &node)
+    {
+        *node.pprev = node.next;
+        if (node.next)
+        {
+            node.next->pprev = node.pprev;
+        }
+        node.next = nullptr;
+        node.pprev = nullptr;
+    }
+
+    /* Move all nodes of list 'from' to the front of list 'to' */
+    static void splice(Node **from, Node **to)
+    {
+        while (*from)
+        {
+            Node *node = *from;
+            unlink(*node);
+            link(*node, to);
+        }
+    }
+
+    template <class F>
+    void process(Node **list, uint32_t now, F &expired)
+    {
+        while (*list)
+        {
+            Node *node = *list;
+            unlink(*node);
+            if ((int32_t)(now - node->deadline) >= 0)
+            {
+                expired(*node->owner);
+            }
+            else
+            {
+                // Not yet, the deadline is in a later slot or rotation
+                insert(*node, slotOf(node->deadline));
+            }
+        }
+    }
+};
@@ -0,0 +1,157 @@
+#pragma once
+
+#include "OrviboS20Platform.h"
+
+#ifdef ARDUINO
+#include <WiFiUDP.h>
+#endif
+
+/* Complete datagram used for batch sending */
+struct OrviboS20Datagram
+{
+    IPAddress ip;
+    uint16_t port;
+    const uint8_t *data;
+    size_t length;
+};
+
+/*
+ * Datagram transport used by OrviboS20Class and OrviboS20WiFiPairClass
+ * The interface follows the WiFiUDP API so that the ESP8266 backend is a thin wrapper.
+ */
+class OrviboS20Transport
+{
+public:
+    virtual ~OrviboS20Transport() {}
+
+    /* Open the transport and listen on the specified local port */
+    virtual bool begin(uint16_t port) = 0;
+    /* Close the transport */
+    virtual void stop() = 0;
+
+    /*
+     * Fetch next received datagram (any unread data of the previous one is discarded)
+     * Returns size of the datagram or 0 if there is nothing to read
+     */
+    virtual int parsePacket() = 0;
+    /* Read data of the datagram fetched by parsePacket() */
+    virtual int read(uint8_t *buffer, size_t length) = 0;
+    /* Source of the datagram fetched by parsePacket() */
+    virtual IPAddress remoteIP() = 0;
+    virtual uint16_t remotePort() = 0;
+    /*
+     * Number of datagrams that can be fetched by parsePacket() without waiting
+     * This is a lower bound; transports that can't look ahead return 0 or 1
+     */
+    virtual int pending() = 0;
+
+    /* Start building a datagram to the specified destination */
+    virtual int beginPacket(IPAddress ip, uint16_t port) = 0;
+    /* Append data to the datagram */
+    virtual size_t write(const uint8_t *buffer, size_t length) = 0;
+    /* Send the datagram */
+    virtual int endPacket() = 0;
+
+    /* Send a complete datagram, backends may override this to avoid the intermediate copy */
+    virtual bool sendPacket(IPAddress ip, uint16_t port, const uint8_t *buffer, size_t length)
+    {
+        if (!beginPacket(ip, port))
+        {
+            return false;
+        }
+        write(buffer, length);
+        return endPacket() != 0;
+    }
+
+    /*
+     * Send several datagrams back-to-back, returns the number sent
+     * A datagram that can't be sent is skipped, the others are still sent.
+     */
+    virtual size_t sendPackets(const OrviboS20Datagram *datagrams, size_t count)
+    {
+        size_t sent = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (sendPacket(datagrams[i].ip, datagrams[i].port, datagrams[i].data, datagrams[i].length))
+            {
+                sent++;
+            }
+        }
+        return sent;
+    }
+
+    size_t write(uint8_t byte)
+    {
+        return write(&byte, 1);
+    }
+};
+
+#ifdef ARDUINO
+
+/* ESP8266 backend using WiFiUDP */
+class OrviboS20WiFiUDPTransport : public OrviboS20Transport
+{
+public:
+    bool begin(uint16_t port) override
+    {
+        return m_udp.begin(port);
+    }
+    void stop() override
+    {
+        m_peeked_size = 0;
+        m_udp.stop();
+    }
+    int parsePacket() override
+    {
+        if (m_peeked_size > 0)
+        {
+            // pending() has already fetched the next datagram
+            int size = m_peeked_size;
+            m_peeked_size = 0;
+            return size;
+        }
+        return m_udp.parsePacket();
+    }
+    int read(uint8_t *buffer, size_t length) override
+    {
+        return m_udp.read(buffer, length);
+    }
+    IPAddress remoteIP() override
+    {
+        return m_udp.remoteIP();
+    }
+    uint16_t remotePort() override
+    {
+        return m_udp.remotePort();
+    }
+    int pending() override
+    {
+        // WiFiUDP can't look ahead so we fetch the next datagram and hand it out in
+        // the next parsePacket() call. Note: this discards the current datagram.
+        if (m_peeked_size <= 0)
+        {
+            m_peeked_size = m_udp.parsePacket();
+        }
+        return (m_peeked_size > 0) ? 1 : 0;
+    }
+    int beginPacket(IPAddress ip, uint16_t port) override
+    {
+        return m_udp.beginPacket(ip, port);
+    }
+    size_t write(const uint8_t *buffer, size_t length) override
+    {
+        return m_udp.write(buffer, length);
+    }
+    int endPacket() override
+    {
+        return m_udp.endPacket();
+    }
+
+    using OrviboS20Transport::write;
+
+protected:
+    WiFiUDP m_udp;
+    int m_peeked_size = 0;
+};
+
+#endif
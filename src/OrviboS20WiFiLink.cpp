@@ -0,0 +1,70 @@
+#include "OrviboS20WiFiLink.h"
+
+#ifdef ARDUINO
+
+#include <ESP8266WiFi.h>
+extern "C" {
+#include <user_interface.h>
+}
+
+/***********************************************************************************
+ * Class definition
+ ***********************************************************************************/
+
+void OrviboS20ESPWiFiLink::disconnect()
+{
+    WiFi.disconnect();
+}
+
+void OrviboS20ESPWiFiLink::scanNetworks()
+{
+    WiFi.scanNetworks(true, false);
+}
+
+int OrviboS20ESPWiFiLink::scanComplete()
+{
+    return WiFi.scanComplete();
+}
+
+bool OrviboS20ESPWiFiLink::getNetwork(int index, char *ssid, size_t ssid_size, uint8_t *bssid, int32_t &channel)
+{
+    // The scan record is read directly, WiFi.SSID() would allocate a String
+    const bss_info *info = (const bss_info *)WiFi.getScanInfoByIndex(index);
+    if ((info == nullptr) || (ssid_size == 0))
+    {
+        return false;
+    }
+    size_t ssid_len = (info->ssid_len < sizeof(info->ssid)) ? info->ssid_len : sizeof(info->ssid);
+    if (ssid_len > ssid_size - 1)
+    {
+        ssid_len = ssid_size - 1;
+    }
+    memcpy(ssid, info->ssid, ssid_len);
+    ssid[ssid_len] = 0;
+    memcpy(bssid, info->bssid, 6);
+    channel = info->channel;
+    return true;
+}
+
+void OrviboS20ESPWiFiLink::begin(const char *ssid, const char *passphrase, int32_t channel, const uint8_t *bssid)
+{
+    WiFi.begin(ssid, passphrase, channel, bssid);
+}
+
+bool OrviboS20ESPWiFiLink::isConnected()
+{
+    return WiFi.isConnected();
+}
+
+const uint8_t *OrviboS20ESPWiFiLink::BSSID()
+{
+    return WiFi.BSSID();
+}
+
+IPAddress OrviboS20ESPWiFiLink::broadcastIP()
+{
+    uint32_t subnet = WiFi.subnetMask();
+    return (uint32_t)WiFi.localIP() | (~subnet);
+}
+
+#endif
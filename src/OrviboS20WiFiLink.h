@@ -0,0 +1,48 @@
+#pragma once
+
+#include "OrviboS20Platform.h"
+
+/*
+ * The WiFi station operations needed by OrviboS20WiFiPairClass
+ * On the ESP8266 this is implemented with the ESP8266WiFi library. On other platforms
+ * the application needs to provide an implementation (see OrviboS20WiFiPair.setWiFiLink()).
+ */
+class OrviboS20WiFiLink
+{
+public:
+    virtual ~OrviboS20WiFiLink() {}
+
+    /* Disconnect station from current AP */
+    virtual void disconnect() = 0;
+    /* Start an asynchronous scan */
+    virtual void scanNetworks() = 0;
+    /* Returns number of networks found or a negative value while scan is running */
+    virtual int scanComplete() = 0;
+    /* Get SSID, BSSID and channel of a scan result */
+    virtual bool getNetwork(int index, char *ssid, size_t ssid_size, uint8_t *bssid, int32_t &channel) = 0;
+    /* Connect to an AP (channel = 0 and bssid = nullptr means any) */
+    virtual void begin(const char *ssid, const char *passphrase, int32_t channel, const uint8_t *bssid) = 0;
+    virtual bool isConnected() = 0;
+    /* BSSID of the AP we're connected to */
+    virtual const uint8_t *BSSID() = 0;
+    /* Broadcast address of the network we're connected to */
+    virtual IPAddress broadcastIP() = 0;
+};
+
+#ifdef ARDUINO
+
+/* ESP8266 implementation using the global WiFi object */
+class OrviboS20ESPWiFiLink : public OrviboS20WiFiLink
+{
+public:
+    void disconnect() override;
+    void scanNetworks() override;
+    int scanComplete() override;
+    bool getNetwork(int index, char *ssid, size_t ssid_size, uint8_t *bssid, int32_t &channel) override;
+    void begin(const char *ssid, const char *passphrase, int32_t channel, const uint8_t *bssid) override;
+    bool isConnected() override;
+    const uint8_t *BSSID() override;
+    IPAddress broadcastIP() override;
+};
+
+#endif
@@ -1,97 +1,217 @@
-#include <ESP8266WiFi.h>
+#include <ctype.h>
 #include "OrviboS20WiFiPair.h"
 
 /***********************************************************************************
  * Consts
  ***********************************************************************************/
 
-#define GLOBAL_TIMEOUT_S 60
-#define CONNECT_TIMEOUT_S 10
-#define COMMAND_TIMEOUT_S 3
+#define GLOBAL_TIMEOUT_MS 60000
+#define CONNECT_TIMEOUT_MS 10000
+#define COMMAND_TIMEOUT_MS 1000
+#define MAX_COMMAND_TIMEOUT_MS 4000
+#define COMMAND_BACKOFF 2
+#define COMMAND_RETRIES 3
 
-const String WIWO_S20_SSID = "WiWo-S20";
-const String ASSIST_THREAD[] = "HF-A11ASSISTHREAD";
-const uint16_t UDP_PORT = 48899;
+static const char WIWO_S20_SSID[] = "WiWo-S20";
+static const uint16_t UDP_PORT = 48899;
+
+/* What is appended to the fixed text of a command */
+enum CommandArg
+{
+    ARG_NONE,
+    ARG_SSID,
+    ARG_KEY
+};
+
+struct CommandEncoding
+{
+    const char *text;
+    CommandArg arg;
+    bool cr; /* AT commands are terminated by a carriage return */
+};
+
+/* Indexed by OrviboS20WiFiPairClass::CommandId */
+static constexpr CommandEncoding COMMANDS[] = {
+    {"HF-A11ASSISTHREAD", ARG_NONE, false},
+    {"AT+WSSSID=", ARG_SSID, true},
+    {"AT+WSKEY=", ARG_KEY, true},
+    {"AT+WMODE=STA", ARG_NONE, true},
+    {"AT+Z", ARG_NONE, true},
+};
+static_assert(sizeof(COMMANDS) / sizeof(COMMANDS[0]) == OrviboS20WiFiPairClass::CMD_LAST, "A command has no encoding");
+
+static const char KEY_OPEN[] = "OPEN,NONE,";
+static const char KEY_WPA2[] = "WPA2PSK,AES,";
+
+/* Longest command: AT+WSKEY=WPA2PSK,AES,<64 char passphrase>\r */
+static const size_t COMMAND_BUFFER_LEN = sizeof("AT+WSKEY=") - 1 + sizeof(KEY_WPA2) - 1 + 64 + 2;
 
 /***********************************************************************************
  * Variables
  ***********************************************************************************/
 
+#ifdef ARDUINO
+static OrviboS20WiFiUDPTransport s_default_transport;
+static OrviboS20ESPWiFiLink s_default_link;
+#endif
+
 OrviboS20WiFiPairClass OrviboS20WiFiPair;
 
+/***********************************************************************************
+ * Static functions
+ ***********************************************************************************/
+
+// prefix/suffix must be upper case
+static bool startsWithNoCase(const char *str, size_t len, const char *prefix)
+{
+    size_t prefix_len = strlen(prefix);
+    if (len < prefix_len)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < prefix_len; i++)
+    {
+        if (toupper((unsigned char)str[i]) != prefix[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool endsWithNoCase(const char *str, size_t len, const char *suffix)
+{
+    size_t suffix_len = strlen(suffix);
+    return (len >= suffix_len) && startsWithNoCase(&str[len - suffix_len], suffix_len, suffix);
+}
+
+// Leaves room for the carriage return and the null terminator
+static size_t append(char *buffer, size_t pos, const char *str)
+{
+    size_t len = strnlen(str, COMMAND_BUFFER_LEN - 2 - pos);
+    memcpy(&buffer[pos], str, len);
+    return pos + len;
+}
+
+static bool expired(uint32_t deadline)
+{
+    return (int32_t)(millis() - deadline) >= 0;
+}
+
 /***********************************************************************************
  * Class definition
  ***********************************************************************************/
 
-void OrviboS20WiFiPairClass::sendString(const char *str)
+#ifdef ARDUINO
+OrviboS20WiFiPairClass::OrviboS20WiFiPairClass() : m_udp(&s_default_transport), m_wifi(&s_default_link)
+#else
+OrviboS20WiFiPairClass::OrviboS20WiFiPairClass() : m_udp(nullptr), m_wifi(nullptr)
+#endif
 {
-    uint32_t subnet = WiFi.subnetMask();
-    uint32_t mcast = (uint32_t)WiFi.localIP() | (~subnet);
+    m_ssid[0] = 0;
+    m_passphrase[0] = 0;
+    m_timing.global_timeout_ms = GLOBAL_TIMEOUT_MS;
+    m_timing.connect_timeout_ms = CONNECT_TIMEOUT_MS;
+    for (int i = CMD_FIRST; i < CMD_LAST; i++)
+    {
+        m_timing.command_timeout_ms[i] = COMMAND_TIMEOUT_MS;
+    }
+    m_timing.max_command_timeout_ms = MAX_COMMAND_TIMEOUT_MS;
+    m_timing.backoff = COMMAND_BACKOFF;
+    m_timing.retries = COMMAND_RETRIES;
+}
 
-    m_udp.beginPacket(mcast, UDP_PORT);
-    m_udp.write(str, strlen(str));
-    m_udp.endPacket();
+void OrviboS20WiFiPairClass::sendString(const char *str, size_t len)
+{
+    m_udp->beginPacket(m_wifi->broadcastIP(), UDP_PORT);
+    m_udp->write((const uint8_t *)str, len);
+    m_udp->endPacket();
 }
 
 void OrviboS20WiFiPairClass::sendCommand(CommandId cmdId)
 {
-    String cmd;
-    switch (cmdId)
+    // Encoded on the stack, pairing often runs right after boot and shouldn't touch the heap
+    char cmd[COMMAND_BUFFER_LEN];
+    const CommandEncoding &encoding = COMMANDS[cmdId];
+    size_t len = append(cmd, 0, encoding.text);
+    switch (encoding.arg)
     {
-    case CMD_ASSISTTHREAD:
-        cmd = "HF-A11ASSISTHREAD";
+    case ARG_SSID:
+        len = append(cmd, len, m_ssid);
         break;
-    case CMD_SSID:
-        cmd = "AT+WSSSID=" + m_ssid + "\r";
-        break;
-    case CMD_KEY:
-        cmd = "AT+WSKEY=";
-        if (m_passphrase == "")
-            cmd += "OPEN,NONE,\r";
+    case ARG_KEY:
+        if (m_passphrase[0] == 0)
+        {
+            len = append(cmd, len, KEY_OPEN);
+        }
         else
-            cmd += "WPA2PSK,AES," + m_passphrase + "\r";
-        break;
-    case CMD_MODE:
-        cmd = "AT+WMODE=STA\r";
+        {
+            len = append(cmd, len, KEY_WPA2);
+            len = append(cmd, len, m_passphrase);
+        }
         break;
-    case CMD_Z:
-        cmd = "AT+Z\r";
+    default:
         break;
     }
+    if (encoding.cr)
+    {
+        cmd[len++] = '\r';
+    }
+    cmd[len] = 0;
     if (m_sending_cmd_cb)
     {
-        m_sending_cmd_cb(WiFi.BSSID(), cmd.c_str());
+        m_sending_cmd_cb(m_wifi->BSSID(), cmd);
     }
-    sendString(cmd.c_str());
+    sendString(cmd, len);
+}
+
+void OrviboS20WiFiPairClass::startCommand(CommandId cmdId)
+{
+    m_current_cmd = cmdId;
+    m_cmd_retransmit_counter = 0;
+    m_cmd_timeout_ms = m_timing.command_timeout_ms[cmdId];
+    m_state_deadline = millis() + m_cmd_timeout_ms;
+    sendCommand(cmdId);
+}
+
+void OrviboS20WiFiPairClass::retransmitCommand()
+{
+    m_cmd_retransmit_counter++;
+    uint32_t timeout = m_cmd_timeout_ms * (m_timing.backoff ? m_timing.backoff : 1);
+    m_cmd_timeout_ms = (timeout > m_timing.max_command_timeout_ms) ? m_timing.max_command_timeout_ms : timeout;
+    // Never back off to less than the configured timeout of the command
+    if (m_cmd_timeout_ms < m_timing.command_timeout_ms[m_current_cmd])
+    {
+        m_cmd_timeout_ms = m_timing.command_timeout_ms[m_current_cmd];
+    }
+    m_state_deadline = millis() + m_cmd_timeout_ms;
+    sendCommand(m_current_cmd);
 }
 
 OrviboS20WiFiPairClass::PacketType OrviboS20WiFiPairClass::checkRxPacket()
 {
-    char rx_buffer[64];
-    if (m_udp.parsePacket() <= 0)
+    char rx_buffer[63];
+    if (m_udp->parsePacket() <= 0)
     {
         return PKT_NONE;
     }
-    int len = m_udp.read(rx_buffer, sizeof(rx_buffer) - 1);
+    int len = m_udp->read((uint8_t *)rx_buffer, sizeof(rx_buffer));
     if (len < 0)
     {
         return PKT_NONE;
     }
-    // Null-terminate the string
-    rx_buffer[len] = 0;
-    String rsp = rx_buffer;
-    rsp.toUpperCase();
-    if (rsp.startsWith("+OK"))
+    // Matched in place, case insensitive
+    if (startsWithNoCase(rx_buffer, len, "+OK"))
     {
         return PKT_OK;
     }
-    else if (rsp.startsWith("+ERR"))
+    else if (startsWithNoCase(rx_buffer, len, "+ERR"))
     {
         return PKT_ERROR;
     }
-    else if (rsp.endsWith("HF-LPB100") && (m_current_cmd == CMD_ASSISTTHREAD))
+    else if (endsWithNoCase(rx_buffer, len, "HF-LPB100") && (m_current_cmd == CMD_ASSISTTHREAD))
     {
-        sendString("+ok");
+        sendString("+ok", 3);
         return PKT_OK;
     }
     return PKT_UNKNOWN;
@@ -102,27 +222,27 @@ OrviboS20WiFiPairClass::State OrviboS20WiFiPairClass::enterState(State state)
     switch (state)
     {
     case S_IDLE:
-        m_tmo_timer = GLOBAL_TIMEOUT_S;
-        WiFi.disconnect();
+        m_global_deadline = millis() + m_timing.global_timeout_ms;
+        m_queue_count = 0;
+        m_queue_pos = 0;
+        m_wifi->disconnect();
         break;
     case S_SCAN:
-        WiFi.scanNetworks(true, false);
+        m_wifi->scanNetworks();
         break;
     case S_CONNECT:
-        m_state_timer = CONNECT_TIMEOUT_S;
-        WiFi.begin(WIWO_S20_SSID);
+        m_state_deadline = millis() + m_timing.connect_timeout_ms;
+        // Connect to the exact network found by the scan (no channel scan needed)
+        m_wifi->begin(WIWO_S20_SSID, nullptr, m_queue[m_queue_pos].channel, m_queue[m_queue_pos].bssid);
         break;
     case S_SEND_COMMANDS:
-        m_state_timer = COMMAND_TIMEOUT_S;
-        m_current_cmd = CMD_FIRST;
-        m_cmd_retransmit_counter = 0;
-        sendCommand(m_current_cmd);
+        startCommand(CMD_FIRST);
         break;
     case S_STOPPED:
-        WiFi.disconnect();
+        m_wifi->disconnect();
         if (m_state != S_STOPPED)
         {
-            m_udp.stop();
+            m_udp->stop();
             if (m_stopped_cb)
             {
                 OrviboStopReason reason;
@@ -137,6 +257,9 @@ OrviboS20WiFiPairClass::State OrviboS20WiFiPairClass::enterState(State state)
                 case S_TIMEOUT:
                     reason = REASON_TIMEOUT;
                     break;
+                case S_BATCH_COMPLETE:
+                    reason = m_batch_result.paired ? REASON_PAIRING_SUCCESSFUL : m_last_failure;
+                    break;
                 default:
                     reason = REASON_STOPPED_BY_USER;
                 }
@@ -147,12 +270,42 @@ OrviboS20WiFiPairClass::State OrviboS20WiFiPairClass::enterState(State state)
     case S_PAIRING_COMPLETE:
         if (m_success_cb)
         {
-            m_success_cb(WiFi.BSSID());
+            m_success_cb(m_queue[m_queue_pos].bssid);
         }
+        if (m_batch)
+        {
+            return nextDevice(REASON_PAIRING_SUCCESSFUL);
+        }
+        // m_state tells enterState(S_STOPPED) the stop reason
+        m_state = state;
         return enterState(S_STOPPED);
     case S_COMMAND_FAILED:
+        if (m_batch)
+        {
+            return nextDevice(REASON_COMMAND_FAILED);
+        }
+        m_state = state;
         return enterState(S_STOPPED);
     case S_TIMEOUT:
+        if (m_batch)
+        {
+            // Either the current device timed out or the scan didn't find anything
+            if (m_queue_count > 0)
+            {
+                return nextDevice(REASON_TIMEOUT);
+            }
+            m_last_failure = REASON_TIMEOUT;
+            return enterState(S_BATCH_COMPLETE);
+        }
+        m_state = state;
+        return enterState(S_STOPPED);
+    case S_BATCH_COMPLETE:
+        m_batch_result.elapsed_ms = millis() - m_batch_start;
+        if (m_batch_done_cb)
+        {
+            m_batch_done_cb(m_batch_result);
+        }
+        m_state = state;
         return enterState(S_STOPPED);
 
     default:
@@ -161,24 +314,73 @@ OrviboS20WiFiPairClass::State OrviboS20WiFiPairClass::enterState(State state)
     return state;
 }
 
-OrviboS20WiFiPairClass::State OrviboS20WiFiPairClass::executeState(State state)
+OrviboS20WiFiPairClass::State OrviboS20WiFiPairClass::nextDevice(OrviboStopReason result)
 {
-    bool state_timeout, global_timeout;
-    int networksFound;
-    PacketType pkt = checkRxPacket();
+    if (result == REASON_PAIRING_SUCCESSFUL)
+    {
+        m_batch_result.paired++;
+    }
+    else
+    {
+        m_batch_result.failed++;
+        m_last_failure = result;
+    }
+    if (m_device_result_cb)
+    {
+        m_device_result_cb(m_queue[m_queue_pos].bssid, result);
+    }
+    if (++m_queue_pos < m_queue_count)
+    {
+        m_wifi->disconnect();
+        m_global_deadline = millis() + m_timing.global_timeout_ms;
+        return enterState(S_CONNECT);
+    }
+    return enterState(S_BATCH_COMPLETE);
+}
 
-    if (millis() - m_last_tick_time > 1000)
+bool OrviboS20WiFiPairClass::queueNetworks(int count)
+{
+    m_queue_count = 0;
+    m_queue_pos = 0;
+    for (int i = 0; (i < count) && (m_queue_count < ORVIBO_PAIR_QUEUE_MAX); i++)
     {
-        m_last_tick_time = millis();
-        if (m_state_timer >= 0)
-            m_state_timer--;
-        if (m_tmo_timer >= 0)
-            m_tmo_timer--;
+        char ssid[33];
+        target_t &target = m_queue[m_queue_count];
+        if (!m_wifi->getNetwork(i, ssid, sizeof(ssid), target.bssid, target.channel) ||
+            (strcmp(ssid, WIWO_S20_SSID) != 0))
+        {
+            continue;
+        }
+        bool duplicate = false;
+        for (uint8_t j = 0; j < m_queue_count; j++)
+        {
+            duplicate = duplicate || (memcmp(m_queue[j].bssid, target.bssid, 6) == 0);
+        }
+        if (duplicate)
+        {
+            continue;
+        }
+        m_queue_count++;
+        if (m_found_device_cb)
+        {
+            m_found_device_cb(target.bssid);
+        }
+        if (!m_batch)
+        {
+            // Single device pairing uses the first one found
+            break;
+        }
     }
-    state_timeout = m_state_timer <= 0;
-    global_timeout = m_tmo_timer <= 0;
+    m_batch_result.found = m_queue_count;
+    return m_queue_count > 0;
+}
 
-    if (state != S_STOPPED && global_timeout)
+OrviboS20WiFiPairClass::State OrviboS20WiFiPairClass::executeState(State state)
+{
+    int networksFound;
+    PacketType pkt = checkRxPacket();
+
+    if (state != S_STOPPED && expired(m_global_deadline))
     {
         return enterState(S_TIMEOUT);
     }
@@ -189,70 +391,61 @@ OrviboS20WiFiPairClass::State OrviboS20WiFiPairClass::executeState(State state)
         return enterState(S_SCAN);
 
     case S_SCAN:
-        networksFound = WiFi.scanComplete();
+        networksFound = m_wifi->scanComplete();
         if (networksFound >= 0)
         {
-            for (int i = 0; i < networksFound; i++)
+            if (queueNetworks(networksFound))
             {
-                if (WiFi.SSID(i) == WIWO_S20_SSID)
-                {
-                    if (m_found_device_cb)
-                    {
-                        m_found_device_cb(WiFi.BSSID(i));
-                    }
-                    return enterState(S_CONNECT);
-                }
+                return enterState(S_CONNECT);
             }
             return enterState(S_SCAN);
         }
         break;
 
     case S_CONNECT:
-        if (WiFi.isConnected())
+        if (m_wifi->isConnected())
         {
             return enterState(S_SEND_COMMANDS);
         }
-        if (state_timeout)
+        if (expired(m_state_deadline))
         {
-            return enterState(S_SCAN);
+            return m_batch ? nextDevice(REASON_TIMEOUT) : enterState(S_SCAN);
         }
         break;
 
     case S_SEND_COMMANDS:
         if (pkt == PKT_OK)
         {
-            state_timeout = COMMAND_TIMEOUT_S;
-            m_cmd_retransmit_counter = 0;
-            m_current_cmd = static_cast<CommandId>(static_cast<int>(m_current_cmd) + 1);
-
-            if (m_current_cmd == CMD_LAST)
+            CommandId next = static_cast<CommandId>(static_cast<int>(m_current_cmd) + 1);
+            if (next == CMD_LAST)
             {
                 // We should actually never get here since the last AT+Z does not send any response
                 return enterState(S_PAIRING_COMPLETE);
             }
             // Send next command
-            sendCommand(m_current_cmd);
+            startCommand(next);
         }
         else if (pkt == PKT_ERROR)
         {
             // Something went wrong..
             return enterState(S_COMMAND_FAILED);
         }
-        else if (state_timeout)
+        else if (expired(m_state_deadline))
         {
-            if (m_cmd_retransmit_counter++ < 2)
+            if (m_current_cmd == CMD_Z)
             {
-                state_timeout = COMMAND_TIMEOUT_S;
+                // ATZ is last command and since S20 will not send any response for this cmd we're done..
+                // It is sent once more in case the first one was lost
                 sendCommand(m_current_cmd);
-                if (m_current_cmd == CMD_Z)
-                {
-                    // ATZ is last command and since S20 will not send any response for this cmd we're done..
-                    return enterState(S_PAIRING_COMPLETE);
-                }
+                return enterState(S_PAIRING_COMPLETE);
+            }
+            if (m_cmd_retransmit_counter < m_timing.retries)
+            {
+                retransmitCommand();
             }
             else
             {
-                return enterState(S_SCAN);
+                return m_batch ? nextDevice(REASON_TIMEOUT) : enterState(S_SCAN);
             }
         }
         break;
@@ -265,22 +458,69 @@ OrviboS20WiFiPairClass::State OrviboS20WiFiPairClass::executeState(State state)
 
 bool OrviboS20WiFiPairClass::begin(const char *ssid, const char *passphrase)
 {
-    m_ssid = ssid;
+    m_batch = false;
+    return start(ssid, passphrase);
+}
+
+bool OrviboS20WiFiPairClass::beginBatch(const char *ssid, const char *passphrase)
+{
+    m_batch = true;
+    return start(ssid, passphrase);
+}
+
+bool OrviboS20WiFiPairClass::start(const char *ssid, const char *passphrase)
+{
+    if ((m_udp == nullptr) || (m_wifi == nullptr))
+    {
+        return false;
+    }
+
+    strncpy(m_ssid, ssid, sizeof(m_ssid));
+    m_ssid[sizeof(m_ssid) - 1] = 0;
     if (passphrase == nullptr)
-        m_passphrase = "";
+        m_passphrase[0] = 0;
     else
-        m_passphrase = passphrase;
+    {
+        strncpy(m_passphrase, passphrase, sizeof(m_passphrase));
+        m_passphrase[sizeof(m_passphrase) - 1] = 0;
+    }
 
+    m_batch_result = {};
+    m_batch_start = millis();
     m_state = enterState(S_IDLE);
-    return m_udp.begin(UDP_PORT);
+    return m_udp->begin(UDP_PORT);
 }
 
 void OrviboS20WiFiPairClass::stop()
 {
+    if ((m_udp == nullptr) || (m_wifi == nullptr))
+    {
+        stopDetached(REASON_STOPPED_BY_USER);
+        return;
+    }
     m_state = enterState(S_STOPPED);
 }
 
 void OrviboS20WiFiPairClass::handle()
 {
+    if ((m_udp == nullptr) || (m_wifi == nullptr))
+    {
+        // setTransport(nullptr) or setWiFiLink(nullptr) while pairing
+        stopDetached(REASON_COMMAND_FAILED);
+        return;
+    }
     m_state = executeState(m_state);
 }
+
+void OrviboS20WiFiPairClass::stopDetached(OrviboStopReason reason)
+{
+    if (m_state == S_STOPPED)
+    {
+        return;
+    }
+    m_state = S_STOPPED;
+    if (m_stopped_cb)
+    {
+        m_stopped_cb(reason);
+    }
+}
@@ -1,8 +1,18 @@
 #pragma once
 
-#include <Arduino.h>
-#include <WiFiUDP.h>
-#include <functional>
+#include "OrviboS20Callback.h"
+#include "OrviboS20Platform.h"
+#include "OrviboS20Transport.h"
+#include "OrviboS20WiFiLink.h"
+
+/* Max number of devices paired in one batch, see OrviboS20WiFiPairClass::beginBatch() */
+#ifndef ORVIBO_PAIR_QUEUE_MAX
+#ifdef ARDUINO
+#define ORVIBO_PAIR_QUEUE_MAX 16
+#else
+#define ORVIBO_PAIR_QUEUE_MAX 64
+#endif
+#endif
 
 enum OrviboStopReason
 {
@@ -15,9 +25,47 @@ enum OrviboStopReason
 class OrviboS20WiFiPairClass
 {
 public:
-    typedef std::function<void(const uint8_t *bssid)> event_callback_t;
-    typedef std::function<void(const uint8_t *bssid, const char cmd[])> command_callback_t;
-    typedef std::function<void(OrviboStopReason reason)> stopped_callback_t;
+    typedef OrviboS20Callback<void(const uint8_t *bssid)> event_callback_t;
+    typedef OrviboS20Callback<void(const uint8_t *bssid, const char cmd[])> command_callback_t;
+    typedef OrviboS20Callback<void(OrviboStopReason reason)> stopped_callback_t;
+
+    /* Result of a batch, see beginBatch() */
+    struct batch_result_t
+    {
+        uint8_t found;       /* Devices queued by the scan */
+        uint8_t paired;
+        uint8_t failed;
+        uint32_t elapsed_ms; /* From begin until the last device was done */
+    };
+    typedef OrviboS20Callback<void(const uint8_t *bssid, OrviboStopReason result)> device_result_callback_t;
+    typedef OrviboS20Callback<void(const batch_result_t &result)> batch_done_callback_t;
+
+    /* The commands sent to the device, in order */
+    enum CommandId
+    {
+        CMD_FIRST = 0,
+
+        CMD_ASSISTTHREAD = CMD_FIRST,
+        CMD_SSID,
+        CMD_KEY,
+        CMD_MODE,
+        CMD_Z,
+
+        CMD_LAST
+    };
+
+    /* Timeouts of the pairing process, see setTiming() */
+    struct timing_t
+    {
+        uint32_t global_timeout_ms;            /* Per pairing, per device in a batch (default 60000) */
+        uint32_t connect_timeout_ms;           /* Connecting to the "WiWo-S20" AP (default 10000) */
+        uint16_t command_timeout_ms[CMD_LAST]; /* Wait for the reply to the first transmission of each command (default 1000) */
+        uint16_t max_command_timeout_ms;       /* Upper limit of the backed off timeout (default 4000) */
+        uint8_t backoff;                       /* The timeout is multiplied by this for each retransmission (default 2) */
+        uint8_t retries;                       /* Retransmissions before a device is given up (default 3) */
+    };
+
+    OrviboS20WiFiPairClass();
 
     /* This callback is called when a device with SSID "WiWo-S20" is found */
     void onFoundDevice(event_callback_t cb)
@@ -42,22 +90,86 @@ public:
     {
         m_success_cb = cb;
     }
+    /* Batch pairing: called when a device is done, result is REASON_PAIRING_SUCCESSFUL or the reason it failed */
+    void onDeviceResult(device_result_callback_t cb)
+    {
+        m_device_result_cb = cb;
+    }
+    /* Batch pairing: called when all queued devices are done, before onStopped() */
+    void onBatchDone(batch_done_callback_t cb)
+    {
+        m_batch_done_cb = cb;
+    }
 
     /*
      * Call begin() to start the WiFi pairing process for a WiWo S20
      * The ESP must be in STA or AP+STA mode for it to work (use WiFi.mode())
      * Set ssid and passphrase to the AP you want the S20 to connect to.
      * The pairing process will timeout after 60 seconds if it is not able to find
-     * and connect a device.
+     * and connect a device (see setTiming()).
      * Note: When passphrase is set this class will configure auth/enc to WPA2/AES,
      *       which is the default for ESP. Hence, if you try to pair it with another
      *       AP it may not work depending on AP config.
      */
     bool begin(const char *ssid, const char *passphrase = nullptr);
+#ifdef ARDUINO
     bool begin(const String &ssid, const String &passphrase = emptyString)
     {
         return begin(ssid.c_str(), passphrase.c_str());
     }
+#endif
+
+    /*
+     * Pair all devices in range
+     * Same as begin() but the scan queues every "WiWo-S20" network found (max
+     * ORVIBO_PAIR_QUEUE_MAX), and the devices are then connected to by BSSID and channel
+     * and paired one after the other. A device that fails is reported through
+     * onDeviceResult() and the next one is tried. Each device gets its own 60 second
+     * timeout. onStopped() is called with REASON_PAIRING_SUCCESSFUL if at least one
+     * device was paired, otherwise with the reason the last device failed.
+     */
+    bool beginBatch(const char *ssid, const char *passphrase = nullptr);
+#ifdef ARDUINO
+    bool beginBatch(const String &ssid, const String &passphrase = emptyString)
+    {
+        return beginBatch(ssid.c_str(), passphrase.c_str());
+    }
+#endif
+
+    const batch_result_t &getBatchResult()
+    {
+        return m_batch_result;
+    }
+
+    /*
+     * Change the timeouts, takes effect at the next state change. For example:
+     *   OrviboS20WiFiPairClass::timing_t timing = OrviboS20WiFiPair.getTiming();
+     *   timing.command_timeout_ms[OrviboS20WiFiPairClass::CMD_Z] = 300;
+     *   OrviboS20WiFiPair.setTiming(timing);
+     * AT+Z is never answered, it is sent once more when its timeout expires and the
+     * device is then considered paired.
+     */
+    void setTiming(const timing_t &timing)
+    {
+        m_timing = timing;
+    }
+    const timing_t &getTiming()
+    {
+        return m_timing;
+    }
+
+    /*
+     * Use another UDP transport and/or WiFi station implementation than the default
+     * ESP8266 ones. On other platforms both must be set before calling begin().
+     */
+    void setTransport(OrviboS20Transport *transport)
+    {
+        m_udp = transport;
+    }
+    void setWiFiLink(OrviboS20WiFiLink *link)
+    {
+        m_wifi = link;
+    }
 
     /* Stop the pairing process */
     void stop();
@@ -68,7 +180,11 @@ public:
         return (m_state != S_STOPPED);
     }
 
-    /* Call this from loop() */
+    /*
+     * Call this from loop()
+     * If the transport or WiFi link was removed while pairing, pairing stops with
+     * REASON_COMMAND_FAILED.
+     */
     void handle();
 
 protected:
@@ -80,23 +196,11 @@ protected:
         S_CONNECT,
         S_SEND_COMMANDS,
         S_PAIRING_COMPLETE,
+        S_BATCH_COMPLETE,
         S_COMMAND_FAILED = -1,
         S_TIMEOUT = -2
     };
 
-    enum CommandId
-    {
-        CMD_FIRST = 0,
-
-        CMD_ASSISTTHREAD = CMD_FIRST,
-        CMD_SSID,
-        CMD_KEY,
-        CMD_MODE,
-        CMD_Z,
-
-        CMD_LAST
-    };
-
     enum PacketType
     {
         PKT_NONE,
@@ -105,26 +209,52 @@ protected:
         PKT_UNKNOWN
     };
 
-    String m_ssid;
-    String m_passphrase;
+    char m_ssid[33];
+    char m_passphrase[65];
     State m_state = S_STOPPED;
-    WiFiUDP m_udp;
+    OrviboS20Transport *m_udp;
+    OrviboS20WiFiLink *m_wifi;
     CommandId m_current_cmd;
     int m_cmd_retransmit_counter;
-    int m_state_timer;
-    int m_tmo_timer;
-    unsigned long m_last_tick_time = 0;
+    uint32_t m_cmd_timeout_ms;
+    timing_t m_timing;
+    /* millis() deadlines */
+    uint32_t m_state_deadline;
+    uint32_t m_global_deadline;
+
+    /* Networks found by the scan, paired in order */
+    struct target_t
+    {
+        uint8_t bssid[6];
+        int32_t channel;
+    };
+    target_t m_queue[ORVIBO_PAIR_QUEUE_MAX];
+    uint8_t m_queue_count = 0;
+    uint8_t m_queue_pos = 0;
+    bool m_batch = false;
+    unsigned long m_batch_start = 0;
+    batch_result_t m_batch_result = {};
+    OrviboStopReason m_last_failure = REASON_TIMEOUT;
 
     event_callback_t m_found_device_cb = nullptr;
     command_callback_t m_sending_cmd_cb = nullptr;
     stopped_callback_t m_stopped_cb = nullptr;
     event_callback_t m_success_cb = nullptr;
+    device_result_callback_t m_device_result_cb = nullptr;
+    batch_done_callback_t m_batch_done_cb = nullptr;
 
-    void sendString(const char *str);
+    void sendString(const char *str, size_t len);
     void sendCommand(CommandId cmdId);
+    void startCommand(CommandId cmdId);
+    void retransmitCommand();
     PacketType checkRxPacket();
     State enterState(State state);
     State executeState(State state);
+    State nextDevice(OrviboStopReason result);
+    /* Stop without the transport or WiFi link, which have been removed */
+    void stopDetached(OrviboStopReason reason);
+    bool queueNetworks(int count);
+    bool start(const char *ssid, const char *passphrase);
 };
 
 extern OrviboS20WiFiPairClass OrviboS20WiFiPair;